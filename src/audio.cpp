@@ -1,61 +1,366 @@
 #include <cstring>
 #include <atomic>
 #include <cmath>
+#include <climits>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
 
 #include "logging.h"
 #include "miniaudio.h"
 #include "work_queue.h"
 #include "global_constants.h"
+#include "audio_dsp.h"
+#include "audio_resample.h"
+#include "audio_vad.h"
+#include "audio_mel.h"
+#include "audio_config.h"
+#include "spsc_ring.h"
+#include "audio_segment.h"
+#include "rt_check.h"
+#include "utils.h"
 #include "audio.h"
 
-intern constexpr sizet AUDIO_ENTRY_MAX_CHUNK_COUNT = (1000 / AUDIO_CHUNK_DURATION_MS) * AUDIO_ENTRY_MAX_DURATION_S;
-intern constexpr u32 AUDIO_CB_CHUNK_FRAME_COUNT = (AUDIO_SAMPLE_RATE * AUDIO_CHUNK_DURATION_MS) / 1000;
-intern constexpr u32 AUDIO_CB_CHUNK_SAMPLE_COUNT = AUDIO_CB_CHUNK_FRAME_COUNT * AUDIO_CHANNEL_COUNT;
-// Triple buffer the audio
-intern constexpr sizet AUDIO_BUFFER_SAMPLE_COUNT = AUDIO_SAMPLE_RATE * AUDIO_ENTRY_MAX_DURATION_S * 3;
-intern constexpr sizet CONSECUTIVE_SILENT_AUDIO_CHUNK_THRESHOLD = (CONSECUTIVE_SILENT_AUDIO_THRESHOLD_MS / AUDIO_CHUNK_DURATION_MS);
+// Once more than this fraction of the ring is held by unreleased segments, new segments are copied to the segment pool so
+// that slow workers can't starve the capture thread of ring space
+intern constexpr f32 AUDIO_RING_DETACH_FILL = 0.5f;
+intern constexpr audio_pool_empty_policy AUDIO_SEGMENT_POOL_POLICY = AUDIO_POOL_EMPTY_HEAP;
+
+// What the capture thread does when the ring has no room for new samples. The ring never overwrites unconsumed samples,
+// so this only decides which audio is lost.
+enum audio_overflow_policy
+{
+    // Drop incoming blocks that don't fit and end the current segment before them - a new segment starts once there is
+    // room again, so no segment has a gap spliced out of it
+    AUDIO_OVERFLOW_DROP_NEW,
+    // Drop incoming blocks and end the current segment as above, and have the processing thread drop the oldest segments
+    // no worker has started on so the ring frees up
+    AUDIO_OVERFLOW_DROP_OLDEST,
+    // Write what fits and end the current segment there - a new segment starts once there is room
+    AUDIO_OVERFLOW_TRUNCATE
+};
+intern constexpr audio_overflow_policy AUDIO_OVERFLOW_POLICY = AUDIO_OVERFLOW_DROP_OLDEST;
+intern constexpr sizet CONSECUTIVE_SILENT_AUDIO_FRAME_THRESHOLD = (CONSECUTIVE_SILENT_AUDIO_THRESHOLD_MS / AUDIO_VAD_FRAME_DURATION_MS);
+intern constexpr sizet AUDIO_VAD_ATTACK_FRAME_COUNT = (AUDIO_VAD_ATTACK_MS > AUDIO_VAD_FRAME_DURATION_MS) ? AUDIO_VAD_ATTACK_MS / AUDIO_VAD_FRAME_DURATION_MS : 1;
+intern constexpr sizet AUDIO_PREROLL_FRAME_COUNT = (AUDIO_PREROLL_MS + AUDIO_VAD_FRAME_DURATION_MS - 1) / AUDIO_VAD_FRAME_DURATION_MS;
+// Frames kept while not recording - the pre-roll followed by the attack
+intern constexpr sizet AUDIO_HISTORY_FRAME_COUNT = AUDIO_PREROLL_FRAME_COUNT + AUDIO_VAD_ATTACK_FRAME_COUNT;
+intern constexpr u32 AUDIO_SEGMENT_MIN_SPEECH_FRAME_COUNT = AUDIO_SEGMENT_MIN_SPEECH_MS / AUDIO_VAD_FRAME_DURATION_MS;
+intern constexpr sizet AUDIO_SEGMENT_MERGE_GAP_FRAME_COUNT = AUDIO_SEGMENT_MERGE_GAP_MS / AUDIO_VAD_FRAME_DURATION_MS;
+intern constexpr sizet AUDIO_SPLIT_SEARCH_FRAME_COUNT = AUDIO_SPLIT_SEARCH_MS / AUDIO_VAD_FRAME_DURATION_MS;
+
+intern constexpr sizet AUDIO_EVENT_RING_COUNT = 256;
+// File sources decode this many frames at a time, and wait for this much room in each stream's event ring before running
+// a block through - a block can't post more events than that so nothing is dropped however far ahead of the processing
+// thread the decoder gets
+intern constexpr sizet AUDIO_FILE_READ_FRAME_COUNT = 4096;
+intern constexpr sizet AUDIO_FILE_EVENT_SPACE = AUDIO_EVENT_RING_COUNT / 2;
+
+// What the synth source plays, in a loop. The quiet steps are low level noise under the silence threshold and longer than
+// the silence needed to end a segment, so each burst in between becomes its own segment - except for the noise, which
+// stands in for an open squelch and should be rejected by the VAD.
+enum audio_synth_kind
+{
+    AUDIO_SYNTH_QUIET,
+    AUDIO_SYNTH_TONE,
+    AUDIO_SYNTH_NOISE,
+    // The speech sample - its whole length regardless of the step duration, or a tone if it couldn't be loaded
+    AUDIO_SYNTH_SPEECH
+};
+
+struct audio_synth_step
+{
+    audio_synth_kind kind;
+    f32 duration_s;
+    f32 amplitude;
+};
+
+intern constexpr audio_synth_step AUDIO_SYNTH_SCHEDULE[] = {{AUDIO_SYNTH_QUIET, 3.0f, 0.0005f},
+                                                            {AUDIO_SYNTH_TONE, 1.5f, 0.25f},
+                                                            {AUDIO_SYNTH_QUIET, 3.0f, 0.0005f},
+                                                            {AUDIO_SYNTH_SPEECH, 1.5f, 0.25f},
+                                                            {AUDIO_SYNTH_QUIET, 3.0f, 0.0005f},
+                                                            {AUDIO_SYNTH_NOISE, 2.0f, 0.1f}};
+intern constexpr sizet AUDIO_SYNTH_STEP_COUNT = sizeof(AUDIO_SYNTH_SCHEDULE) / sizeof(AUDIO_SYNTH_SCHEDULE[0]);
+intern constexpr cstr AUDIO_SYNTH_SPEECH_FILE = "sample_audio/jfk.mp3";
+intern constexpr f64 AUDIO_SYNTH_TONE_HZ = 440.0;
+// How often the processing thread logs per stream callback load - only checked when there are events to handle
+intern constexpr u64 AUDIO_STREAM_STATS_INTERVAL_NS = 60ull * 1000000000ull;
 
 inline constexpr s32 WAV_HEADER_SIZE = 44;
-intern constexpr s16 MAX_S16 = std::numeric_limits<s16>::max();
-intern constexpr f32 SAMPLE_RMS_DENOM = MAX_S16 * MAX_S16;
 
-struct proc_thread_audio_data
+enum audio_event_type
+{
+    AUDIO_EVENT_RECORDING_START,
+    AUDIO_EVENT_RECORDING_STOP,
+    AUDIO_EVENT_MAX_DURATION,
+    AUDIO_EVENT_SEGMENT_PARTIAL,
+    AUDIO_EVENT_SEGMENT_CLOSED,
+    AUDIO_EVENT_OVERRUN,
+    AUDIO_EVENT_CLIPPING,
+    // Recording didn't start again within AUDIO_SEGMENT_MERGE_GAP_MS of stopping, or the stream was flushed - the last
+    // closed segment won't be merged with the next
+    AUDIO_EVENT_MERGE_WINDOW_CLOSED
+};
+
+// Small fixed size record posted by the audio callback in place of logging, and formatted later by the processing thread
+struct audio_event
 {
-    size_t read_pos;
+    u32 type;
+    // Id and start ring position of the segment being recorded when the event was posted
+    u32 segment_id;
+    u64 segment_start;
+    // Pending ring position when the event was posted - for partial and closed segments this is the segment end
+    u64 ring_pos;
+    // Event specific - dropped samples for overruns, clipped samples for clipping, partial window index for partials,
+    // and number of partial windows for closed segments
+    u64 value;
+    u64 time_ns;
+    // Speech confidence of the segment so far and the number of speech frames in it
+    f32 confidence;
+    u32 speech_frame_count;
+    // Noise floor estimate and speech threshold when the event was posted
+    f32 noise_floor_rms;
+    f32 threshold_rms;
 };
 
 struct snd_thread_audio_data
 {
-    size_t write_pos;
-    size_t consecutive_silent_chunks{};
+    // Accumulates samples from the capture callback until there is a whole VAD frame, for when the capture period isn't
+    // a multiple of the frame length
+    s16 vad_frame[audio_config_max::vad_frame_sample_count];
+    sizet vad_frame_fill;
+    audio_vad vad;
+    // Circular history of the frames since recording last stopped, up to AUDIO_HISTORY_FRAME_COUNT of them. A segment
+    // starts with all of it - the pre-roll and then the attack. Frames go in slot history_next along with their features,
+    // packed back to back at the stream's frame length so runs of them can be written to the ring as they are.
+    s16 history[AUDIO_HISTORY_FRAME_COUNT * audio_config_max::vad_frame_sample_count];
+    audio_frame_features history_features[AUDIO_HISTORY_FRAME_COUNT];
+    sizet history_next;
+    sizet history_count;
+    // Speech frames at the end of the history since the last frame that wasn't - recording starts once there are
+    // AUDIO_VAD_ATTACK_FRAME_COUNT of them
+    sizet attack_frame_count;
+    size_t consecutive_silent_frames{};
     bool recording;
-    s32 buffered_chunk_cnt{};
+    // Current segment - its id and start ring position, and the partial windows published for it so far
+    u32 segment_id;
+    u64 segment_start_pos;
+    u32 segment_partials;
+    u64 last_partial_pos;
+    // Clipped samples in the current segment
+    u64 segment_clip_count;
+    // Sum of the VAD scores of the current segment's frames and the frame count, both as of its last speech frame so the
+    // hangover doesn't count against it
+    f64 segment_score_sum;
+    u32 segment_frame_count;
+    f64 segment_speech_score_sum;
+    u32 segment_speech_frame_count;
+    // Speech frames in the current segment
+    u32 segment_speech_frames;
+    // Frames left before the merge window after the last segment that stopped on silence closes - 0 if it is closed
+    sizet merge_window_frames;
+    // Counters read by the processing thread
+    std::atomic<u64> dropped_events;
+    std::atomic<u64> overruns;
+    std::atomic<u64> dropped_samples;
+    std::atomic<u64> truncated_segments;
+    // Time spent in the capture callback, to measure the per stream processing load
+    std::atomic<u64> callback_count;
+    std::atomic<u64> callback_ns;
+    // VAD frames analyzed and the time spent on them, frames that were speech, frames that were loud enough for the old
+    // energy only VAD but weren't speech, and bursts of speech frames too short to start recording
+    std::atomic<u64> vad_frames;
+    std::atomic<u64> vad_ns;
+    std::atomic<u64> speech_frames;
+    std::atomic<u64> rejected_loud_frames;
+    std::atomic<u64> rejected_attacks;
+    // Loud frames under the noise floor threshold, and the latest noise floor estimate and threshold
+    std::atomic<u64> under_floor_frames;
+    std::atomic<f32> noise_floor_rms;
+    std::atomic<f32> threshold_rms;
 };
 
 struct audio_buffer
 {
-    // Shared buffer in both threads - big enough it shouldnt ever matter
-    s16 *buffer;
-    // Data available for processing - incremented by sound thread and decremented by processing thread
-    std::atomic_size_t available;
-    // Used by processing thread only
-    proc_thread_audio_data proc_data;
+    // Shared ring in both threads - the sound thread writes a segment to the pending region and publishes it once
+    // recording stops. The samples are read in place by the workers, and given back as their segments are released.
+    spsc_ring<s16> ring;
+    // Events from the sound thread, including the position of each partial and closed segment so the processing thread
+    // can hand them out one at a time
+    spsc_ring<audio_event> events;
+    // Last dropped event count reported by the processing thread
+    u64 reported_dropped_events;
+    // Segments dropped by the processing thread to make room after an overrun
+    u64 dropped_segments;
+    audio_overflow_policy overflow_policy;
+    // Publish a partial window of the current segment each time it grows by this many samples - 0 to disable
+    sizet partial_interval_samples;
+    // Segments handed out to the workers - used by the processing and worker threads
+    audio_segment_table segments;
+    // Shared by all streams - bumped each time an event is posted so the processing thread can wait on every stream at
+    // once
+    std::atomic<u32> *event_seq;
+    // Features of each frame in the ring - written by the sound thread along with the samples
+    audio_frame_ring frames;
+    // Log mel frames of the ring - written by the processing thread as samples are published, so by the time a segment
+    // closes only its last window or two is left to compute
+    audio_mel_ring mel_frames;
+    // Used by the processing thread only. mel_next_frame is the next frame to compute, and windows never reach back past
+    // mel_segment_start, the start of the segment it's in.
+    audio_mel mel;
+    u64 mel_next_frame;
+    u64 mel_segment_start;
+    s16 mel_window[audio_config_max::mel_window_sample_count];
+    // Log mel frames computed and the time spent on them, and for closed segments the time from the sound thread closing
+    // them to their last frame being ready and how much of that went to the frames left at close
+    u64 mel_frame_count;
+    u64 mel_ns;
+    u64 mel_closed_segments;
+    u64 mel_ready_ns;
+    u64 mel_close_ns;
     // Used by the sound thread only
     snd_thread_audio_data snd_data;
 };
 
-struct audio_ctxt
+// One radio - a channel of a capture device and its ring, VAD state, and segments
+struct audio_stream
 {
-    ma_log lg;
-    ma_context ctxt;
-    ma_device dev;
+    // Tag for the station the radio is tuned to - segments are named after it
+    cstr station;
+    // Backs generated tags for streams not bound to a station, and streams of sources without devices
+    char station_buf[16];
     audio_buffer data;
+    // Start of the current stats interval and the callback counters at that point - processing thread only
+    u64 stats_time_ns;
+    u64 stats_callback_count;
+    u64 stats_callback_ns;
+    // Segment post processing - processing thread only. A closed segment that stopped on silence is held here until its
+    // merge window closes, and merged with the next segment if that starts recording first.
+    audio_event pending_segment;
+    bool has_pending_segment;
+    // Recording started again inside the pending segment's merge window
+    bool pending_merge;
+    // A recording stop was seen and the segment it ends hasn't closed yet
+    bool stopped_on_silence;
+    // Work the post processing saved the workers - segments dropped for too little speech and their samples, and
+    // segments merged in to the one before
+    u64 short_segments;
+    u64 short_segment_samples;
+    u64 merged_segments;
+};
+
+// A capture device - each of its channels feeds its own stream
+struct audio_device
+{
+    ma_device dev;
+    u32 channel_count;
+    audio_stream *streams[AUDIO_MAX_DEVICE_CHANNEL_COUNT];
+    // Each channel of a multichannel device is split out here before it goes through its stream - sound thread only
+    s16 channel_buf[AUDIO_MAX_DEVICE_CHANNEL_COUNT][audio_config_max::deinterleave_frame_count];
+    // Set when the device captures faster than the pipeline's sample rate - each channel is decimated through its own
+    // resampler in to resample_buf before it goes through its stream
+    bool resample;
+    audio_resampler resamplers[AUDIO_MAX_DEVICE_CHANNEL_COUNT];
+    s16 resample_buf[audio_config_max::deinterleave_frame_count];
+};
+
+// Generates the synth schedule for one channel
+struct audio_synth
+{
+    ma_waveform tone;
+    ma_noise noise;
+    // Shared by every channel - null if the speech sample couldn't be loaded
+    const s16 *speech;
+    sizet speech_frame_count;
+    // Current step and how far in to it we are
+    sizet step;
+    u64 step_frame;
+};
+
+// File and synth sources run a thread that pushes frames through a device's streams in place of a capture device
+struct audio_source
+{
+    audio_source_config cfg;
+    pthread_t thread;
+    bool started;
+    // Set by the source thread once it runs out of audio
+    std::atomic<bool> done;
+    u64 start_ns;
+    // Source thread only until done is set
+    u64 frame_count;
+    sizet file_count;
+    // Periods where a paced synth source woke up more than a period late
+    u64 late_periods;
+    // One per stream
+    audio_synth synth[AUDIO_MAX_CAPTURE_STREAMS];
+    sizet synth_count;
+    s16 *speech;
+    sizet speech_frame_count;
+};
+
+struct audio_batch;
+
+// A batch thread decodes whole files through its own stream, and handles the stream's events and segments itself
+struct audio_batch_worker
+{
+    audio_batch *batch;
+    pthread_t thread;
+    audio_stream stream;
+    // Segments are named after the file they came from
+    char station[NAME_MAX + 1];
 };
 
-struct upload_audio_chunk_data
+// Reprocesses every file in a directory, sharded across threads a file at a time. Finished files are appended to a
+// journal so an interrupted batch picks up where it left off.
+struct audio_batch
 {
-    s16 *pcm_data;
-    sizet sample_count;
+    audio_ctxt *ma;
+    // Resolved with realpath, so the journal lists the same paths however the directory was typed
+    char dir[PATH_MAX];
+    dirent **entries;
+    sizet entry_count;
+    std::atomic<sizet> next_entry;
+    audio_batch_worker *workers;
+    sizet worker_count;
+    // Sorted paths read from the journal, and the journal open for appending
+    char **done_paths;
+    sizet done_count;
+    FILE *journal;
+    pthread_mutex_t journal_mutex;
+    // Progress
+    u64 start_ns;
+    std::atomic<u64> frame_count;
+    std::atomic<sizet> files_done;
+    std::atomic<sizet> files_skipped;
+};
+
+// Entry points of one instantiation of the pipeline
+struct audio_pipeline_ops
+{
+    bool (*init)(audio_ctxt *ma, const audio_source_config &cfg);
+    bool (*init_batch)(audio_ctxt *ma, cstr dir, sizet thread_count);
+    void (*process_available_audio)(audio_ctxt *ma, work_queue *wq);
+    void (*log_source_throughput)(audio_ctxt *ma);
+    void (*wait_batch)(audio_ctxt *ma);
+};
+
+struct audio_ctxt
+{
+    // Instantiation of the pipeline picked at startup
+    const audio_pipeline_ops *pipeline;
+    ma_log lg;
+    ma_context ctxt;
+    audio_source source;
+    audio_batch batch;
+    audio_device devices[AUDIO_MAX_CAPTURE_STREAMS];
+    sizet device_count;
+    audio_stream streams[AUDIO_MAX_CAPTURE_STREAMS];
+    sizet stream_count;
+    // Buffers for segments that can't be read in place from their stream's ring - shared by all streams
+    audio_segment_pool pool;
+    std::atomic<u32> event_seq;
 };
 
 inline sizet wav_pcm_data_size(s32 num_channels, s32 num_samples)
@@ -101,8 +406,9 @@ void write_wav_header(FILE *f, s32 sample_rate, s32 num_channels, s32 num_sample
     fwrite(&data_chunk_size, 4, 1, f);
 }
 
+// Write pcm data that may be split in to two spans (ie read in place from a ring buffer) to a wav file
 template<class T>
-sizet write_wav_to_file(const char *path, const T *pcm_data, s32 sample_rate, s32 num_channels, s32 num_samples)
+sizet write_wav_to_file(const char *path, const ring_view<const T> &pcm, s32 sample_rate, s32 num_channels)
 {
     asrt(path);
     FILE *f = fopen(path, "wb");
@@ -110,13 +416,20 @@ sizet write_wav_to_file(const char *path, const T *pcm_data, s32 sample_rate, s3
         elog("Could not open file %s for writing: %s", path, strerror(errno));
         return 0;
     }
-    write_wav_header<T>(f, sample_rate, num_channels, num_samples);
-    // Write audio data here (for example purposes, we write silence)
-    auto ret = fwrite(pcm_data, sizeof(T), num_samples * num_channels, f);
+    write_wav_header<T>(f, sample_rate, num_channels, ring_view_count(pcm) / num_channels);
+    auto ret = fwrite(pcm.head, sizeof(T), pcm.head_count, f);
+    ret += fwrite(pcm.tail, sizeof(T), pcm.tail_count, f);
     fclose(f);
     return ret;
 }
 
+template<class T>
+sizet write_wav_to_file(const char *path, const T *pcm_data, s32 sample_rate, s32 num_channels, s32 num_samples)
+{
+    ring_view<const T> pcm{pcm_data, (sizet)(num_samples * num_channels), nullptr, 0};
+    return write_wav_to_file(path, pcm, sample_rate, num_channels);
+}
+
 template<class T>
 sizet write_wav_to_buffer(u8 *wav_data_buffer, sizet wav_data_buffer_size, const T *pcm_data, s32 sample_rate, s32 num_channels, s32 num_samples)
 {
@@ -173,234 +486,1971 @@ intern void on_ma_log(void *, u32 level, const char *msg)
     }
 }
 
-intern void stop_recording(snd_thread_audio_data *snd_data)
+// Mean VAD score of the current segment's frames up to its last speech frame
+intern f32 segment_confidence(const snd_thread_audio_data *snd)
 {
-    dlog("Recording stop at write pos %u with %u available chunks", snd_data->write_pos, snd_data->buffered_chunk_cnt);
-    snd_data->recording = false;
+    return snd->segment_speech_frame_count ? (f32)(snd->segment_speech_score_sum / snd->segment_speech_frame_count) : 0.0f;
 }
 
-intern void audio_callback(ma_device *dev, void *output, const void *input, u32 frame_count)
+// Post an event for the processing thread to log. Everything here is real time safe - if the event ring is full the
+// event is counted and dropped.
+intern void post_event_at(audio_buffer *data, u32 type, u64 value, u64 ring_pos)
 {
-    auto ma = (audio_ctxt *)dev->pUserData;
-
-    // Frames are same as sample count since we have mono audio
-    u32 sample_count = frame_count * AUDIO_CHANNEL_COUNT;
-    const s16 *input_f = (const s16 *)input;
-
-    // Calculate our chunk RMS
-    float sample_rms{};
-    for (int i = 0; i < sample_count; ++i) {
-        sample_rms += (input_f[i] * input_f[i] / SAMPLE_RMS_DENOM);
-    }
-    sample_rms = sqrt(sample_rms / sample_count);
-
-    bool update_avail{false};
-    if (sample_rms < AUDIO_SILENT_THRESHOLD_RMS) {
-        ++ma->data.snd_data.consecutive_silent_chunks;
-        // dlog("Increased silence count to %d", ma->data.snd_data.consecutive_silent_chunks);
-        assert(ma->data.snd_data.consecutive_silent_chunks <= CONSECUTIVE_SILENT_AUDIO_CHUNK_THRESHOLD);
-        if (ma->data.snd_data.consecutive_silent_chunks == CONSECUTIVE_SILENT_AUDIO_CHUNK_THRESHOLD) {
-            ma->data.snd_data.consecutive_silent_chunks = 0;
-            if (ma->data.snd_data.recording) {
-                stop_recording(&ma->data.snd_data);
-                dlog("Stopped due to silence");
-                update_avail = true;
-            }
-        }
+    auto snd = &data->snd_data;
+    audio_event ev{type,
+                   snd->segment_id,
+                   snd->segment_start_pos,
+                   ring_pos,
+                   value,
+                   monotonic_time_ns(),
+                   segment_confidence(snd),
+                   snd->segment_speech_frames,
+                   snd->vad.noise_floor.floor_rms,
+                   snd->vad.noise_floor.threshold_rms};
+    if (spsc_ring_write(&data->events, &ev, 1) == 1) {
+        spsc_ring_publish(&data->events);
+        data->event_seq->fetch_add(1, std::memory_order_release);
+        data->event_seq->notify_one();
     }
     else {
-        ma->data.snd_data.consecutive_silent_chunks = 0;
-        if (!ma->data.snd_data.recording) {
-            dlog("Recording start at write pos %u with %u available chunks", ma->data.snd_data.buffered_chunk_cnt);
-            ma->data.snd_data.recording = true;
-        }
+        snd->dropped_events.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+intern void post_event(audio_buffer *data, u32 type, u64 value)
+{
+    post_event_at(data, type, value, data->ring.pending_pos);
+}
+
+// Make the samples recorded so far visible to the processing thread without handing any of them out, and wake it up
+intern void publish_samples(audio_buffer *data)
+{
+    spsc_ring_publish(&data->ring);
+    data->event_seq->fetch_add(1, std::memory_order_release);
+    data->event_seq->notify_one();
+}
+
+intern sizet segment_sample_count(audio_buffer *data)
+{
+    return (sizet)(data->ring.pending_pos - data->snd_data.segment_start_pos);
+}
+
+// Make the samples recorded so far in the current segment visible to the processing thread as a window from the start of
+// the segment
+intern void publish_partial(audio_buffer *data)
+{
+    auto snd = &data->snd_data;
+    spsc_ring_publish(&data->ring);
+    post_event(data, AUDIO_EVENT_SEGMENT_PARTIAL, snd->segment_partials++);
+    snd->last_partial_pos = data->ring.pending_pos;
+}
+
+// Close the current segment at end_pos and make it visible to the processing thread - the next segment starts right after
+// it, with any samples already recorded past end_pos. If the event can't be posted the segment is never handed out, and
+// its ring space is given back with the next segment's.
+intern void close_segment_at(audio_buffer *data, u64 end_pos)
+{
+    auto snd = &data->snd_data;
+    if (snd->segment_clip_count > 0) {
+        post_event_at(data, AUDIO_EVENT_CLIPPING, snd->segment_clip_count, end_pos);
+        snd->segment_clip_count = 0;
+    }
+    spsc_ring_publish(&data->ring);
+    post_event_at(data, AUDIO_EVENT_SEGMENT_CLOSED, snd->segment_partials, end_pos);
+    ++snd->segment_id;
+    snd->segment_start_pos = end_pos;
+    snd->last_partial_pos = end_pos;
+    snd->segment_partials = 0;
+    snd->segment_score_sum = 0.0;
+    snd->segment_frame_count = 0;
+    snd->segment_speech_score_sum = 0.0;
+    snd->segment_speech_frame_count = 0;
+    snd->segment_speech_frames = 0;
+}
+
+intern void close_segment(audio_buffer *data)
+{
+    close_segment_at(data, data->ring.pending_pos);
+}
+
+intern void record_overrun(audio_buffer *data, sizet dropped)
+{
+    data->snd_data.overruns.fetch_add(1, std::memory_order_relaxed);
+    data->snd_data.dropped_samples.fetch_add(dropped, std::memory_order_relaxed);
+    post_event(data, AUDIO_EVENT_OVERRUN, dropped);
+}
+
+// Append frame_count frames and their features to the pending region - the caller has made sure there is space
+template<class C>
+intern void write_frames(audio_buffer *data, const s16 *samples, const audio_frame_features *features, sizet frame_count)
+{
+    u64 first_frame = data->ring.pending_pos / C::vad_frame_sample_count;
+    for (sizet i = 0; i < frame_count; ++i) {
+        *audio_frame_ring_at(&data->frames, first_frame + i) = features[i];
+    }
+    sizet written = spsc_ring_write(&data->ring, samples, frame_count * C::vad_frame_sample_count);
+    asrt(written == frame_count * C::vad_frame_sample_count);
+}
+
+// Add a frame written to the current segment to its totals - clipping counts for every frame, but only scored frames count
+// towards the confidence and the speech frames
+intern void count_segment_frame(snd_thread_audio_data *snd, const audio_frame_features &features, bool scored)
+{
+    snd->segment_clip_count += features.clip_count;
+    if (!scored) {
+        return;
+    }
+    snd->segment_score_sum += features.score;
+    ++snd->segment_frame_count;
+    if (features.flags & AUDIO_FRAME_SPEECH) {
+        snd->segment_speech_score_sum = snd->segment_score_sum;
+        snd->segment_speech_frame_count = snd->segment_frame_count;
+        ++snd->segment_speech_frames;
+    }
+}
+
+// Write frame_count VAD frames and their features to the current segment, closing the segment each time it reaches the
+// max duration, and return how many were written. Only whole frames go in to the ring, even when truncating, so the
+// features stay in lockstep with it. Frames from first_scored on are scored (see count_segment_frame), and each frame is
+// counted in the segment it was written to. Frames that don't fit are dropped and the segment is closed before the gap, so
+// the audio after it starts a new segment instead of being spliced on to this one.
+template<class C>
+intern sizet record_frames(audio_buffer *data,
+                           const s16 *samples,
+                           const audio_frame_features *features,
+                           sizet frame_count,
+                           sizet first_scored)
+{
+    // Space only grows while we write, so it's enough to check it once
+    sizet space_frames = spsc_ring_write_space(&data->ring) / C::vad_frame_sample_count;
+    // Unless we are truncating, only whole blocks go in to a segment
+    if (data->overflow_policy != AUDIO_OVERFLOW_TRUNCATE && space_frames < frame_count) {
+        space_frames = 0;
     }
 
-    if (ma->data.snd_data.recording) {
-        auto write_buffer = ma->data.buffer + ma->data.snd_data.write_pos;
-        size_t in_buf_cpy_offset{};
-        size_t new_pos = ma->data.snd_data.write_pos + sample_count;
-        if (new_pos >= AUDIO_BUFFER_SAMPLE_COUNT) {
-            auto in_buf_cpy_offset = (AUDIO_BUFFER_SAMPLE_COUNT - ma->data.snd_data.write_pos);
-            memcpy(write_buffer, input, in_buf_cpy_offset * sizeof(s16));
-            write_buffer = ma->data.buffer;
-            new_pos -= AUDIO_BUFFER_SAMPLE_COUNT;
+    sizet total_written{};
+    while (frame_count > 0) {
+        sizet seg_space = (C::entry_max_sample_count - segment_sample_count(data)) / C::vad_frame_sample_count;
+        sizet to_write = (frame_count < seg_space) ? frame_count : seg_space;
+        sizet written = (to_write < space_frames) ? to_write : space_frames;
+        write_frames<C>(data, samples, features, written);
+        for (sizet i = 0; i < written; ++i) {
+            count_segment_frame(&data->snd_data, features[i], total_written + i >= first_scored);
         }
-        else if (new_pos == AUDIO_BUFFER_SAMPLE_COUNT) {
-            new_pos = 0;
+        space_frames -= written;
+        total_written += written;
+        if (written < to_write) {
+            record_overrun(data, (frame_count - written) * C::vad_frame_sample_count);
+            if (segment_sample_count(data) > 0) {
+                data->snd_data.truncated_segments.fetch_add(1, std::memory_order_relaxed);
+                close_segment(data);
+            }
+            return total_written;
         }
-        memcpy(write_buffer, input_f + in_buf_cpy_offset, (sample_count - in_buf_cpy_offset) * sizeof(s16));
-        ++ma->data.snd_data.buffered_chunk_cnt;
-        ma->data.snd_data.write_pos = new_pos;
-        // dlog("Recorded chunk resulting in write pos %u", ma->data.snd_data.buffered_chunk_cnt);
-        assert(ma->data.snd_data.buffered_chunk_cnt <= AUDIO_ENTRY_MAX_CHUNK_COUNT);
-        if (ma->data.snd_data.buffered_chunk_cnt == AUDIO_ENTRY_MAX_CHUNK_COUNT) {
-            stop_recording(&ma->data.snd_data);
-            dlog("Stopped due to threshold");
-            update_avail = true;
+        samples += written * C::vad_frame_sample_count;
+        features += written;
+        frame_count -= written;
+        if (segment_sample_count(data) == C::entry_max_sample_count) {
+            post_event(data, AUDIO_EVENT_MAX_DURATION, C::entry_max_sample_count);
+            close_segment(data);
         }
     }
+    return total_written;
+}
 
-    if (update_avail) {
-        auto res = std::atomic_fetch_add(&ma->data.available, ma->data.snd_data.buffered_chunk_cnt);
-        std::atomic_notify_one(&ma->data.available);
-        dlog("Updating available chunk count from %lu to %lu", res, res + ma->data.snd_data.buffered_chunk_cnt);
-        ma->data.snd_data.buffered_chunk_cnt = 0;
+// Forget the speech frames counted towards the attack - they were a burst too short to be speech, and stay in the history
+// as pre-roll
+intern void reset_attack(snd_thread_audio_data *snd)
+{
+    if (snd->attack_frame_count > 0) {
+        snd->rejected_attacks.fetch_add(1, std::memory_order_relaxed);
     }
+    snd->attack_frame_count = 0;
 }
 
-intern void upload_audio_chunk_with_meta(void *arg)
+intern void reset_history(snd_thread_audio_data *snd)
 {
-    auto chunk_data = (upload_audio_chunk_data *)arg;
-    char fname[16]{};
-    static int chunks = 0;
-    sprintf(fname, "chunk_%d.wav", chunks++);
-    write_wav_to_file(fname, chunk_data->pcm_data, AUDIO_SAMPLE_RATE, AUDIO_CHANNEL_COUNT, chunk_data->sample_count);
-    ilog("Saving %lu sample audio chunk to %s", chunk_data->sample_count, fname);
-    free(chunk_data->pcm_data);
-    free(chunk_data);
+    snd->history_next = 0;
+    snd->history_count = 0;
+    snd->attack_frame_count = 0;
 }
 
-void process_available_audio(audio_ctxt *ma, work_queue *wq)
+template<class C>
+intern void push_history(snd_thread_audio_data *snd, const s16 *samples, const audio_frame_features &features)
+{
+    memcpy(snd->history + snd->history_next * C::vad_frame_sample_count, samples, C::vad_frame_sample_count * sizeof(s16));
+    snd->history_features[snd->history_next] = features;
+    snd->history_next = (snd->history_next + 1) % AUDIO_HISTORY_FRAME_COUNT;
+    if (snd->history_count < AUDIO_HISTORY_FRAME_COUNT) {
+        ++snd->history_count;
+    }
+}
+
+// Start the segment with the whole history, oldest frame first. The history is written straight to the ring as at most
+// two runs of frames, so nothing is copied on the way. Only the attack at the end of the history is scored - the pre-roll
+// is there for context.
+template<class C>
+intern void record_history(audio_buffer *data)
 {
-    std::atomic_wait(&ma->data.available, 0);
-    size_t avail_chunks = std::atomic_load(&ma->data.available);
-    asrt(avail_chunks > 0);
+    auto snd = &data->snd_data;
+    sizet first = (snd->history_next + AUDIO_HISTORY_FRAME_COUNT - snd->history_count) % AUDIO_HISTORY_FRAME_COUNT;
+    sizet head_count = AUDIO_HISTORY_FRAME_COUNT - first;
+    head_count = (snd->history_count < head_count) ? snd->history_count : head_count;
+    sizet first_scored = snd->history_count - snd->attack_frame_count;
+    sizet written = record_frames<C>(
+        data, snd->history + first * C::vad_frame_sample_count, &snd->history_features[first], head_count, first_scored);
+    // The rest of the history only follows on if the first run went in whole
+    if (written == head_count && head_count < snd->history_count) {
+        record_frames<C>(data,
+                         snd->history,
+                         &snd->history_features[0],
+                         snd->history_count - head_count,
+                         (first_scored > head_count) ? first_scored - head_count : 0);
+    }
+}
 
-    auto chunk_data = (upload_audio_chunk_data *)calloc(1, sizeof(upload_audio_chunk_data));
-    chunk_data->sample_count = avail_chunks * AUDIO_CB_CHUNK_SAMPLE_COUNT;
-    chunk_data->pcm_data = (s16 *)calloc(1, chunk_data->sample_count * sizeof(s16));
+// Cut the segment at the start of the quietest frame in the last AUDIO_SPLIT_SEARCH_MS instead of wherever the max
+// duration falls, going by the frame features already in the ring. The frames after the cut are already in the ring right
+// after it, so they become the start of the next segment as they are - only their VAD totals move over. Frames a partial
+// window has covered stay in this segment. Returns false if there is nowhere to cut, and the segment is cut at the max
+// duration as before.
+template<class C>
+intern bool split_segment(audio_buffer *data)
+{
+    auto snd = &data->snd_data;
+    u64 end_frame = data->ring.pending_pos / C::vad_frame_sample_count;
+    u64 first_frame = snd->segment_start_pos / C::vad_frame_sample_count + 1;
+    u64 partial_frame = (snd->last_partial_pos + C::vad_frame_sample_count - 1) / C::vad_frame_sample_count;
+    first_frame = (partial_frame > first_frame) ? partial_frame : first_frame;
+    if (end_frame > AUDIO_SPLIT_SEARCH_FRAME_COUNT && end_frame - AUDIO_SPLIT_SEARCH_FRAME_COUNT > first_frame) {
+        first_frame = end_frame - AUDIO_SPLIT_SEARCH_FRAME_COUNT;
+    }
+    if (first_frame >= end_frame) {
+        return false;
+    }
 
-    // Get the end position of the read buffer - if its past the end of the audio circular buffer (>
-    // AUDIO_BUFFER_SAMPLE_COUNT) then we copy the chunk at the end of the buffer first, then copy the chunk from the
-    // start of the buffer to the recalculated end pos..
-    size_t read_buf_end_pos = ma->data.proc_data.read_pos + chunk_data->sample_count;
-    auto dest_buf = chunk_data->pcm_data;
-    if (read_buf_end_pos > AUDIO_BUFFER_SAMPLE_COUNT) {
-        // Copy the end chunk of the audio buffer
-        auto read_buf_partial_sz = (AUDIO_BUFFER_SAMPLE_COUNT - ma->data.proc_data.read_pos);
-        ilog("Copying %u samples from audio (%u offset) to pcm buffer", read_buf_partial_sz, ma->data.proc_data.read_pos);
-        memcpy(chunk_data->pcm_data, ma->data.buffer + ma->data.proc_data.read_pos, read_buf_partial_sz * sizeof(s16));
+    // Ties go to the later frame to keep the segment as long as possible
+    u64 cut_frame = first_frame;
+    for (u64 f = first_frame + 1; f < end_frame; ++f) {
+        if (audio_frame_ring_at(&data->frames, f)->rms <= audio_frame_ring_at(&data->frames, cut_frame)->rms) {
+            cut_frame = f;
+        }
+    }
 
-        // Now set the read pos to the start of the cirular buffer, and recalculate the end pos. We also adjust the dest
-        // buffer to account for the samples we just wrote to it
-        ma->data.proc_data.read_pos = 0;
-        read_buf_end_pos -= AUDIO_BUFFER_SAMPLE_COUNT;
-        dest_buf += read_buf_partial_sz;
+    // Totals of the frames after the cut, as they will be for the next segment
+    u64 clip_count{};
+    f64 score_sum{};
+    u32 frame_count{};
+    f64 speech_score_sum{};
+    u32 speech_frame_count{};
+    u32 speech_frames{};
+    for (u64 f = cut_frame; f < end_frame; ++f) {
+        auto frame = audio_frame_ring_at(&data->frames, f);
+        clip_count += frame->clip_count;
+        score_sum += frame->score;
+        ++frame_count;
+        if (frame->flags & AUDIO_FRAME_SPEECH) {
+            speech_score_sum = score_sum;
+            speech_frame_count = frame_count;
+            ++speech_frames;
+        }
     }
-    ilog("Copying %u samples from audio (%u read_pos) to pcm buffer (offset %u)",
-         (read_buf_end_pos - ma->data.proc_data.read_pos),
-         ma->data.proc_data.read_pos,
-         dest_buf - chunk_data->pcm_data);
-    memcpy(dest_buf, ma->data.buffer + ma->data.proc_data.read_pos, (read_buf_end_pos - ma->data.proc_data.read_pos) * sizeof(s16));
-    // If read_buf_end_pos is AUDIO_BUFFER_SAMPLE_COUNT, it will be correctly handled on the next set of samples.. the first
-    // partial memcpy would just copy 0 bytes as read_buf_partial_sz would calculate to 0
-    ma->data.proc_data.read_pos = read_buf_end_pos;
 
-    auto res = std::atomic_fetch_sub(&ma->data.available, avail_chunks); // update available frames
-    ilog("Updating available chunk count from %lu to %lu", res, res - avail_chunks);
+    snd->segment_clip_count -= clip_count;
+    snd->segment_score_sum -= score_sum;
+    snd->segment_frame_count -= frame_count;
+    snd->segment_speech_frames -= speech_frames;
+    // If the last speech frame was after the cut, every frame before it counts towards the confidence
+    if (snd->segment_speech_frame_count > snd->segment_frame_count) {
+        snd->segment_speech_score_sum = snd->segment_score_sum;
+        snd->segment_speech_frame_count = snd->segment_frame_count;
+    }
+    u64 cut_pos = cut_frame * C::vad_frame_sample_count;
+    post_event_at(data, AUDIO_EVENT_MAX_DURATION, cut_pos - snd->segment_start_pos, cut_pos);
+    close_segment_at(data, cut_pos);
 
-    enqueue_task(wq, {upload_audio_chunk_with_meta, chunk_data});
+    snd->segment_clip_count = clip_count;
+    snd->segment_score_sum = score_sum;
+    snd->segment_frame_count = frame_count;
+    snd->segment_speech_score_sum = speech_score_sum;
+    snd->segment_speech_frame_count = speech_frame_count;
+    snd->segment_speech_frames = speech_frames;
+    return true;
 }
 
-bool audio_init(audio_ctxt *ma)
+intern audio_frame_features frame_features(const audio_vad_frame &vf)
 {
-    ilog("Initializing audio");
-    ma_result result = ma_log_init(nullptr, &ma->lg);
-    if (result != MA_SUCCESS) {
-        wlog("Failed to initialize log: %s", ma_result_description(result));
-        return false;
+    audio_frame_features features{};
+    features.rms = vf.rms;
+    features.score = vf.score;
+    features.peak = (u16)((vf.feat.peak > 32767) ? 32767 : vf.feat.peak);
+    features.zero_crossings = (u16)vf.feat.zero_crossings;
+    features.clip_count = (u16)vf.feat.clip_count;
+    features.flags = (vf.loud ? AUDIO_FRAME_LOUD : 0) | (vf.above_floor ? AUDIO_FRAME_ABOVE_FLOOR : 0) |
+                     (vf.speech ? AUDIO_FRAME_SPEECH : 0);
+    return features;
+}
+
+// Make the speech/silence decision for one VAD frame and record it if we are recording
+template<class C>
+intern void process_vad_frame(audio_buffer *data, const s16 *samples)
+{
+    auto snd = &data->snd_data;
+
+    u64 start_ns = monotonic_time_ns();
+    audio_vad_frame vf;
+    audio_vad_analyze(&snd->vad, samples, &vf);
+    snd->vad_ns.fetch_add(monotonic_time_ns() - start_ns, std::memory_order_relaxed);
+    snd->vad_frames.fetch_add(1, std::memory_order_relaxed);
+    if (vf.speech) {
+        snd->speech_frames.fetch_add(1, std::memory_order_relaxed);
     }
-    ma_log_callback cb{};
-    cb.onLog = on_ma_log;
-    ma_log_register_callback(&ma->lg, cb);
+    else if (vf.loud) {
+        snd->rejected_loud_frames.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (vf.loud && !vf.above_floor) {
+        snd->under_floor_frames.fetch_add(1, std::memory_order_relaxed);
+    }
+    snd->noise_floor_rms.store(vf.noise_floor_rms, std::memory_order_relaxed);
+    snd->threshold_rms.store(vf.threshold_rms, std::memory_order_relaxed);
+    audio_frame_features features = frame_features(vf);
 
-    ma_context_config ccfg{};
-    ccfg.pLog = &ma->lg;
+    bool stopped{false};
+    if (!vf.speech) {
+        reset_attack(snd);
+        ++snd->consecutive_silent_frames;
+        assert(snd->consecutive_silent_frames <= CONSECUTIVE_SILENT_AUDIO_FRAME_THRESHOLD);
+        if (snd->consecutive_silent_frames == CONSECUTIVE_SILENT_AUDIO_FRAME_THRESHOLD) {
+            snd->consecutive_silent_frames = 0;
+            if (snd->recording) {
+                post_event(data, AUDIO_EVENT_RECORDING_STOP, segment_sample_count(data));
+                snd->recording = false;
+                snd->merge_window_frames = AUDIO_SEGMENT_MERGE_GAP_FRAME_COUNT;
+                stopped = true;
+            }
+        }
+    }
+    else {
+        snd->consecutive_silent_frames = 0;
+        if (!snd->recording) {
+            // Count speech frames towards the attack until there have been enough in a row
+            ++snd->attack_frame_count;
+        }
+    }
 
-    result = ma_context_init(NULL, 0, &ccfg, &ma->ctxt);
-    if (result != MA_SUCCESS) {
-        wlog("Could not initialize audio context - err: %s", ma_result_description(result));
-        ma_log_uninit(&ma->lg);
-        return false;
+    if (snd->recording) {
+        if (segment_sample_count(data) + C::vad_frame_sample_count >= C::entry_max_sample_count) {
+            split_segment<C>(data);
+        }
+        record_frames<C>(data, samples, &features, 1, 0);
+    }
+    else {
+        push_history<C>(snd, samples, features);
+        if (snd->merge_window_frames > 0 && --snd->merge_window_frames == 0) {
+            post_event(data, AUDIO_EVENT_MERGE_WINDOW_CLOSED, 0);
+        }
+        if (snd->attack_frame_count == AUDIO_VAD_ATTACK_FRAME_COUNT) {
+            post_event(data, AUDIO_EVENT_RECORDING_START, snd->history_count * C::vad_frame_sample_count);
+            snd->recording = true;
+            record_history<C>(data);
+            snd->merge_window_frames = 0;
+            reset_history(snd);
+        }
     }
-    ilog("Selected audio backend: %s", ma_get_backend_name(ma->ctxt.backend));
 
-    ma_device_info *dev_infos;
-    ma_uint32 dev_cnt;
-    ma_device_info *capture_infos;
-    u32 capture_dev_cnt;
-    result = ma_context_get_devices(&ma->ctxt, &dev_infos, &dev_cnt, &capture_infos, &capture_dev_cnt);
-    if (result != MA_SUCCESS) {
-        wlog("Could not list audio devices: %s", ma_result_description(result));
-        audio_terminate(ma);
-        return false;
+    if (stopped && segment_sample_count(data) > 0) {
+        close_segment(data);
+    }
+    else if (snd->recording && data->partial_interval_samples > 0 &&
+             data->ring.pending_pos - snd->last_partial_pos >= data->partial_interval_samples) {
+        publish_partial(data);
+    }
+    else if (snd->recording && spsc_ring_pending(&data->ring) >= C::publish_sample_count) {
+        publish_samples(data);
+    }
+}
+
+// Run sample_count mono samples through a stream's VAD
+template<class C>
+intern void process_stream_samples(audio_stream *stream, const s16 *samples, sizet sample_count)
+{
+    u64 start_ns = monotonic_time_ns();
+    auto data = &stream->data;
+    auto snd = &data->snd_data;
+
+    // Whole frames are processed straight from the input, and only the leftovers that don't make a whole frame are copied
+    // to the accumulator - so any frame count from miniaudio works
+    while (sample_count > 0) {
+        if (snd->vad_frame_fill == 0 && sample_count >= C::vad_frame_sample_count) {
+            process_vad_frame<C>(data, samples);
+            samples += C::vad_frame_sample_count;
+            sample_count -= C::vad_frame_sample_count;
+            continue;
+        }
+        sizet to_copy = C::vad_frame_sample_count - snd->vad_frame_fill;
+        to_copy = (sample_count < to_copy) ? sample_count : to_copy;
+        memcpy(snd->vad_frame + snd->vad_frame_fill, samples, to_copy * sizeof(s16));
+        snd->vad_frame_fill += to_copy;
+        samples += to_copy;
+        sample_count -= to_copy;
+        if (snd->vad_frame_fill == C::vad_frame_sample_count) {
+            process_vad_frame<C>(data, snd->vad_frame);
+            snd->vad_frame_fill = 0;
+        }
+    }
+    snd->callback_count.fetch_add(1, std::memory_order_relaxed);
+    snd->callback_ns.fetch_add(monotonic_time_ns() - start_ns, std::memory_order_relaxed);
+}
+
+// Run frame_count frames from a device through its streams - mono devices at the pipeline's rate go straight through,
+// otherwise split the channels out and decimate them a block at a time and run each through its own stream
+template<class C>
+intern void process_device_frames(audio_device *device, const s16 *frames, sizet frame_count)
+{
+    if (C::device_channel_count == 1 && !device->resample) {
+        process_stream_samples<C>(device->streams[0], frames, frame_count);
+        return;
     }
 
-    // Print out each device info and save the index of the USB device associated with what we want
-    s32 our_dev_ind{-1};
-    for (s32 devi = 0; devi < dev_cnt; devi += 1) {
-        if (ma->ctxt.backend == ma_backend_alsa) {
-            ilog("%d: %s : %s", devi, dev_infos[devi].name, dev_infos[devi].id.alsa);
-            if (strstr(dev_infos[devi].name, "USB Audio CODEC")) {
-                our_dev_ind = devi;
+    s16 *channels[C::device_channel_count];
+    for (u32 ch = 0; ch < C::device_channel_count; ++ch) {
+        channels[ch] = device->channel_buf[ch];
+    }
+    while (frame_count > 0) {
+        sizet block = (frame_count < C::deinterleave_frame_count) ? frame_count : C::deinterleave_frame_count;
+        if (C::device_channel_count > 1) {
+            audio_deinterleave(frames, block, C::device_channel_count, channels);
+        }
+        for (u32 ch = 0; ch < C::device_channel_count; ++ch) {
+            const s16 *samples = (C::device_channel_count > 1) ? channels[ch] : frames;
+            sizet sample_count = block;
+            // Decimating never produces more samples than went in, so a block always fits
+            if (device->resample) {
+                sample_count = audio_resample(&device->resamplers[ch], samples, block, device->resample_buf);
+                samples = device->resample_buf;
             }
+            process_stream_samples<C>(device->streams[ch], samples, sample_count);
         }
-        else if (ma->ctxt.backend == ma_backend_pulseaudio) {
-            ilog("%d: %s : %s", devi, dev_infos[devi].name, dev_infos[devi].id.pulse);
+        frames += block * C::device_channel_count;
+        frame_count -= block;
+    }
+}
+
+// Runs on the real time audio thread - no logging, locking, or allocating in here or anything it calls. Post an event
+// instead.
+template<class C>
+intern void audio_callback(ma_device *dev, void *output, const void *input, u32 frame_count)
+{
+    rt_scope_begin();
+    process_device_frames<C>((audio_device *)dev->pUserData, (const s16 *)input, frame_count);
+    rt_scope_end();
+}
+
+// Peak level and share of speech frames of a segment, from its frame features rather than its samples
+intern void segment_frame_stats(const audio_segment *seg, f32 *peak_dbfs, f32 *speech_fraction)
+{
+    u16 peak{};
+    sizet speech{};
+    const audio_frame_features *spans[] = {seg->frames.head, seg->frames.tail};
+    sizet counts[] = {seg->frames.head_count, seg->frames.tail_count};
+    for (sizet s = 0; s < 2; ++s) {
+        for (sizet i = 0; i < counts[s]; ++i) {
+            peak = (spans[s][i].peak > peak) ? spans[s][i].peak : peak;
+            speech += (spans[s][i].flags & AUDIO_FRAME_SPEECH) != 0;
         }
-        else if (ma->ctxt.backend == ma_backend_jack) {
-            ilog("%d: %s : %d", devi, dev_infos[devi].name, dev_infos[devi].id.jack);
+    }
+    *peak_dbfs = (peak > 0) ? 20.0f * log10f(peak / 32768.0f) : -INFINITY;
+    *speech_fraction = seg->frame_count ? (f32)speech / seg->frame_count : 0.0f;
+}
+
+intern constexpr cstr SEGMENT_FILE_PREFIX = "chunk_";
+intern constexpr cstr SEGMENT_FILE_EXT = ".wav";
+
+// Name the wav file of a segment in to fname - false if the name would be truncated, which happens with stations named
+// after long archive files. The id, and the part of partial windows, always end the name, so different stations can't
+// name a file the same.
+intern bool segment_file_name(char (&fname)[NAME_MAX + 1], cstr station, u32 id, bool partial, u32 part)
+{
+    int len{};
+    if (partial) {
+        len = snprintf(fname, sizeof(fname), "%s%s_%u_part%u%s", SEGMENT_FILE_PREFIX, station, id, part, SEGMENT_FILE_EXT);
+    }
+    else {
+        len = snprintf(fname, sizeof(fname), "%s%s_%u%s", SEGMENT_FILE_PREFIX, station, id, SEGMENT_FILE_EXT);
+    }
+    return len >= 0 && (sizet)len < sizeof(fname);
+}
+
+// Whether name looks like a file segment_file_name made
+intern bool is_segment_file_name(cstr name)
+{
+    sizet len = strlen(name);
+    sizet prefix_len = strlen(SEGMENT_FILE_PREFIX);
+    sizet ext_len = strlen(SEGMENT_FILE_EXT);
+    return len > prefix_len + ext_len && strncmp(name, SEGMENT_FILE_PREFIX, prefix_len) == 0 &&
+           strcmp(name + len - ext_len, SEGMENT_FILE_EXT) == 0;
+}
+
+template<class C>
+intern void upload_audio_chunk_with_meta(void *arg)
+{
+    auto seg = (audio_segment *)arg;
+    if (!audio_segment_begin(seg)) {
+        ilog("Skipping dropped segment %s/%u", seg->station, seg->id);
+        audio_segment_release(seg);
+        return;
+    }
+    dlog("Starting segment %s/%u %.1f ms after it was published", seg->station, seg->id, (monotonic_time_ns() - seg->publish_ns) / 1000000.0);
+    char fname[NAME_MAX + 1];
+    if (!segment_file_name(fname, seg->station, seg->id, seg->partial, seg->part)) {
+        elog("Dropping segment %s/%u - its file name would be longer than %d characters", seg->station, seg->id, NAME_MAX);
+        audio_segment_release(seg);
+        return;
+    }
+    write_wav_to_file(fname, seg->pcm, C::sample_rate, AUDIO_CHANNEL_COUNT);
+    f32 peak_dbfs;
+    f32 speech_fraction;
+    segment_frame_stats(seg, &peak_dbfs, &speech_fraction);
+    ilog("Saving %lu sample audio chunk with speech confidence %.2f (peak %.1f dBFS, %.0f%% speech frames) to %s",
+         seg->sample_count,
+         seg->confidence,
+         peak_dbfs,
+         100.0f * speech_fraction,
+         fname);
+    audio_segment_release(seg);
+}
+
+template<class C>
+intern void hand_off_segment(audio_ctxt *ma, audio_stream *stream, work_queue *wq, const audio_event &ev)
+{
+    // Keep the start of a segment that is still being streamed in the ring until it's closed, even if all of its partial
+    // windows have been released - the hold is only dropped once the closed segment holds its own reference
+    auto data = &stream->data;
+    bool partial = (ev.type == AUDIO_EVENT_SEGMENT_PARTIAL);
+    if (partial) {
+        audio_segment_table_set_hold(&data->segments, ev.segment_start);
+    }
+
+    // The worker reads the samples straight out of the ring and releases the segment when it's done with them. If the
+    // segment wraps in an unmirrored ring, or the ring is filling up with segments the workers haven't gotten to, copy it
+    // to the pool instead so the worker gets contiguous samples and the ring space is freed now.
+    auto seg = audio_segment_create(&data->segments, ev.segment_id, ev.segment_start, ev.ring_pos);
+    seg->partial = partial;
+    seg->part = (u32)ev.value;
+    seg->station = stream->station;
+    seg->publish_ns = ev.time_ns;
+    seg->confidence = ev.confidence;
+    if (partial) {
+        u64 first_mel_frame = ev.segment_start / C::mel_hop_sample_count;
+        sizet mel_ready = (data->mel_next_frame > first_mel_frame) ? (sizet)(data->mel_next_frame - first_mel_frame) : 0;
+        if (mel_ready < seg->mel_frame_count) {
+            seg->mel_frame_count = mel_ready;
+            seg->mel = audio_mel_ring_view(&data->mel_frames, first_mel_frame, mel_ready);
         }
-        else {
-            ilog("%d - %s", devi, dev_infos[devi].name);
-        }
-    }
-    if (our_dev_ind != -1) {
-        ma_device_config config = ma_device_config_init(ma_device_type_capture);
-        config.capture.pDeviceID = &dev_infos[our_dev_ind].id;
-        config.capture.format = ma_format_s16;
-        config.capture.channels = AUDIO_CHANNEL_COUNT;
-        config.sampleRate = AUDIO_SAMPLE_RATE;
-        config.periodSizeInFrames = AUDIO_CB_CHUNK_FRAME_COUNT;
-        config.dataCallback = audio_callback;
-        config.pUserData = ma;
-
-        ma_result result = ma_device_init(&ma->ctxt, &config, &ma->dev);
-        if (result != MA_SUCCESS) {
-            wlog("Could not initialize audio device %s: %s", dev_infos[our_dev_ind].name, ma_result_description(result));
-            audio_terminate(ma);
-            return false;
+    }
+    else {
+        audio_segment_table_set_hold(&data->segments, INVALID_IND);
+    }
+    auto ring = &data->ring;
+    sizet ring_used = (sizet)(ring->write_pos.load(std::memory_order_relaxed) - ring->read_pos.load(std::memory_order_relaxed));
+    if (seg->pcm.tail_count > 0 || ring_used > ring->capacity * AUDIO_RING_DETACH_FILL) {
+        dlog("Detaching segment %s/%u with ring %lu/%lu samples used", stream->station, seg->id, ring_used, ring->capacity);
+        seg = audio_segment_detach(&ma->pool, seg);
+    }
+    ilog("Handing off %s segment %s/%u/%u with %lu samples (%lu head %lu tail) at ring pos %lu - speech confidence %.2f",
+         seg->partial ? "partial" : "closed",
+         seg->station,
+         seg->id,
+         seg->part,
+         seg->sample_count,
+         seg->pcm.head_count,
+         seg->pcm.tail_count,
+         seg->start_pos,
+         seg->confidence);
+    // Batch threads have no work queue and handle their segments themselves
+    if (wq) {
+        enqueue_task(wq, {upload_audio_chunk_with_meta<C>, seg});
+    }
+    else {
+        upload_audio_chunk_with_meta<C>(seg);
+    }
+}
+
+// Hand off the held segment, unless it has too little speech to be worth transcribing in which case its ring space is
+// given back without a worker ever seeing it
+template<class C>
+intern void finish_pending_segment(audio_ctxt *ma, audio_stream *stream, work_queue *wq)
+{
+    if (!stream->has_pending_segment) {
+        return;
+    }
+    stream->has_pending_segment = false;
+    stream->pending_merge = false;
+    const audio_event &ev = stream->pending_segment;
+    if (ev.speech_frame_count >= AUDIO_SEGMENT_MIN_SPEECH_FRAME_COUNT) {
+        hand_off_segment<C>(ma, stream, wq, ev);
+        return;
+    }
+    sizet sample_count = (sizet)(ev.ring_pos - ev.segment_start);
+    ++stream->short_segments;
+    stream->short_segment_samples += sample_count;
+    audio_segment_table_skip(&stream->data.segments, ev.ring_pos);
+    ilog("Dropping segment %s/%u with %lu samples - only %u ms of speech",
+         stream->station,
+         ev.segment_id,
+         sample_count,
+         ev.speech_frame_count * AUDIO_VAD_FRAME_DURATION_MS);
+}
+
+// Sits between the ring and the workers - closed segments are merged with the one before them if they started recording
+// within its merge window, and held back until their own merge window closes. Streamed segments have already had partial
+// windows handed out so they go straight through.
+template<class C>
+intern void post_process_segment(audio_ctxt *ma, audio_stream *stream, work_queue *wq, const audio_event &ev)
+{
+    bool stopped_on_silence = stream->stopped_on_silence;
+    stream->stopped_on_silence = false;
+    if (ev.type == AUDIO_EVENT_SEGMENT_PARTIAL || ev.value > 0) {
+        finish_pending_segment<C>(ma, stream, wq);
+        hand_off_segment<C>(ma, stream, wq, ev);
+        return;
+    }
+
+    auto pending = &stream->pending_segment;
+    if (stream->has_pending_segment && stream->pending_merge && pending->ring_pos == ev.segment_start &&
+        ev.ring_pos - pending->segment_start <= C::entry_max_sample_count) {
+        u32 speech_frame_count = pending->speech_frame_count + ev.speech_frame_count;
+        if (speech_frame_count > 0) {
+            pending->confidence = (pending->confidence * pending->speech_frame_count + ev.confidence * ev.speech_frame_count) /
+                                  speech_frame_count;
         }
+        pending->speech_frame_count = speech_frame_count;
+        pending->ring_pos = ev.ring_pos;
+        pending->time_ns = ev.time_ns;
+        stream->pending_merge = false;
+        ++stream->merged_segments;
+        ilog("Merged segment %s/%u in to %s/%u - now %lu samples",
+             stream->station,
+             ev.segment_id,
+             stream->station,
+             pending->segment_id,
+             (sizet)(pending->ring_pos - pending->segment_start));
     }
     else {
-        wlog("Could not find USB audio device");
-        audio_terminate(ma);
-        return false;
+        finish_pending_segment<C>(ma, stream, wq);
+        *pending = ev;
+        stream->has_pending_segment = true;
     }
-    sizet buf_sz = AUDIO_BUFFER_SAMPLE_COUNT * sizeof(s16);
-    ilog("Allocating %u byte buffer for audio recording", buf_sz);
-    ma->data.buffer = (s16 *)malloc(buf_sz);
 
-    ma_device_start(&ma->dev);
-    return true;
+    // Segments cut by the max duration or an overrun, rather than by silence, have no merge window to wait for
+    if (!stopped_on_silence || AUDIO_SEGMENT_MERGE_GAP_FRAME_COUNT == 0) {
+        finish_pending_segment<C>(ma, stream, wq);
+    }
 }
 
-void audio_terminate(audio_ctxt *aud)
+intern f32 rms_dbfs(f32 rms)
 {
-    ilog("Terminating audio");
-    if (ma_device_is_started(&aud->dev)) {
-        ma_device_stop(&aud->dev);
+    return (rms > 0.0f) ? 20.0f * log10f(rms) : -INFINITY;
+}
+
+intern void log_audio_event(const audio_stream *stream, const audio_event &ev)
+{
+    f64 age_ms = (monotonic_time_ns() - ev.time_ns) / 1000000.0;
+    cstr st = stream->station;
+    switch (ev.type) {
+    case (AUDIO_EVENT_RECORDING_START):
+        dlog("%s: Recording start at ring pos %lu with %lu samples of pre-roll and attack (%.1f ms ago)",
+             st,
+             ev.ring_pos,
+             ev.value,
+             age_ms);
+        break;
+    case (AUDIO_EVENT_RECORDING_STOP):
+        dlog("%s: Recording stopped due to silence with %lu pending samples at ring pos %lu - noise floor %.1f dBFS threshold "
+             "%.1f dBFS (%.1f ms ago)",
+             st,
+             ev.value,
+             ev.ring_pos,
+             rms_dbfs(ev.noise_floor_rms),
+             rms_dbfs(ev.threshold_rms),
+             age_ms);
+        break;
+    case (AUDIO_EVENT_MAX_DURATION):
+        dlog("%s: Segment reached max duration - cut after %lu samples at ring pos %lu (%.1f ms ago)", st, ev.value, ev.ring_pos, age_ms);
+        break;
+    case (AUDIO_EVENT_SEGMENT_PARTIAL):
+        dlog("%s: Segment %u partial window %lu published ending at ring pos %lu (%.1f ms ago)",
+             st,
+             ev.segment_id,
+             ev.value,
+             ev.ring_pos,
+             age_ms);
+        break;
+    case (AUDIO_EVENT_SEGMENT_CLOSED):
+        dlog("%s: Segment %u closed after %lu partial windows with %u ms of speech ending at ring pos %lu (%.1f ms ago)",
+             st,
+             ev.segment_id,
+             ev.value,
+             ev.speech_frame_count * AUDIO_VAD_FRAME_DURATION_MS,
+             ev.ring_pos,
+             age_ms);
+        break;
+    case (AUDIO_EVENT_MERGE_WINDOW_CLOSED):
+        // Only matters to the segment post processing, which logs what it does
+        break;
+    case (AUDIO_EVENT_OVERRUN):
+        wlog("%s: Audio ring full - dropped %lu samples at ring pos %lu (%.1f ms ago)", st, ev.value, ev.ring_pos, age_ms);
+        break;
+    case (AUDIO_EVENT_CLIPPING):
+        dlog("%s: Segment ending at ring pos %lu had %lu clipped samples (%.1f ms ago)", st, ev.ring_pos, ev.value, age_ms);
+        break;
+    default:
+        wlog("%s: Unknown audio event type %u", st, ev.type);
     }
-    ma_device_uninit(&aud->dev);
-    free(aud->data.buffer);
-    ma_context_uninit(&aud->ctxt);
-    ma_log_uninit(&aud->lg);
 }
 
-audio_ctxt *audio_create()
+intern void handle_overrun(audio_stream *stream)
+{
+    auto data = &stream->data;
+    if (data->overflow_policy == AUDIO_OVERFLOW_DROP_OLDEST) {
+        sizet dropped = audio_segment_table_drop_queued(&data->segments);
+        data->dropped_segments += dropped;
+        if (dropped > 0) {
+            wlog("%s: Dropped %lu queued segments to make room in the audio ring", stream->station, dropped);
+        }
+    }
+    auto snd = &data->snd_data;
+    wlog("%s: Audio overrun stats - overruns: %lu dropped samples: %lu truncated segments: %lu dropped segments: %lu",
+         stream->station,
+         snd->overruns.load(std::memory_order_relaxed),
+         snd->dropped_samples.load(std::memory_order_relaxed),
+         snd->truncated_segments.load(std::memory_order_relaxed),
+         data->dropped_segments);
+}
+
+// Log the stream's VAD, segment post processing, and log mel stats - these are totals since the stream started. Loud frames
+// the VAD rejected are ones the old energy only VAD would have recorded.
+template<class C>
+intern void log_vad_stats(const audio_stream *stream)
+{
+    auto snd = &stream->data.snd_data;
+    u64 frames = snd->vad_frames.load(std::memory_order_relaxed);
+    u64 speech = snd->speech_frames.load(std::memory_order_relaxed);
+    u64 rejected = snd->rejected_loud_frames.load(std::memory_order_relaxed);
+    ilog("%s: VAD %lu frames averaging %.2f us - %lu speech, %lu loud frames rejected (%.1f%% of loud frames, %lu under the "
+         "noise floor threshold), %lu bursts too short to start recording",
+         stream->station,
+         frames,
+         frames ? (snd->vad_ns.load(std::memory_order_relaxed) / 1000.0) / frames : 0.0,
+         speech,
+         rejected,
+         (speech + rejected) ? (100.0 * rejected) / (speech + rejected) : 0.0,
+         snd->under_floor_frames.load(std::memory_order_relaxed),
+         snd->rejected_attacks.load(std::memory_order_relaxed));
+    ilog("%s: Noise floor %.1f dBFS - speech threshold %.1f dBFS",
+         stream->station,
+         rms_dbfs(snd->noise_floor_rms.load(std::memory_order_relaxed)),
+         rms_dbfs(snd->threshold_rms.load(std::memory_order_relaxed)));
+    ilog("%s: Dropped %lu segments with under %d ms of speech (%.1f s of audio) and merged %lu segments - %lu fewer worker "
+         "tasks",
+         stream->station,
+         stream->short_segments,
+         AUDIO_SEGMENT_MIN_SPEECH_MS,
+         (f64)stream->short_segment_samples / (C::sample_rate * AUDIO_CHANNEL_COUNT),
+         stream->merged_segments,
+         stream->short_segments + stream->merged_segments);
+    auto data = &stream->data;
+    ilog("%s: Log mel %lu frames averaging %.2f us - closed segments ready %.2f ms after closing on average, %.1f us of "
+         "it finishing their last frames",
+         stream->station,
+         data->mel_frame_count,
+         data->mel_frame_count ? (data->mel_ns / 1000.0) / data->mel_frame_count : 0.0,
+         data->mel_closed_segments ? (data->mel_ready_ns / 1000000.0) / data->mel_closed_segments : 0.0,
+         data->mel_closed_segments ? (data->mel_close_ns / 1000.0) / data->mel_closed_segments : 0.0);
+}
+
+// Log how much of the real time budget the capture callback used over the last interval, then the VAD stats
+template<class C>
+intern void log_stream_stats(audio_stream *stream, u64 now_ns)
+{
+    auto snd = &stream->data.snd_data;
+    u64 count = snd->callback_count.load(std::memory_order_relaxed);
+    u64 ns = snd->callback_ns.load(std::memory_order_relaxed);
+    u64 elapsed_ns = now_ns - stream->stats_time_ns;
+    u64 interval_count = count - stream->stats_callback_count;
+    u64 interval_ns = ns - stream->stats_callback_ns;
+    ilog("%s: %lu capture callbacks averaging %.1f us - %.3f%% of one core",
+         stream->station,
+         interval_count,
+         interval_count ? (interval_ns / 1000.0) / interval_count : 0.0,
+         elapsed_ns ? (100.0 * interval_ns) / elapsed_ns : 0.0);
+    log_vad_stats<C>(stream);
+    stream->stats_time_ns = now_ns;
+    stream->stats_callback_count = count;
+    stream->stats_callback_ns = ns;
+}
+
+// Compute the log mel frames whose whole window has been published up to limit_pos. Forcing also computes the frames
+// centered before limit_pos whose windows run past it, with the rest of the window left as zeros - for when a segment
+// closes there.
+template<class C>
+intern void advance_mel(audio_buffer *data, u64 limit_pos, bool force)
+{
+    constexpr u64 half_window = C::mel_window_sample_count / 2;
+    u64 first_frame = data->mel_segment_start / C::mel_hop_sample_count;
+    if (data->mel_next_frame < first_frame) {
+        data->mel_next_frame = first_frame;
+    }
+    u64 start_ns = monotonic_time_ns();
+    sizet computed{};
+    while (1) {
+        u64 center = data->mel_next_frame * C::mel_hop_sample_count;
+        if (center >= limit_pos || (!force && center + half_window > limit_pos)) {
+            break;
+        }
+        // Windows are clipped to the segment, so samples from either side of a gap between transmissions never mix
+        u64 lo = (center >= data->mel_segment_start + half_window) ? center - half_window : data->mel_segment_start;
+        u64 hi = (center + half_window < limit_pos) ? center + half_window : limit_pos;
+        sizet offset = (sizet)(lo + half_window - center);
+        if (offset > 0 || hi < center + half_window) {
+            memset(data->mel_window, 0, sizeof(data->mel_window));
+        }
+        ring_view_copy(data->mel_window + offset, spsc_ring_view(&data->ring, lo, (sizet)(hi - lo)));
+        audio_mel_compute(&data->mel, data->mel_window, audio_mel_ring_at(&data->mel_frames, data->mel_next_frame));
+        ++data->mel_next_frame;
+        ++computed;
+    }
+    if (computed > 0) {
+        data->mel_frame_count += computed;
+        data->mel_ns += monotonic_time_ns() - start_ns;
+    }
+}
+
+// Finish the log mel frames of a segment closed at end_pos - windows of the next segment start from there
+template<class C>
+intern void finish_segment_mel(audio_buffer *data, const audio_event &ev)
+{
+    u64 start_ns = monotonic_time_ns();
+    advance_mel<C>(data, ev.ring_pos, true);
+    u64 end_ns = monotonic_time_ns();
+    data->mel_segment_start = ev.ring_pos;
+    ++data->mel_closed_segments;
+    data->mel_close_ns += end_ns - start_ns;
+    data->mel_ready_ns += end_ns - ev.time_ns;
+}
+
+// Handle every event the stream has posted so far and return how many there were. Log mel frames are computed up to
+// each event before it's handled, and then up to the end of what's been published.
+template<class C>
+intern sizet process_stream_events(audio_ctxt *ma, audio_stream *stream, work_queue *wq)
+{
+    auto data = &stream->data;
+    // Read before the events - the sound thread posts a segment's closed event before it publishes anything past it, so
+    // every segment end up to here has its event in the ring. Segments cut at the max duration are published with the
+    // samples past the cut before their event is posted, but there the audio carries on across the cut so the frames
+    // spanning it are fine.
+    u64 published = data->ring.write_pos.load(std::memory_order_acquire);
+    sizet avail = spsc_ring_available(&data->events);
+    for (sizet i = 0; i < avail; ++i) {
+        audio_event ev;
+        ring_view_copy(&ev, spsc_ring_peek(&data->events, 1));
+        spsc_ring_consume(&data->events, 1);
+        log_audio_event(stream, ev);
+        advance_mel<C>(data, (ev.ring_pos < published) ? ev.ring_pos : published, false);
+        if (ev.type == AUDIO_EVENT_SEGMENT_CLOSED) {
+            finish_segment_mel<C>(data, ev);
+        }
+        if (ev.type == AUDIO_EVENT_SEGMENT_PARTIAL || ev.type == AUDIO_EVENT_SEGMENT_CLOSED) {
+            post_process_segment<C>(ma, stream, wq, ev);
+        }
+        else if (ev.type == AUDIO_EVENT_RECORDING_STOP) {
+            stream->stopped_on_silence = true;
+        }
+        else if (ev.type == AUDIO_EVENT_RECORDING_START) {
+            stream->pending_merge = stream->has_pending_segment;
+        }
+        else if (ev.type == AUDIO_EVENT_MERGE_WINDOW_CLOSED) {
+            finish_pending_segment<C>(ma, stream, wq);
+        }
+        else if (ev.type == AUDIO_EVENT_OVERRUN) {
+            handle_overrun(stream);
+        }
+    }
+    advance_mel<C>(data, published, false);
+
+    u64 dropped = data->snd_data.dropped_events.load(std::memory_order_relaxed);
+    if (dropped != data->reported_dropped_events) {
+        wlog("%s: Audio event ring full - %lu events dropped so far", stream->station, dropped);
+        data->reported_dropped_events = dropped;
+    }
+    return avail;
+}
+
+template<class C>
+intern void process_pipeline_audio(audio_ctxt *ma, work_queue *wq)
+{
+    rt_assert_can_block();
+    // Read the sequence before checking the streams so an event posted after a stream is checked still wakes us. File and
+    // synth sources bump it once more when they're done.
+    u32 seq = ma->event_seq.load(std::memory_order_acquire);
+    bool source_done = ma->source.done.load(std::memory_order_acquire);
+    sizet handled{};
+    u64 now_ns = monotonic_time_ns();
+    for (sizet i = 0; i < ma->stream_count; ++i) {
+        auto stream = &ma->streams[i];
+        handled += process_stream_events<C>(ma, stream, wq);
+        if (now_ns - stream->stats_time_ns >= AUDIO_STREAM_STATS_INTERVAL_NS) {
+            log_stream_stats<C>(stream, now_ns);
+        }
+    }
+    if (handled == 0 && !source_done) {
+        ma->event_seq.wait(seq, std::memory_order_acquire);
+    }
+}
+
+void process_available_audio(audio_ctxt *ma, work_queue *wq)
+{
+    ma->pipeline->process_available_audio(ma, wq);
+}
+
+// Allocate the ring, event ring, and segment table for a stream
+template<class C>
+intern bool audio_buffer_init(audio_buffer *data, std::atomic<u32> *event_seq, f64 partial_interval_s)
+{
+    if (!spsc_ring_init(&data->ring, C::buffer_sample_count)) {
+        return false;
+    }
+    if (!spsc_ring_init(&data->events, AUDIO_EVENT_RING_COUNT)) {
+        spsc_ring_terminate(&data->ring);
+        return false;
+    }
+    if (!audio_frame_ring_init(&data->frames, data->ring.capacity, C::vad_frame_sample_count)) {
+        spsc_ring_terminate(&data->events);
+        spsc_ring_terminate(&data->ring);
+        return false;
+    }
+    if (!audio_mel_ring_init(&data->mel_frames, data->ring.capacity, C::mel_hop_sample_count)) {
+        audio_frame_ring_terminate(&data->frames);
+        spsc_ring_terminate(&data->events);
+        spsc_ring_terminate(&data->ring);
+        return false;
+    }
+    if (!audio_mel_init(&data->mel, C::sample_rate)) {
+        audio_mel_ring_terminate(&data->mel_frames);
+        audio_frame_ring_terminate(&data->frames);
+        spsc_ring_terminate(&data->events);
+        spsc_ring_terminate(&data->ring);
+        return false;
+    }
+    asrt(data->mel.window_sample_count == C::mel_window_sample_count);
+    if (!audio_vad_init(&data->snd_data.vad, C::vad_frame_sample_count, C::sample_rate)) {
+        audio_mel_terminate(&data->mel);
+        audio_mel_ring_terminate(&data->mel_frames);
+        audio_frame_ring_terminate(&data->frames);
+        spsc_ring_terminate(&data->events);
+        spsc_ring_terminate(&data->ring);
+        return false;
+    }
+    audio_segment_table_init(&data->segments, &data->ring, &data->frames, &data->mel_frames);
+    data->event_seq = event_seq;
+    data->overflow_policy = AUDIO_OVERFLOW_POLICY;
+    data->partial_interval_samples = (sizet)(partial_interval_s * C::sample_rate) * AUDIO_CHANNEL_COUNT;
+    return true;
+}
+
+intern void audio_buffer_terminate(audio_buffer *data)
+{
+    audio_vad_terminate(&data->snd_data.vad);
+    audio_segment_table_terminate(&data->segments);
+    audio_mel_terminate(&data->mel);
+    audio_mel_ring_terminate(&data->mel_frames);
+    audio_frame_ring_terminate(&data->frames);
+    spsc_ring_terminate(&data->events);
+    spsc_ring_terminate(&data->ring);
+}
+
+template<class C>
+intern bool audio_stream_init(audio_ctxt *ma, audio_stream *stream, cstr station)
+{
+    stream->station = station;
+    // Batches never set a source config, so their streams only publish closed segments
+    if (!audio_buffer_init<C>(&stream->data, &ma->event_seq, ma->source.cfg.partial_interval_s)) {
+        wlog("%s: Could not allocate audio ring buffers", station);
+        return false;
+    }
+    stream->stats_time_ns = monotonic_time_ns();
+    ilog("%s: Allocated %lu byte %s ring buffer with %lu bytes of frame features and %lu bytes of log mel frames",
+         station,
+         stream->data.ring.capacity * sizeof(s16),
+         stream->data.ring.mirrored ? "mirrored" : "unmirrored",
+         stream->data.frames.capacity * sizeof(audio_frame_features),
+         stream->data.mel_frames.capacity * sizeof(audio_mel_frame));
+    return true;
+}
+
+intern void audio_device_terminate(audio_device *device)
+{
+    if (ma_device_is_started(&device->dev)) {
+        ma_device_stop(&device->dev);
+    }
+    ma_device_uninit(&device->dev);
+    for (u32 ch = 0; device->resample && ch < device->channel_count; ++ch) {
+        audio_resampler_terminate(&device->resamplers[ch]);
+    }
+    device->resample = false;
+}
+
+// Resolve the sysfs path of the card behind an ALSA id (hw:1,0 or :1,0) in to path - left empty for ids that don't name a
+// card number
+intern void alsa_card_path(cstr alsa_id, char *path, sizet path_size)
+{
+    path[0] = 0;
+    cstr card = strchr(alsa_id, ':');
+    if (!card || card[1] < '0' || card[1] > '9') {
+        return;
+    }
+    char link[64];
+    snprintf(link, sizeof(link), "/sys/class/sound/card%d", atoi(card + 1));
+    char resolved[PATH_MAX];
+    if (realpath(link, resolved)) {
+        snprintf(path, path_size, "%s", resolved);
+    }
+}
+
+// Station tag bound to channel ch of a device in AUDIO_STATION_BINDINGS, or null if there isn't one or an earlier stream
+// already took it
+intern cstr find_station_tag(audio_ctxt *ma, cstr name, cstr id, cstr card_path, u32 ch)
+{
+    for (const auto &binding : AUDIO_STATION_BINDINGS) {
+        if (binding.channel != ch ||
+            !(strstr(name, binding.device) || strstr(id, binding.device) || strstr(card_path, binding.device))) {
+            continue;
+        }
+        for (sizet i = 0; i < ma->stream_count; ++i) {
+            if (ma->streams[i].station == binding.tag) {
+                wlog("Station %s is already bound to another stream - %s matches more than one device", binding.tag, binding.device);
+                return nullptr;
+            }
+        }
+        return binding.tag;
+    }
+    return nullptr;
+}
+
+// Open a capture device and set up a stream for each of its channels - the streams are only kept if the device opens
+template<class C>
+intern bool audio_device_init(audio_ctxt *ma, audio_device *device, const ma_device_info *dev_info)
+{
+    if (ma->stream_count + C::device_channel_count > AUDIO_MAX_CAPTURE_STREAMS) {
+        wlog("Skipping audio device %s - all %lu streams are in use", dev_info->name, AUDIO_MAX_CAPTURE_STREAMS);
+        return false;
+    }
+
+    char card_path[PATH_MAX];
+    cstr id = (ma->ctxt.backend == ma_backend_alsa) ? dev_info->id.alsa : "";
+    alsa_card_path(id, card_path, sizeof(card_path));
+    ilog("Opening %s (%s) - card path %s", dev_info->name, id, card_path[0] ? card_path : "unknown");
+
+    sizet first_stream = ma->stream_count;
+    device->channel_count = C::device_channel_count;
+    for (u32 ch = 0; ch < C::device_channel_count; ++ch) {
+        auto stream = &ma->streams[first_stream + ch];
+        device->streams[ch] = stream;
+        cstr station = find_station_tag(ma, dev_info->name, id, card_path, ch);
+        if (!station) {
+            snprintf(stream->station_buf, sizeof(stream->station_buf), "unbound%lu", first_stream + ch);
+            station = stream->station_buf;
+            wlog("No station is bound to channel %u of %s - recording it as %s", ch, dev_info->name, station);
+        }
+        else {
+            ilog("%s: Bound to channel %u of %s", station, ch, dev_info->name);
+        }
+        if (!audio_stream_init<C>(ma, stream, station)) {
+            for (u32 prev = 0; prev < ch; ++prev) {
+                audio_buffer_terminate(&device->streams[prev]->data);
+            }
+            return false;
+        }
+    }
+
+    ma_device_config config = ma_device_config_init(ma_device_type_capture);
+    config.capture.pDeviceID = &dev_info->id;
+    config.capture.format = ma_format_s16;
+    config.capture.channels = C::device_channel_count;
+    // A sample rate of 0 opens the device at its native rate, and the ALSA plugin layer is kept from converting it
+    config.sampleRate = AUDIO_CAPTURE_NATIVE_RATE ? 0 : C::sample_rate;
+    config.alsa.noAutoResample = AUDIO_CAPTURE_NATIVE_RATE;
+    config.periodSizeInMilliseconds = AUDIO_CAPTURE_PERIOD_MS;
+    config.performanceProfile = ma_performance_profile_low_latency;
+    config.dataCallback = audio_callback<C>;
+    config.pUserData = device;
+
+    ma_result result = ma_device_init(&ma->ctxt, &config, &device->dev);
+    // We only decimate - a codec running slower than the pipeline's rate is reopened and left to miniaudio to convert
+    if (result == MA_SUCCESS && device->dev.sampleRate < C::sample_rate) {
+        ilog("Native rate of %s is %u Hz - capturing at %d Hz instead", dev_info->name, device->dev.sampleRate, C::sample_rate);
+        ma_device_uninit(&device->dev);
+        config.sampleRate = C::sample_rate;
+        config.alsa.noAutoResample = false;
+        result = ma_device_init(&ma->ctxt, &config, &device->dev);
+    }
+    if (result != MA_SUCCESS) {
+        wlog("Could not initialize audio device %s: %s", dev_info->name, ma_result_description(result));
+        for (u32 ch = 0; ch < C::device_channel_count; ++ch) {
+            audio_buffer_terminate(&device->streams[ch]->data);
+        }
+        return false;
+    }
+
+    device->resample = (device->dev.sampleRate != C::sample_rate);
+    for (u32 ch = 0; device->resample && ch < C::device_channel_count; ++ch) {
+        if (!audio_resampler_init(&device->resamplers[ch], device->dev.sampleRate, C::sample_rate)) {
+            audio_device_terminate(device);
+            for (u32 stream_ch = 0; stream_ch < C::device_channel_count; ++stream_ch) {
+                audio_buffer_terminate(&device->streams[stream_ch]->data);
+            }
+            return false;
+        }
+    }
+    ma->stream_count += C::device_channel_count;
+    ilog("Capturing %u channels at %u Hz from %s", C::device_channel_count, device->dev.sampleRate, dev_info->name);
+    return true;
+}
+
+
+intern bool init_context(audio_ctxt *ma, const ma_backend *backends, u32 backend_count)
+{
+    ma_result result = ma_log_init(nullptr, &ma->lg);
+    if (result != MA_SUCCESS) {
+        wlog("Failed to initialize log: %s", ma_result_description(result));
+        return false;
+    }
+    ma_log_callback cb{};
+    cb.onLog = on_ma_log;
+    ma_log_register_callback(&ma->lg, cb);
+
+    ma_context_config ccfg{};
+    ccfg.pLog = &ma->lg;
+
+    result = ma_context_init(backends, backend_count, &ccfg, &ma->ctxt);
+    if (result != MA_SUCCESS) {
+        wlog("Could not initialize audio context - err: %s", ma_result_description(result));
+        ma_log_uninit(&ma->lg);
+        return false;
+    }
+    ilog("Selected audio backend: %s", ma_get_backend_name(ma->ctxt.backend));
+    return true;
+}
+
+// Open every capture device matching AUDIO_CAPTURE_DEVICE_MATCH, or the null backend's capture device
+template<class C>
+intern bool init_capture_source(audio_ctxt *ma, bool null_backend)
+{
+    ma_backend null_backends[] = {ma_backend_null};
+    if (!(null_backend ? init_context(ma, null_backends, 1) : init_context(ma, nullptr, 0))) {
+        return false;
+    }
+
+    ma_device_info *dev_infos;
+    ma_uint32 dev_cnt;
+    ma_device_info *capture_infos;
+    u32 capture_dev_cnt;
+    ma_result result = ma_context_get_devices(&ma->ctxt, &dev_infos, &dev_cnt, &capture_infos, &capture_dev_cnt);
+    if (result != MA_SUCCESS) {
+        wlog("Could not list audio devices: %s", ma_result_description(result));
+        audio_terminate(ma);
+        return false;
+    }
+
+    if (null_backend) {
+        if (capture_dev_cnt > 0 && audio_device_init<C>(ma, &ma->devices[0], &capture_infos[0])) {
+            ++ma->device_count;
+        }
+    }
+    else {
+        // Print out each device info and open each USB device associated with what we want
+        for (s32 devi = 0; devi < dev_cnt; devi += 1) {
+            if (ma->ctxt.backend == ma_backend_alsa) {
+                ilog("%d: %s : %s", devi, dev_infos[devi].name, dev_infos[devi].id.alsa);
+                if (strstr(dev_infos[devi].name, AUDIO_CAPTURE_DEVICE_MATCH) &&
+                    audio_device_init<C>(ma, &ma->devices[ma->device_count], &dev_infos[devi])) {
+                    ++ma->device_count;
+                }
+            }
+            else if (ma->ctxt.backend == ma_backend_pulseaudio) {
+                ilog("%d: %s : %s", devi, dev_infos[devi].name, dev_infos[devi].id.pulse);
+            }
+            else if (ma->ctxt.backend == ma_backend_jack) {
+                ilog("%d: %s : %d", devi, dev_infos[devi].name, dev_infos[devi].id.jack);
+            }
+            else {
+                ilog("%d - %s", devi, dev_infos[devi].name);
+            }
+        }
+    }
+    if (ma->device_count == 0) {
+        wlog("Could not find %s audio device", null_backend ? "null" : "USB");
+        audio_terminate(ma);
+        return false;
+    }
+    if (!audio_segment_pool_init(&ma->pool,
+                                 C::entry_max_sample_count,
+                                 C::entry_max_frame_count,
+                                 C::entry_max_mel_frame_count,
+                                 AUDIO_SEGMENT_POOL_POLICY)) {
+        audio_terminate(ma);
+        return false;
+    }
+
+    // Only start capturing once every stream is set up so none of them sit on samples while the others initialize
+    for (sizet i = 0; i < ma->device_count; ++i) {
+        ma_device_start(&ma->devices[i].dev);
+    }
+    ilog("Started %lu audio capture streams on %lu devices", ma->stream_count, ma->device_count);
+    return true;
+}
+
+// End the current segment at the end of a file so segments never span two files, and start the next file with fresh VAD
+// state
+intern void flush_stream(audio_stream *stream)
+{
+    auto data = &stream->data;
+    auto snd = &data->snd_data;
+    if (snd->recording) {
+        post_event(data, AUDIO_EVENT_RECORDING_STOP, segment_sample_count(data));
+        snd->recording = false;
+    }
+    if (segment_sample_count(data) > 0) {
+        close_segment(data);
+    }
+    // Segments are never merged across files either
+    post_event(data, AUDIO_EVENT_MERGE_WINDOW_CLOSED, 0);
+    snd->merge_window_frames = 0;
+    snd->vad_frame_fill = 0;
+    snd->consecutive_silent_frames = 0;
+    audio_vad_reset(&snd->vad);
+    reset_history(snd);
+}
+
+// Ring space a producer that can block waits for before running sample_count samples through a stream. Besides the
+// samples themselves, a frame that completes an attack flushes the whole history in to the ring at once, and the partial
+// VAD frame left over from the last block is finished too.
+template<class C>
+intern constexpr sizet blocking_ring_space(sizet sample_count)
+{
+    return sample_count + (AUDIO_HISTORY_FRAME_COUNT + 1) * C::vad_frame_sample_count;
+}
+
+template<class C>
+intern void decode_file(audio_ctxt *ma, cstr path)
+{
+    ma_decoder_config cfg = ma_decoder_config_init(ma_format_s16, C::device_channel_count, C::sample_rate);
+    ma_decoder dec;
+    ma_result result = ma_decoder_init_file(path, &cfg, &dec);
+    if (result != MA_SUCCESS) {
+        wlog("Skipping %s - could not open it for decoding: %s", path, ma_result_description(result));
+        return;
+    }
+    ilog("Decoding %s", path);
+
+    auto device = &ma->devices[0];
+    s16 frames[AUDIO_FILE_READ_FRAME_COUNT * C::device_channel_count];
+    u64 file_frames{};
+    while (1) {
+        ma_uint64 read{};
+        result = ma_decoder_read_pcm_frames(&dec, frames, AUDIO_FILE_READ_FRAME_COUNT, &read);
+        if (read == 0) {
+            if (result != MA_SUCCESS && result != MA_AT_END) {
+                wlog("Stopped decoding %s early: %s", path, ma_result_description(result));
+            }
+            break;
+        }
+
+        // Unlike a capture device we can wait for the workers to free up ring space, so a file never overruns - leave room for
+        // a history flush and the partial VAD frame left over from the last block too
+        for (u32 ch = 0; ch < C::device_channel_count; ++ch) {
+            auto data = &device->streams[ch]->data;
+            spsc_ring_wait_space(&data->ring, blocking_ring_space<C>(read * AUDIO_CHANNEL_COUNT));
+            spsc_ring_wait_space(&data->events, AUDIO_FILE_EVENT_SPACE);
+        }
+        process_device_frames<C>(device, frames, read);
+        file_frames += read;
+    }
+    for (u32 ch = 0; ch < C::device_channel_count; ++ch) {
+        flush_stream(device->streams[ch]);
+    }
+    ma_decoder_uninit(&dec);
+    ma->source.frame_count += file_frames;
+    ++ma->source.file_count;
+    ilog("Decoded %.1f s of audio from %s", (f64)file_frames / C::sample_rate, path);
+}
+
+intern bool is_dir(cstr path)
+{
+    auto dir = opendir(path);
+    if (dir) {
+        closedir(dir);
+    }
+    return dir != nullptr;
+}
+
+// Called from the source thread once it runs out of audio
+intern void finish_source(audio_ctxt *ma)
+{
+    ma->source.done.store(true, std::memory_order_release);
+    ma->event_seq.fetch_add(1, std::memory_order_release);
+    ma->event_seq.notify_one();
+}
+
+template<class C>
+intern void *file_source_thread(void *arg)
+{
+    auto ma = (audio_ctxt *)arg;
+    auto src = &ma->source;
+    cstr src_path = src->cfg.path;
+    if (is_dir(src_path)) {
+        // Files are decoded in name order so archives named by time go through in order
+        dirent **entries;
+        int count = scandir(src_path, &entries, nullptr, alphasort);
+        if (count < 0) {
+            wlog("Could not read directory %s: %s", src_path, strerror(errno));
+            count = 0;
+        }
+        for (int i = 0; i < count; ++i) {
+            if (entries[i]->d_name[0] != '.') {
+                char path[PATH_MAX];
+                snprintf(path, sizeof(path), "%s/%s", src_path, entries[i]->d_name);
+                decode_file<C>(ma, path);
+            }
+            free(entries[i]);
+        }
+        if (count > 0) {
+            free(entries);
+        }
+    }
+    else {
+        decode_file<C>(ma, src_path);
+    }
+
+    f64 audio_s = (f64)src->frame_count / C::sample_rate;
+    f64 wall_s = (monotonic_time_ns() - src->start_ns) / 1000000000.0;
+    ilog("Decoded %.1f s of audio from %lu files in %.2f s", audio_s, src->file_count, wall_s);
+    finish_source(ma);
+    return nullptr;
+}
+
+template<class C>
+intern u64 synth_step_frame_count(const audio_synth *syn, const audio_synth_step &step)
+{
+    if (step.kind == AUDIO_SYNTH_SPEECH && syn->speech) {
+        return syn->speech_frame_count;
+    }
+    return (u64)(step.duration_s * C::sample_rate);
+}
+
+intern void synth_begin_step(audio_synth *syn)
+{
+    auto &step = AUDIO_SYNTH_SCHEDULE[syn->step];
+    syn->step_frame = 0;
+    if (step.kind == AUDIO_SYNTH_QUIET || step.kind == AUDIO_SYNTH_NOISE) {
+        ma_noise_set_amplitude(&syn->noise, step.amplitude);
+    }
+    else {
+        ma_waveform_set_amplitude(&syn->tone, step.amplitude);
+    }
+}
+
+// Fill frame_count mono frames from the schedule - real time safe
+template<class C>
+intern void synth_generate(audio_synth *syn, s16 *frames, sizet frame_count)
+{
+    while (frame_count > 0) {
+        auto &step = AUDIO_SYNTH_SCHEDULE[syn->step];
+        u64 step_left = synth_step_frame_count<C>(syn, step) - syn->step_frame;
+        sizet count = (frame_count < step_left) ? frame_count : (sizet)step_left;
+        if (step.kind == AUDIO_SYNTH_SPEECH && syn->speech) {
+            memcpy(frames, syn->speech + syn->step_frame, count * sizeof(s16));
+        }
+        else if (step.kind == AUDIO_SYNTH_QUIET || step.kind == AUDIO_SYNTH_NOISE) {
+            ma_noise_read_pcm_frames(&syn->noise, frames, count, nullptr);
+        }
+        else {
+            ma_waveform_read_pcm_frames(&syn->tone, frames, count, nullptr);
+        }
+        frames += count;
+        frame_count -= count;
+        syn->step_frame += count;
+        if (syn->step_frame == synth_step_frame_count<C>(syn, step)) {
+            syn->step = (syn->step + 1) % AUDIO_SYNTH_STEP_COUNT;
+            synth_begin_step(syn);
+        }
+    }
+}
+
+template<class C>
+intern void *synth_source_thread(void *arg)
+{
+    auto ma = (audio_ctxt *)arg;
+    auto src = &ma->source;
+    sizet device_count = ma->stream_count / C::device_channel_count;
+    u64 duration_frames = (u64)(src->cfg.duration_s * C::sample_rate);
+    s16 frames[C::capture_period_frame_count * C::device_channel_count];
+    s16 channel[C::capture_period_frame_count];
+
+    // Paced sources deliver a period each time one would have been captured, on an absolute schedule so the pace doesn't
+    // drift with the time spent processing
+    constexpr u64 period_ns = (C::capture_period_frame_count * 1000000000ull) / C::sample_rate;
+    u64 next_ns = monotonic_time_ns();
+    while (duration_frames == 0 || src->frame_count < duration_frames) {
+        if (src->cfg.free_run) {
+            for (sizet i = 0; i < ma->stream_count; ++i) {
+                auto data = &ma->streams[i].data;
+                spsc_ring_wait_space(&data->ring, blocking_ring_space<C>(C::capture_period_frame_count * AUDIO_CHANNEL_COUNT));
+                spsc_ring_wait_space(&data->events, AUDIO_FILE_EVENT_SPACE);
+            }
+        }
+        else {
+            next_ns += period_ns;
+            if (monotonic_time_ns() > next_ns + period_ns) {
+                ++src->late_periods;
+            }
+            timespec ts{(time_t)(next_ns / 1000000000ull), (long)(next_ns % 1000000000ull)};
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr);
+        }
+
+        // Held to the same rules as the capture callback - every device's period is run through one after the other, as
+        // their callbacks would be on a single core
+        rt_scope_begin();
+        for (sizet d = 0; d < device_count; ++d) {
+            for (u32 ch = 0; ch < C::device_channel_count; ++ch) {
+                synth_generate<C>(&src->synth[d * C::device_channel_count + ch], channel, C::capture_period_frame_count);
+                for (sizet i = 0; i < C::capture_period_frame_count; ++i) {
+                    frames[i * C::device_channel_count + ch] = channel[i];
+                }
+            }
+            process_device_frames<C>(&ma->devices[d], frames, C::capture_period_frame_count);
+        }
+        rt_scope_end();
+        src->frame_count += C::capture_period_frame_count;
+    }
+    for (sizet i = 0; i < ma->stream_count; ++i) {
+        flush_stream(&ma->streams[i]);
+    }
+
+    f64 wall_s = (monotonic_time_ns() - src->start_ns) / 1000000000.0;
+    ilog("Generated %.1f s of synthetic audio on each of %lu streams in %.2f s - %lu periods were late",
+         (f64)src->frame_count / C::sample_rate,
+         ma->stream_count,
+         wall_s,
+         src->late_periods);
+    finish_source(ma);
+    return nullptr;
+}
+
+template<class C>
+intern bool init_synth(audio_source *src, sizet stream_count)
+{
+    // The speech sample is optional since it's found relative to the working directory
+    ma_decoder_config dcfg = ma_decoder_config_init(ma_format_s16, 1, C::sample_rate);
+    ma_uint64 speech_frames{};
+    void *speech{};
+    if (ma_decode_file(AUDIO_SYNTH_SPEECH_FILE, &dcfg, &speech_frames, &speech) == MA_SUCCESS) {
+        src->speech = (s16 *)speech;
+        src->speech_frame_count = (sizet)speech_frames;
+        ilog("Loaded %.1f s speech sample from %s", (f64)speech_frames / C::sample_rate, AUDIO_SYNTH_SPEECH_FILE);
+    }
+    else {
+        wlog("Could not load speech sample %s - playing tones in its place", AUDIO_SYNTH_SPEECH_FILE);
+    }
+
+    // Each stream starts at a different step so they don't all get the same audio, and gets its own fixed noise seed so
+    // runs are repeatable
+    for (sizet i = 0; i < stream_count; ++i) {
+        auto syn = &src->synth[i];
+        auto wcfg = ma_waveform_config_init(ma_format_s16, 1, C::sample_rate, ma_waveform_type_sine, 0.0, AUDIO_SYNTH_TONE_HZ);
+        auto ncfg = ma_noise_config_init(ma_format_s16, 1, ma_noise_type_white, (ma_int32)(i + 1), 0.0);
+        if (ma_waveform_init(&wcfg, &syn->tone) != MA_SUCCESS || ma_noise_init(&ncfg, nullptr, &syn->noise) != MA_SUCCESS) {
+            wlog("Could not initialize synthetic audio generators");
+            return false;
+        }
+        syn->speech = src->speech;
+        syn->speech_frame_count = src->speech_frame_count;
+        syn->step = (i * 2) % AUDIO_SYNTH_STEP_COUNT;
+        synth_begin_step(syn);
+        ++src->synth_count;
+    }
+    return true;
+}
+
+intern void terminate_synth(audio_source *src)
+{
+    for (sizet ch = 0; ch < src->synth_count; ++ch) {
+        ma_noise_uninit(&src->synth[ch].noise, nullptr);
+        ma_waveform_uninit(&src->synth[ch].tone);
+    }
+    src->synth_count = 0;
+    ma_free(src->speech, nullptr);
+    src->speech = nullptr;
+}
+
+// Set up stream_count streams, a device's worth at a time, fed by a source thread in place of capture devices, and start
+// the thread
+template<class C>
+intern bool init_thread_source(audio_ctxt *ma, sizet stream_count, void *(*thread_func)(void *))
+{
+    asrt(stream_count % C::device_channel_count == 0 && stream_count <= AUDIO_MAX_CAPTURE_STREAMS);
+    for (sizet i = 0; i < stream_count; ++i) {
+        auto device = &ma->devices[i / C::device_channel_count];
+        u32 ch = i % C::device_channel_count;
+        device->channel_count = C::device_channel_count;
+        auto stream = &ma->streams[i];
+        device->streams[ch] = stream;
+        snprintf(stream->station_buf, sizeof(stream->station_buf), "radio%lu", i);
+        if (!audio_stream_init<C>(ma, stream, stream->station_buf)) {
+            audio_terminate(ma);
+            return false;
+        }
+        ++ma->stream_count;
+    }
+    if (!audio_segment_pool_init(&ma->pool,
+                                 C::entry_max_sample_count,
+                                 C::entry_max_frame_count,
+                                 C::entry_max_mel_frame_count,
+                                 AUDIO_SEGMENT_POOL_POLICY)) {
+        audio_terminate(ma);
+        return false;
+    }
+
+    ma->source.start_ns = monotonic_time_ns();
+    int err = pthread_create(&ma->source.thread, nullptr, thread_func, ma);
+    if (err != 0) {
+        wlog("Could not create audio source thread: %s", strerror(err));
+        audio_terminate(ma);
+        return false;
+    }
+    ma->source.started = true;
+    return true;
+}
+
+template<class C>
+intern bool init_pipeline(audio_ctxt *ma, const audio_source_config &cfg)
+{
+    static_assert(audio_config_fits<C>);
+    ilog("Initializing audio");
+    ilog("Running the %d Hz pipeline with %u channels per device", C::sample_rate, C::device_channel_count);
+    ilog("Using %s %s audio dsp kernels with %d ms capture periods and %d ms VAD frames",
+         audio_dsp_isa_name(),
+         audio_dsp_math_name(),
+         AUDIO_CAPTURE_PERIOD_MS,
+         AUDIO_VAD_FRAME_DURATION_MS);
+    ilog("Segments start with %lu ms of pre-roll before a %lu ms attack - %lu bytes of history per stream",
+         AUDIO_PREROLL_FRAME_COUNT * AUDIO_VAD_FRAME_DURATION_MS,
+         AUDIO_VAD_ATTACK_FRAME_COUNT * AUDIO_VAD_FRAME_DURATION_MS,
+         AUDIO_HISTORY_FRAME_COUNT * C::vad_frame_sample_count * sizeof(s16) + sizeof(snd_thread_audio_data::history_features));
+    if (cfg.partial_interval_s > 0.0) {
+        ilog("Streaming partial windows of each segment every %.1f s", cfg.partial_interval_s);
+    }
+    ma->source.cfg = cfg;
+    switch (cfg.type) {
+    case (AUDIO_SOURCE_FILE):
+        ilog("Decoding audio from %s", cfg.path);
+        return init_thread_source<C>(ma, C::device_channel_count, file_source_thread<C>);
+    case (AUDIO_SOURCE_SYNTH): {
+        sizet stream_count = cfg.synth_stream_count ? cfg.synth_stream_count : C::device_channel_count;
+        if (stream_count % C::device_channel_count != 0 || stream_count > AUDIO_MAX_CAPTURE_STREAMS) {
+            wlog("Can't generate %lu streams - it has to be a multiple of the %u channels per device, up to %lu",
+                 stream_count,
+                 C::device_channel_count,
+                 AUDIO_MAX_CAPTURE_STREAMS);
+            return false;
+        }
+        ilog("Generating %lu streams of %s synthetic audio", stream_count, cfg.free_run ? "free running" : "real time paced");
+        if (!init_synth<C>(&ma->source, stream_count)) {
+            audio_terminate(ma);
+            return false;
+        }
+        return init_thread_source<C>(ma, stream_count, synth_source_thread<C>);
+    }
+    case (AUDIO_SOURCE_NULL):
+        return init_capture_source<C>(ma, true);
+    default:
+        return init_capture_source<C>(ma, false);
+    }
+}
+
+bool audio_init(audio_ctxt *ma, const audio_source_config &cfg)
+{
+    return ma->pipeline->init(ma, cfg);
+}
+
+bool audio_source_finished(audio_ctxt *ma)
+{
+    if (!ma->source.done.load(std::memory_order_acquire)) {
+        return false;
+    }
+    for (sizet i = 0; i < ma->stream_count; ++i) {
+        if (spsc_ring_available(&ma->streams[i].data.events) > 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+template<class C>
+intern void log_pipeline_throughput(audio_ctxt *ma)
+{
+    auto src = &ma->source;
+    f64 audio_s = (f64)src->frame_count / C::sample_rate;
+    f64 wall_s = (monotonic_time_ns() - src->start_ns) / 1000000000.0;
+    ilog("Processed %.1f s of audio in %.2f s - real time factor %.4f (%.1fx real time)",
+         audio_s,
+         wall_s,
+         (audio_s > 0.0) ? wall_s / audio_s : 0.0,
+         (wall_s > 0.0) ? audio_s / wall_s : 0.0);
+    for (sizet i = 0; i < ma->stream_count; ++i) {
+        log_vad_stats<C>(&ma->streams[i]);
+    }
+}
+
+void audio_log_source_throughput(audio_ctxt *ma)
+{
+    ma->pipeline->log_source_throughput(ma);
+}
+
+// Leaves out the journal, and what an earlier run started from the batch directory left there - its segments and its
+// dated log directory
+intern int batch_entry_filter(const dirent *entry)
+{
+    return entry->d_name[0] != '.' && entry->d_type != DT_DIR && strcmp(entry->d_name, AUDIO_BATCH_JOURNAL_FILE) != 0 &&
+           !is_segment_file_name(entry->d_name);
+}
+
+intern int compare_paths(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Read the paths finished by earlier runs so they can be skipped, and open the journal to add to it. The journal lives in
+// the batch directory, so a batch resumes wherever it is run from.
+intern bool open_batch_journal(audio_batch *batch)
+{
+    char journal_path[PATH_MAX];
+    int len = snprintf(journal_path, sizeof(journal_path), "%s/%s", batch->dir, AUDIO_BATCH_JOURNAL_FILE);
+    if (len < 0 || (sizet)len >= sizeof(journal_path)) {
+        elog("Batch journal path in %s is longer than %d characters", batch->dir, PATH_MAX - 1);
+        return false;
+    }
+    FILE *f = fopen(journal_path, "r");
+    if (f) {
+        sizet capacity{};
+        char line[PATH_MAX + 2];
+        while (fgets(line, sizeof(line), f)) {
+            line[strcspn(line, "\n")] = '\0';
+            if (line[0] == '\0') {
+                continue;
+            }
+            if (batch->done_count == capacity) {
+                capacity = capacity ? capacity * 2 : 64;
+                batch->done_paths = (char **)realloc(batch->done_paths, capacity * sizeof(char *));
+            }
+            batch->done_paths[batch->done_count++] = strdup(line);
+        }
+        fclose(f);
+        qsort(batch->done_paths, batch->done_count, sizeof(char *), compare_paths);
+        ilog("Resuming batch - %lu files are already done according to %s (delete it to start over)",
+             batch->done_count,
+             journal_path);
+    }
+
+    batch->journal = fopen(journal_path, "a");
+    if (!batch->journal) {
+        elog("Could not open batch journal %s: %s", journal_path, strerror(errno));
+        return false;
+    }
+    pthread_mutex_init(&batch->journal_mutex, nullptr);
+    return true;
+}
+
+intern bool batch_path_done(const audio_batch *batch, cstr path)
+{
+    return batch->done_count > 0 && bsearch(&path, batch->done_paths, batch->done_count, sizeof(char *), compare_paths);
+}
+
+intern void mark_batch_path_done(audio_batch *batch, cstr path)
+{
+    pthread_mutex_lock(&batch->journal_mutex);
+    fprintf(batch->journal, "%s\n", path);
+    fflush(batch->journal);
+    pthread_mutex_unlock(&batch->journal_mutex);
+}
+
+// Decode a file through the worker's stream, handling segments as they close. Segment ids start over with each file so a
+// file that is reprocessed after an interruption writes the same outputs again. Segments are named after the whole file
+// name, extension and all - names are unique within the directory, so files with the same stem (kpns.wav and kpns.mp3)
+// can't write over each other's segments.
+template<class C>
+intern bool batch_decode_file(audio_batch_worker *worker, cstr path, cstr name, u64 *frame_count)
+{
+    ma_decoder_config cfg = ma_decoder_config_init(ma_format_s16, AUDIO_CHANNEL_COUNT, C::sample_rate);
+    ma_decoder dec;
+    ma_result result = ma_decoder_init_file(path, &cfg, &dec);
+    if (result != MA_SUCCESS) {
+        wlog("Skipping %s - could not open it for decoding: %s", path, ma_result_description(result));
+        return false;
+    }
+
+    auto ma = worker->batch->ma;
+    auto stream = &worker->stream;
+    snprintf(worker->station, sizeof(worker->station), "%s", name);
+
+    // Check the longest name a segment of this file could get before doing any work, rather than finishing the file with
+    // its segments missing
+    char fname[NAME_MAX + 1];
+    if (!segment_file_name(fname, worker->station, UINT32_MAX, true, UINT32_MAX)) {
+        wlog("Skipping %s - its name is too long to name its segments after", path);
+        ma_decoder_uninit(&dec);
+        return false;
+    }
+    stream->data.snd_data.segment_id = 0;
+
+    s16 samples[AUDIO_FILE_READ_FRAME_COUNT * AUDIO_CHANNEL_COUNT];
+    *frame_count = 0;
+    while (1) {
+        ma_uint64 read{};
+        result = ma_decoder_read_pcm_frames(&dec, samples, AUDIO_FILE_READ_FRAME_COUNT, &read);
+        if (read == 0) {
+            if (result != MA_SUCCESS && result != MA_AT_END) {
+                wlog("Stopped decoding %s early: %s", path, ma_result_description(result));
+            }
+            break;
+        }
+        // Segments are released as soon as they're handled here, so the ring always has room for the next block
+        process_stream_samples<C>(stream, samples, read * AUDIO_CHANNEL_COUNT);
+        process_stream_events<C>(ma, stream, nullptr);
+        *frame_count += read;
+    }
+    flush_stream(stream);
+    process_stream_events<C>(ma, stream, nullptr);
+    ma_decoder_uninit(&dec);
+    return true;
+}
+
+template<class C>
+intern f64 audio_hours_per_minute(u64 frame_count, u64 elapsed_ns)
+{
+    f64 hours = (f64)frame_count / (C::sample_rate * 3600.0);
+    f64 minutes = elapsed_ns / 60000000000.0;
+    return (minutes > 0.0) ? hours / minutes : 0.0;
+}
+
+template<class C>
+intern void *batch_thread(void *arg)
+{
+    auto worker = (audio_batch_worker *)arg;
+    auto batch = worker->batch;
+    while (1) {
+        sizet ind = batch->next_entry.fetch_add(1, std::memory_order_relaxed);
+        if (ind >= batch->entry_count) {
+            break;
+        }
+        cstr name = batch->entries[ind]->d_name;
+        char path[PATH_MAX];
+        int len = snprintf(path, sizeof(path), "%s/%s", batch->dir, name);
+        if (len < 0 || (sizet)len >= sizeof(path)) {
+            wlog("Skipping %s - its path is longer than %d characters", name, PATH_MAX - 1);
+            continue;
+        }
+        if (batch_path_done(batch, path)) {
+            batch->files_skipped.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+
+        u64 frames{};
+        if (batch_decode_file<C>(worker, path, name, &frames)) {
+            mark_batch_path_done(batch, path);
+            u64 total_frames = batch->frame_count.fetch_add(frames, std::memory_order_relaxed) + frames;
+            sizet done = batch->files_done.fetch_add(1, std::memory_order_relaxed) + 1;
+            ilog("[%lu/%lu] Reprocessed %s (%.1f s of audio) - %.2f hours of audio per minute so far",
+                 done + batch->files_skipped.load(std::memory_order_relaxed),
+                 batch->entry_count,
+                 name,
+                 (f64)frames / C::sample_rate,
+                 audio_hours_per_minute<C>(total_frames, monotonic_time_ns() - batch->start_ns));
+        }
+    }
+    return nullptr;
+}
+
+template<class C>
+intern bool init_pipeline_batch(audio_ctxt *ma, cstr dir, sizet thread_count)
+{
+    static_assert(audio_config_fits<C>);
+    // Each file is decoded as a single radio, so a multichannel pipeline would have every file downmixed
+    if (C::device_channel_count != AUDIO_CHANNEL_COUNT) {
+        wlog("Batches are reprocessed one radio per file - run them with a mono pipeline instead of %u channels per device",
+             C::device_channel_count);
+        return false;
+    }
+    auto batch = &ma->batch;
+    batch->ma = ma;
+    if (!realpath(dir, batch->dir)) {
+        wlog("Could not find batch directory %s: %s", dir, strerror(errno));
+        return false;
+    }
+    if (thread_count == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = (cores > 0) ? (sizet)cores : 1;
+    }
+
+    int count = scandir(batch->dir, &batch->entries, batch_entry_filter, alphasort);
+    if (count < 0) {
+        wlog("Could not read batch directory %s: %s", batch->dir, strerror(errno));
+        return false;
+    }
+    batch->entry_count = (sizet)count;
+    if (!open_batch_journal(batch)) {
+        audio_terminate(ma);
+        return false;
+    }
+    if (!audio_segment_pool_init(&ma->pool,
+                                 C::entry_max_sample_count,
+                                 C::entry_max_frame_count,
+                                 C::entry_max_mel_frame_count,
+                                 AUDIO_SEGMENT_POOL_POLICY)) {
+        audio_terminate(ma);
+        return false;
+    }
+
+    ilog("Reprocessing %lu files in %s with %lu threads", batch->entry_count, batch->dir, thread_count);
+    batch->workers = new audio_batch_worker[thread_count]{};
+    batch->start_ns = monotonic_time_ns();
+    for (sizet i = 0; i < thread_count; ++i) {
+        auto worker = &batch->workers[i];
+        worker->batch = batch;
+        if (!audio_stream_init<C>(ma, &worker->stream, worker->station)) {
+            break;
+        }
+        int err = pthread_create(&worker->thread, nullptr, batch_thread<C>, worker);
+        if (err != 0) {
+            wlog("Could not create batch thread: %s", strerror(err));
+            audio_buffer_terminate(&worker->stream.data);
+            break;
+        }
+        ++batch->worker_count;
+    }
+    if (batch->worker_count == 0) {
+        audio_terminate(ma);
+        return false;
+    }
+    return true;
+}
+
+bool audio_init_batch(audio_ctxt *ma, cstr dir, sizet thread_count)
+{
+    return ma->pipeline->init_batch(ma, dir, thread_count);
+}
+
+intern void join_batch_workers(audio_batch *batch)
+{
+    for (sizet i = 0; i < batch->worker_count; ++i) {
+        pthread_join(batch->workers[i].thread, nullptr);
+        audio_buffer_terminate(&batch->workers[i].stream.data);
+    }
+    batch->worker_count = 0;
+}
+
+template<class C>
+intern void wait_pipeline_batch(audio_ctxt *ma)
+{
+    auto batch = &ma->batch;
+    join_batch_workers(batch);
+
+    u64 elapsed_ns = monotonic_time_ns() - batch->start_ns;
+    u64 frames = batch->frame_count.load(std::memory_order_relaxed);
+    ilog("Batch done - reprocessed %lu files (%lu already done, %lu failed) with %.2f hours of audio in %.1f s - %.2f hours of "
+         "audio per minute",
+         batch->files_done.load(std::memory_order_relaxed),
+         batch->files_skipped.load(std::memory_order_relaxed),
+         batch->entry_count - batch->files_done.load(std::memory_order_relaxed) - batch->files_skipped.load(std::memory_order_relaxed),
+         (f64)frames / (C::sample_rate * 3600.0),
+         elapsed_ns / 1000000000.0,
+         audio_hours_per_minute<C>(frames, elapsed_ns));
+}
+
+void audio_wait_batch(audio_ctxt *ma)
+{
+    ma->pipeline->wait_batch(ma);
+}
+
+intern void terminate_batch(audio_batch *batch)
+{
+    join_batch_workers(batch);
+    delete[] batch->workers;
+    batch->workers = nullptr;
+    for (sizet i = 0; i < batch->entry_count; ++i) {
+        free(batch->entries[i]);
+    }
+    free(batch->entries);
+    batch->entries = nullptr;
+    batch->entry_count = 0;
+    for (sizet i = 0; i < batch->done_count; ++i) {
+        free(batch->done_paths[i]);
+    }
+    free(batch->done_paths);
+    batch->done_paths = nullptr;
+    batch->done_count = 0;
+    if (batch->journal) {
+        fclose(batch->journal);
+        batch->journal = nullptr;
+        pthread_mutex_destroy(&batch->journal_mutex);
+    }
+}
+
+void audio_terminate(audio_ctxt *aud)
+{
+    ilog("Terminating audio");
+    if (aud->source.started) {
+        pthread_join(aud->source.thread, nullptr);
+        aud->source.started = false;
+    }
+    if (aud->source.cfg.type == AUDIO_SOURCE_SYNTH) {
+        terminate_synth(&aud->source);
+    }
+    if (aud->batch.ma) {
+        terminate_batch(&aud->batch);
+        aud->batch.ma = nullptr;
+    }
+    for (sizet i = 0; i < aud->device_count; ++i) {
+        audio_device_terminate(&aud->devices[i]);
+    }
+    aud->device_count = 0;
+    for (sizet i = 0; i < aud->stream_count; ++i) {
+        audio_buffer_terminate(&aud->streams[i].data);
+    }
+    aud->stream_count = 0;
+    audio_segment_pool_terminate(&aud->pool);
+    ma_context_uninit(&aud->ctxt);
+    ma_log_uninit(&aud->lg);
+}
+
+template<class C>
+intern constexpr audio_pipeline_ops PIPELINE_OPS = {init_pipeline<C>,
+                                                   init_pipeline_batch<C>,
+                                                   process_pipeline_audio<C>,
+                                                   log_pipeline_throughput<C>,
+                                                   wait_pipeline_batch<C>};
+
+// Indexed by audio_pipeline
+intern constexpr const audio_pipeline_ops *AUDIO_PIPELINES[AUDIO_PIPELINE_COUNT] = {&PIPELINE_OPS<audio_config_wideband>,
+                                                                                    &PIPELINE_OPS<audio_config_narrowband>,
+                                                                                    &PIPELINE_OPS<audio_config_wideband_stereo>};
+
+audio_ctxt *audio_create(audio_pipeline pipeline)
 {
-    return new audio_ctxt{};
+    asrt(pipeline < AUDIO_PIPELINE_COUNT);
+    auto ma = new audio_ctxt{};
+    ma->pipeline = AUDIO_PIPELINES[pipeline];
+    return ma;
 }
 
 void audio_destroy(audio_ctxt *aud)
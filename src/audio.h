@@ -1,9 +1,65 @@
 #pragma once
+#include "basic_types.h"
+
 struct audio_ctxt;
 struct work_queue;
 
-audio_ctxt *audio_create();
+// Where the capture pipeline gets its frames
+enum audio_source_type
+{
+    // Capture devices matched by name - the radios
+    AUDIO_SOURCE_CAPTURE,
+    // miniaudio's null backend - a capture device thread paced by the clock that delivers silence
+    AUDIO_SOURCE_NULL,
+    // Generated tones, noise, and speech bursts from the sample audio
+    AUDIO_SOURCE_SYNTH,
+    // A file or a directory of files decoded as fast as the pipeline takes them
+    AUDIO_SOURCE_FILE
+};
+
+// Sample rate and capture device layout the pipeline is built for - each is its own compile time instantiation of the
+// capture code (see audio_config.h), and one is picked at startup
+enum audio_pipeline
+{
+    // 16 kHz mono devices
+    AUDIO_PIPELINE_WIDEBAND,
+    // 8 kHz mono devices
+    AUDIO_PIPELINE_NARROWBAND,
+    // 16 kHz stereo devices with a radio on each channel
+    AUDIO_PIPELINE_WIDEBAND_STEREO,
+    AUDIO_PIPELINE_COUNT
+};
+
+struct audio_source_config
+{
+    audio_source_type type;
+    // File or directory for file sources
+    const char *path;
+    // Synth sources stop after this many seconds of audio - 0 runs until killed
+    f64 duration_s;
+    // Synth sources are paced by the clock like a capture device unless this is set, in which case they run as fast as
+    // the pipeline takes them
+    bool free_run;
+    // Synth sources generate this many streams, a device's worth of channels at a time, to see how the pipeline scales
+    // with the number of radios - 0 generates a single device
+    sizet synth_stream_count;
+    // Streaming mode - publish a partial window of each segment being recorded every this many seconds so downstream work
+    // can start before it closes. 0 only publishes closed segments.
+    f64 partial_interval_s;
+};
+
+audio_ctxt *audio_create(audio_pipeline pipeline);
 void audio_destroy(audio_ctxt *aud);
-bool audio_init(audio_ctxt *aud);
+bool audio_init(audio_ctxt *aud, const audio_source_config &cfg);
+// True once a file or synth source has run out of audio and every event it posted has been processed - capture sources
+// never finish
+bool audio_source_finished(audio_ctxt *aud);
+// Log the file or synth source throughput as a real time factor and each stream's VAD stats - call once the work queue is
+// idle to include the workers
+void audio_log_source_throughput(audio_ctxt *aud);
+// Reprocess every file in dir across thread_count threads (0 for one per core), skipping files a previous run finished
+bool audio_init_batch(audio_ctxt *aud, const char *dir, sizet thread_count);
+// Block until the batch is done and log how it went
+void audio_wait_batch(audio_ctxt *aud);
 void audio_terminate(audio_ctxt *aud);
 void process_available_audio(audio_ctxt *ma, work_queue *wq);
@@ -0,0 +1,47 @@
+#pragma once
+#include "global_constants.h"
+#include "audio_mel.h"
+
+// Everything in the capture pipeline that follows from the sample rate and the number of channels captured from each
+// device. The capture, ring, and VAD code is templated on one of these, so every frame length, buffer size, and loop count
+// in it is a compile time constant - each config is its own instantiation of the pipeline, and the one to run is picked
+// at startup.
+template<s32 SampleRate, u32 DeviceChannelCount>
+struct audio_config
+{
+    // Rate of the streams and their segments - devices capturing faster than this are decimated to it
+    static constexpr s32 sample_rate = SampleRate;
+    // Channels captured from each device - each channel is a separate radio with its own stream (ie two receivers on the
+    // left and right of a stereo codec)
+    static constexpr u32 device_channel_count = DeviceChannelCount;
+    static constexpr sizet capture_period_frame_count = (SampleRate * AUDIO_CAPTURE_PERIOD_MS) / 1000;
+    // Multichannel devices are deinterleaved, and devices capturing at another rate are resampled, this many frames at a
+    // time
+    static constexpr sizet deinterleave_frame_count = capture_period_frame_count;
+    static constexpr sizet vad_frame_sample_count = (SampleRate * AUDIO_VAD_FRAME_DURATION_MS / 1000) * AUDIO_CHANNEL_COUNT;
+    static constexpr sizet entry_max_sample_count = SampleRate * AUDIO_CHANNEL_COUNT * AUDIO_ENTRY_MAX_DURATION_S;
+    static constexpr sizet entry_max_frame_count = entry_max_sample_count / vad_frame_sample_count;
+    static constexpr sizet mel_hop_sample_count = SampleRate * AUDIO_MEL_HOP_MS / 1000;
+    static constexpr sizet mel_window_sample_count = SampleRate * AUDIO_MEL_WINDOW_MS / 1000;
+    static constexpr sizet entry_max_mel_frame_count = entry_max_sample_count / mel_hop_sample_count;
+    static constexpr sizet publish_sample_count = (SampleRate * AUDIO_PUBLISH_INTERVAL_MS / 1000) * AUDIO_CHANNEL_COUNT;
+    // Triple buffer the audio
+    static constexpr sizet buffer_sample_count = entry_max_sample_count * 3;
+};
+
+// 16 kHz mono devices - what Whisper takes, and the default
+using audio_config_wideband = audio_config<16000, 1>;
+// 8 kHz mono devices - narrowband receivers and phone patches, at half the ring memory and VAD work
+using audio_config_narrowband = audio_config<8000, 1>;
+// 16 kHz stereo devices with a radio on each channel
+using audio_config_wideband_stereo = audio_config<16000, 2>;
+
+// Streams and devices of every config share the same structs, so their fixed size buffers are sized for the largest rate
+// and channel count of the configs above
+inline constexpr s32 AUDIO_MAX_SAMPLE_RATE = 16000;
+inline constexpr u32 AUDIO_MAX_DEVICE_CHANNEL_COUNT = 2;
+using audio_config_max = audio_config<AUDIO_MAX_SAMPLE_RATE, AUDIO_MAX_DEVICE_CHANNEL_COUNT>;
+
+template<class C>
+inline constexpr bool audio_config_fits =
+    C::sample_rate <= AUDIO_MAX_SAMPLE_RATE && C::device_channel_count <= AUDIO_MAX_DEVICE_CHANNEL_COUNT;
@@ -0,0 +1,469 @@
+#include <cmath>
+#include <limits>
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define AUDIO_DSP_NEON
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#define AUDIO_DSP_AVX2
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define AUDIO_DSP_SSE2
+#endif
+
+#include "logging.h"
+#include "global_constants.h"
+#include "audio_dsp.h"
+
+intern constexpr s16 MAX_S16 = std::numeric_limits<s16>::max();
+intern constexpr s16 MIN_S16 = std::numeric_limits<s16>::min();
+intern constexpr f64 SAMPLE_RMS_DENOM = (f64)MAX_S16 * MAX_S16;
+
+// A chunk is silent when sqrt(sum_sq / (DENOM * n)) < threshold, or equivalently sum_sq < threshold^2 * DENOM * n. The
+// threshold is widened from the same f32 constant so the cut point matches the old float loop.
+intern constexpr f64 SILENT_SUM_SQ_PER_SAMPLE = (f64)AUDIO_SILENT_THRESHOLD_RMS * (f64)AUDIO_SILENT_THRESHOLD_RMS * SAMPLE_RMS_DENOM;
+
+// log2(1 + i / 64) in Q16 for audio_log2_q16 - one extra entry so the last interval has an end to interpolate to
+intern constexpr u32 LOG2_FRACTION_BITS = 6;
+intern constexpr u32 LOG2_TABLE_Q16[(1 << LOG2_FRACTION_BITS) + 1] = {
+    0,     1466,  2909,  4331,  5732,  7112,  8473,  9814,  11136, 12440, 13727, 14996, 16248, 17484, 18704, 19909, 21098,
+    22272, 23433, 24579, 25711, 26830, 27936, 29029, 30109, 31178, 32234, 33279, 34312, 35334, 36346, 37346, 38336, 39316,
+    40286, 41246, 42196, 43137, 44068, 44990, 45904, 46809, 47705, 48593, 49472, 50344, 51207, 52063, 52911, 53751, 54584,
+    55410, 56229, 57040, 57845, 58643, 59434, 60219, 60997, 61769, 62534, 63294, 64047, 64794, 65536};
+
+// Running state shared by the vector body and the scalar tail
+struct chunk_accum
+{
+    u64 sum_sq;
+    s32 max;
+    s32 min;
+    u32 clip_count;
+    u32 zero_crossings;
+};
+
+intern void accumulate_scalar(const s16 *samples, sizet count, chunk_accum *acc)
+{
+    for (sizet i = 0; i < count; ++i) {
+        s32 s = samples[i];
+        acc->sum_sq += (u64)(s * s);
+        if (s > acc->max) {
+            acc->max = s;
+        }
+        if (s < acc->min) {
+            acc->min = s;
+        }
+        acc->clip_count += (s == MAX_S16 || s == MIN_S16);
+        // Sign changes between each sample and the next one in the chunk
+        acc->zero_crossings += (i + 1 < count) && ((s ^ samples[i + 1]) < 0);
+    }
+}
+
+#if defined(AUDIO_DSP_NEON)
+intern sizet accumulate_simd(const s16 *samples, sizet count, chunk_accum *acc)
+{
+    const int16x8_t rail_hi = vdupq_n_s16(MAX_S16);
+    const int16x8_t rail_lo = vdupq_n_s16(MIN_S16);
+    uint64x2_t sum = vdupq_n_u64(0);
+    uint32x4_t clips = vdupq_n_u32(0);
+    uint32x4_t crossings = vdupq_n_u32(0);
+    int16x8_t vmax = vdupq_n_s16(0);
+    int16x8_t vmin = vdupq_n_s16(0);
+
+    // Each sample is compared with the one after it for zero crossings, so the vector loop stops a sample early
+    sizet i = 0;
+    for (; i + 8 < count; i += 8) {
+        int16x8_t v = vld1q_s16(samples + i);
+        int16x8_t next = vld1q_s16(samples + i + 1);
+        // The largest square is 2^30 so the widened products are always positive and can be summed as u32
+        int32x4_t sq_lo = vmull_s16(vget_low_s16(v), vget_low_s16(v));
+        int32x4_t sq_hi = vmull_high_s16(v, v);
+        sum = vpadalq_u32(sum, vreinterpretq_u32_s32(sq_lo));
+        sum = vpadalq_u32(sum, vreinterpretq_u32_s32(sq_hi));
+        vmax = vmaxq_s16(vmax, v);
+        vmin = vminq_s16(vmin, v);
+        uint16x8_t rails = vorrq_u16(vceqq_s16(v, rail_hi), vceqq_s16(v, rail_lo));
+        clips = vpadalq_u16(clips, vshrq_n_u16(rails, 15));
+        crossings = vpadalq_u16(crossings, vshrq_n_u16(vreinterpretq_u16_s16(veorq_s16(v, next)), 15));
+    }
+    acc->sum_sq += vaddvq_u64(sum);
+    acc->max = (vmaxvq_s16(vmax) > acc->max) ? vmaxvq_s16(vmax) : acc->max;
+    acc->min = (vminvq_s16(vmin) < acc->min) ? vminvq_s16(vmin) : acc->min;
+    acc->clip_count += vaddvq_u32(clips);
+    acc->zero_crossings += vaddvq_u32(crossings);
+    return i;
+}
+#elif defined(AUDIO_DSP_AVX2)
+intern sizet accumulate_simd(const s16 *samples, sizet count, chunk_accum *acc)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i rail_hi = _mm256_set1_epi16(MAX_S16);
+    const __m256i rail_lo = _mm256_set1_epi16(MIN_S16);
+    __m256i sum = zero;
+    __m256i vmax = zero;
+    __m256i vmin = zero;
+    __m256i clips = zero;
+    __m256i crossings = zero;
+    const __m256i ones = _mm256_set1_epi16(1);
+    // Each sample is compared with the one after it for zero crossings, so the vector loop stops a sample early
+    sizet i = 0;
+    for (; i + 16 < count; i += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(samples + i));
+        __m256i next = _mm256_loadu_si256((const __m256i *)(samples + i + 1));
+        // Adjacent squares are added in pairs - only a pair of -32768 samples exceeds s32 so treat the lanes as u32
+        __m256i sq = _mm256_madd_epi16(v, v);
+        sum = _mm256_add_epi64(sum, _mm256_unpacklo_epi32(sq, zero));
+        sum = _mm256_add_epi64(sum, _mm256_unpackhi_epi32(sq, zero));
+        vmax = _mm256_max_epi16(vmax, v);
+        vmin = _mm256_min_epi16(vmin, v);
+        __m256i rails = _mm256_or_si256(_mm256_cmpeq_epi16(v, rail_hi), _mm256_cmpeq_epi16(v, rail_lo));
+        // Rail lanes are -1 so the pairwise multiply add by one gives minus the count per s32 lane
+        clips = _mm256_sub_epi32(clips, _mm256_madd_epi16(rails, ones));
+        // Same trick for sign changes, with the sign bit of the xor spread across the lane
+        __m256i flips = _mm256_srai_epi16(_mm256_xor_si256(v, next), 15);
+        crossings = _mm256_sub_epi32(crossings, _mm256_madd_epi16(flips, ones));
+    }
+
+    alignas(32) u64 sums[4];
+    alignas(32) s16 maxs[16];
+    alignas(32) s16 mins[16];
+    alignas(32) u32 clip_counts[8];
+    alignas(32) u32 crossing_counts[8];
+    _mm256_store_si256((__m256i *)sums, sum);
+    _mm256_store_si256((__m256i *)clip_counts, clips);
+    _mm256_store_si256((__m256i *)crossing_counts, crossings);
+    _mm256_store_si256((__m256i *)maxs, vmax);
+    _mm256_store_si256((__m256i *)mins, vmin);
+    acc->sum_sq += sums[0] + sums[1] + sums[2] + sums[3];
+    for (int lane = 0; lane < 16; ++lane) {
+        acc->max = (maxs[lane] > acc->max) ? maxs[lane] : acc->max;
+        acc->min = (mins[lane] < acc->min) ? mins[lane] : acc->min;
+    }
+    for (int lane = 0; lane < 8; ++lane) {
+        acc->clip_count += clip_counts[lane];
+        acc->zero_crossings += crossing_counts[lane];
+    }
+    return i;
+}
+#elif defined(AUDIO_DSP_SSE2)
+intern sizet accumulate_simd(const s16 *samples, sizet count, chunk_accum *acc)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i rail_hi = _mm_set1_epi16(MAX_S16);
+    const __m128i rail_lo = _mm_set1_epi16(MIN_S16);
+    __m128i sum = zero;
+    __m128i vmax = zero;
+    __m128i vmin = zero;
+    __m128i clips = zero;
+    __m128i crossings = zero;
+    const __m128i ones = _mm_set1_epi16(1);
+    // Each sample is compared with the one after it for zero crossings, so the vector loop stops a sample early
+    sizet i = 0;
+    for (; i + 8 < count; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(samples + i));
+        __m128i next = _mm_loadu_si128((const __m128i *)(samples + i + 1));
+        // Adjacent squares are added in pairs - only a pair of -32768 samples exceeds s32 so treat the lanes as u32
+        __m128i sq = _mm_madd_epi16(v, v);
+        sum = _mm_add_epi64(sum, _mm_unpacklo_epi32(sq, zero));
+        sum = _mm_add_epi64(sum, _mm_unpackhi_epi32(sq, zero));
+        vmax = _mm_max_epi16(vmax, v);
+        vmin = _mm_min_epi16(vmin, v);
+        __m128i rails = _mm_or_si128(_mm_cmpeq_epi16(v, rail_hi), _mm_cmpeq_epi16(v, rail_lo));
+        // Rail lanes are -1 so the pairwise multiply add by one gives minus the count per s32 lane
+        clips = _mm_sub_epi32(clips, _mm_madd_epi16(rails, ones));
+        // Same trick for sign changes, with the sign bit of the xor spread across the lane
+        __m128i flips = _mm_srai_epi16(_mm_xor_si128(v, next), 15);
+        crossings = _mm_sub_epi32(crossings, _mm_madd_epi16(flips, ones));
+    }
+
+    alignas(16) u64 sums[2];
+    alignas(16) s16 maxs[8];
+    alignas(16) s16 mins[8];
+    alignas(16) u32 clip_counts[4];
+    alignas(16) u32 crossing_counts[4];
+    _mm_store_si128((__m128i *)sums, sum);
+    _mm_store_si128((__m128i *)clip_counts, clips);
+    _mm_store_si128((__m128i *)crossing_counts, crossings);
+    _mm_store_si128((__m128i *)maxs, vmax);
+    _mm_store_si128((__m128i *)mins, vmin);
+    acc->sum_sq += sums[0] + sums[1];
+    for (int lane = 0; lane < 8; ++lane) {
+        acc->max = (maxs[lane] > acc->max) ? maxs[lane] : acc->max;
+        acc->min = (mins[lane] < acc->min) ? mins[lane] : acc->min;
+    }
+    acc->clip_count += clip_counts[0] + clip_counts[1] + clip_counts[2] + clip_counts[3];
+    acc->zero_crossings += crossing_counts[0] + crossing_counts[1] + crossing_counts[2] + crossing_counts[3];
+    return i;
+}
+#else
+intern sizet accumulate_simd(const s16 *, sizet, chunk_accum *)
+{
+    return 0;
+}
+#endif
+
+// Stereo deinterleave - each returns how many frames it handled so the scalar loop can finish the rest
+#if defined(AUDIO_DSP_NEON)
+intern sizet deinterleave_stereo_simd(const s16 *frames, sizet frame_count, s16 *left, s16 *right)
+{
+    sizet i = 0;
+    for (; i + 8 <= frame_count; i += 8) {
+        int16x8x2_t v = vld2q_s16(frames + i * 2);
+        vst1q_s16(left + i, v.val[0]);
+        vst1q_s16(right + i, v.val[1]);
+    }
+    return i;
+}
+#elif defined(AUDIO_DSP_AVX2)
+intern sizet deinterleave_stereo_simd(const s16 *frames, sizet frame_count, s16 *left, s16 *right)
+{
+    sizet i = 0;
+    for (; i + 16 <= frame_count; i += 16) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(frames + i * 2));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(frames + i * 2 + 16));
+        // Sign extend the even (left) and odd (right) samples to s32 and pack back down - the values always fit so the
+        // saturation does nothing. The pack works within 128 bit lanes so the quadwords need putting back in order.
+        __m256i l = _mm256_packs_epi32(_mm256_srai_epi32(_mm256_slli_epi32(a, 16), 16), _mm256_srai_epi32(_mm256_slli_epi32(b, 16), 16));
+        __m256i r = _mm256_packs_epi32(_mm256_srai_epi32(a, 16), _mm256_srai_epi32(b, 16));
+        _mm256_storeu_si256((__m256i *)(left + i), _mm256_permute4x64_epi64(l, 0xD8));
+        _mm256_storeu_si256((__m256i *)(right + i), _mm256_permute4x64_epi64(r, 0xD8));
+    }
+    return i;
+}
+#elif defined(AUDIO_DSP_SSE2)
+intern sizet deinterleave_stereo_simd(const s16 *frames, sizet frame_count, s16 *left, s16 *right)
+{
+    sizet i = 0;
+    for (; i + 8 <= frame_count; i += 8) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(frames + i * 2));
+        __m128i b = _mm_loadu_si128((const __m128i *)(frames + i * 2 + 8));
+        // Sign extend the even (left) and odd (right) samples to s32 and pack back down - the values always fit so the
+        // saturation does nothing
+        __m128i l = _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(a, 16), 16), _mm_srai_epi32(_mm_slli_epi32(b, 16), 16));
+        __m128i r = _mm_packs_epi32(_mm_srai_epi32(a, 16), _mm_srai_epi32(b, 16));
+        _mm_storeu_si128((__m128i *)(left + i), l);
+        _mm_storeu_si128((__m128i *)(right + i), r);
+    }
+    return i;
+}
+#else
+intern sizet deinterleave_stereo_simd(const s16 *, sizet, s16 *, s16 *)
+{
+    return 0;
+}
+#endif
+
+// Sum of a[i] * b[i] - returns how many samples it handled so the scalar loop can finish the rest
+#if defined(AUDIO_DSP_NEON)
+intern sizet dot_simd(const s16 *a, const s16 *b, sizet count, s32 *sum)
+{
+    int32x4_t acc = vdupq_n_s32(0);
+    sizet i = 0;
+    for (; i + 8 <= count; i += 8) {
+        int16x8_t va = vld1q_s16(a + i);
+        int16x8_t vb = vld1q_s16(b + i);
+        acc = vmlal_s16(acc, vget_low_s16(va), vget_low_s16(vb));
+        acc = vmlal_high_s16(acc, va, vb);
+    }
+    *sum = vaddvq_s32(acc);
+    return i;
+}
+#elif defined(AUDIO_DSP_AVX2)
+intern sizet dot_simd(const s16 *a, const s16 *b, sizet count, s32 *sum)
+{
+    __m256i acc = _mm256_setzero_si256();
+    sizet i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(va, vb));
+    }
+    __m128i acc4 = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    acc4 = _mm_add_epi32(acc4, _mm_shuffle_epi32(acc4, 0x4E));
+    acc4 = _mm_add_epi32(acc4, _mm_shuffle_epi32(acc4, 0xB1));
+    *sum = _mm_cvtsi128_si32(acc4);
+    return i;
+}
+#elif defined(AUDIO_DSP_SSE2)
+intern sizet dot_simd(const s16 *a, const s16 *b, sizet count, s32 *sum)
+{
+    __m128i acc = _mm_setzero_si128();
+    sizet i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(va, vb));
+    }
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0x4E));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0xB1));
+    *sum = _mm_cvtsi128_si32(acc);
+    return i;
+}
+#else
+intern sizet dot_simd(const s16 *, const s16 *, sizet, s32 *sum)
+{
+    *sum = 0;
+    return 0;
+}
+#endif
+
+// Q15 window multiply - returns how many samples it handled so the scalar loop can finish the rest. AVX2 builds use the
+// SSE2 loop since windows are only a few hundred samples. NEON builds take the scalar loop - the window is only used by the
+// fixed point kernels, which are for boards without NEON.
+#if defined(AUDIO_DSP_AVX2) || defined(AUDIO_DSP_SSE2)
+intern sizet window_simd(const s16 *samples, const s16 *window, sizet count, u32 shift, s32 *out)
+{
+    const __m128i down = _mm_cvtsi32_si128((s32)(15 - shift));
+    const __m128i round = _mm_set1_epi32(1 << (14 - shift));
+    sizet i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(samples + i));
+        __m128i w = _mm_loadu_si128((const __m128i *)(window + i));
+        // Low and high halves of the s32 products, interleaved back together
+        __m128i lo = _mm_mullo_epi16(s, w);
+        __m128i hi = _mm_mulhi_epi16(s, w);
+        __m128i p_lo = _mm_sra_epi32(_mm_add_epi32(_mm_unpacklo_epi16(lo, hi), round), down);
+        __m128i p_hi = _mm_sra_epi32(_mm_add_epi32(_mm_unpackhi_epi16(lo, hi), round), down);
+        _mm_storeu_si128((__m128i *)(out + i), p_lo);
+        _mm_storeu_si128((__m128i *)(out + i + 4), p_hi);
+    }
+    return i;
+}
+#else
+intern sizet window_simd(const s16 *, const s16 *, sizet, u32, s32 *)
+{
+    return 0;
+}
+#endif
+
+#if defined(AUDIO_DSP_FIXED_POINT)
+// Bit at a time square root, rounded down
+intern u32 isqrt_u64(u64 x)
+{
+    u64 root{};
+    u64 bit = 1ull << 62;
+    while (bit > x) {
+        bit >>= 2;
+    }
+    while (bit) {
+        if (x >= root + bit) {
+            x -= root + bit;
+            root = (root >> 1) + bit;
+        }
+        else {
+            root >>= 1;
+        }
+        bit >>= 2;
+    }
+    return (u32)root;
+}
+#endif
+
+const char *audio_dsp_isa_name()
+{
+#if defined(AUDIO_DSP_NEON)
+    return "neon";
+#elif defined(AUDIO_DSP_AVX2)
+    return "avx2";
+#elif defined(AUDIO_DSP_SSE2)
+    return "sse2";
+#else
+    return "scalar";
+#endif
+}
+
+void audio_chunk_features_compute(const s16 *samples, sizet count, audio_chunk_features *feat)
+{
+    chunk_accum acc{};
+    sizet done = accumulate_simd(samples, count, &acc);
+    accumulate_scalar(samples + done, count - done, &acc);
+    feat->sum_sq = acc.sum_sq;
+    feat->peak = (u32)((acc.max > -acc.min) ? acc.max : -acc.min);
+    feat->clip_count = acc.clip_count;
+    feat->zero_crossings = acc.zero_crossings;
+}
+
+const char *audio_dsp_math_name()
+{
+#if defined(AUDIO_DSP_FIXED_POINT)
+    return "fixed point";
+#else
+    return "float";
+#endif
+}
+
+f32 audio_chunk_rms(const audio_chunk_features &feat, sizet count)
+{
+    if (count == 0) {
+        return 0.0f;
+    }
+#if defined(AUDIO_DSP_FIXED_POINT)
+    // Mean square with 16 fractional bits, done as whole and remainder so long chunks can't overflow the shift - its root
+    // has 8 fractional bits
+    u64 mean_sq = ((feat.sum_sq / count) << 16) + ((feat.sum_sq % count) << 16) / count;
+    return (f32)isqrt_u64(mean_sq) * (1.0f / (256.0f * MAX_S16));
+#else
+    return (f32)sqrt((f64)feat.sum_sq / (SAMPLE_RMS_DENOM * count));
+#endif
+}
+
+bool audio_chunk_is_silent(const audio_chunk_features &feat, sizet count)
+{
+    return (f64)feat.sum_sq < SILENT_SUM_SQ_PER_SAMPLE * count;
+}
+
+void audio_deinterleave(const s16 *frames, sizet frame_count, u32 channel_count, s16 *const *channels)
+{
+    sizet done = 0;
+    if (channel_count == 2) {
+        done = deinterleave_stereo_simd(frames, frame_count, channels[0], channels[1]);
+    }
+    for (sizet i = done; i < frame_count; ++i) {
+        for (u32 ch = 0; ch < channel_count; ++ch) {
+            channels[ch][i] = frames[i * channel_count + ch];
+        }
+    }
+}
+
+s32 audio_dot_s16(const s16 *a, const s16 *b, sizet count)
+{
+    s32 sum;
+    sizet done = dot_simd(a, b, count, &sum);
+    for (sizet i = done; i < count; ++i) {
+        sum += (s32)a[i] * b[i];
+    }
+    return sum;
+}
+
+void audio_window_q15(const s16 *samples, const s16 *window, sizet count, u32 shift, s32 *out)
+{
+    asrt(shift < 15);
+    u32 down = 15 - shift;
+    s32 round = 1 << (down - 1);
+    sizet done = window_simd(samples, window, count, shift, out);
+    for (sizet i = done; i < count; ++i) {
+        out[i] = ((s32)samples[i] * window[i] + round) >> down;
+    }
+}
+
+u32 audio_window_q15_shift(u32 peak, u32 bits)
+{
+    // Under 2^peak_bits before the window, which is at most one
+    u32 peak_bits = 32 - __builtin_clz(peak | 1);
+    u32 shift = (bits > peak_bits) ? bits - peak_bits : 0;
+    return (shift < 14) ? shift : 14;
+}
+
+s32 audio_log2_q16(u64 x)
+{
+    s32 msb = 63 - __builtin_clzll(x);
+    // The bits below the leading one, lined up so the top LOG2_FRACTION_BITS pick the table interval and the 16 below
+    // interpolate across it
+    constexpr s32 mantissa_bits = LOG2_FRACTION_BITS + 16;
+    u64 aligned = (msb >= mantissa_bits) ? (x >> (msb - mantissa_bits)) : (x << (mantissa_bits - msb));
+    u32 mantissa = (u32)aligned & ((1u << mantissa_bits) - 1);
+    u32 index = mantissa >> 16;
+    s32 lo = (s32)LOG2_TABLE_Q16[index];
+    s32 hi = (s32)LOG2_TABLE_Q16[index + 1];
+    return (msb << 16) + lo + (s32)(((s64)(hi - lo) * (mantissa & 0xFFFF)) >> 16);
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include "basic_types.h"
+
+// Builds with AUDIO_DSP_FIXED_POINT defined (the CLOUDWX_FIXED_POINT_DSP cmake option) run the per sample and per bin
+// loops of the VAD and log mel front end in Q15/Q31 fixed point instead of float, for boards whose FPUs are slow next to
+// their integer units. The float path is the reference - the fixed one is checked against it and the bound on the
+// difference is documented with each kernel.
+
+// Features computed over a chunk of s16 samples in a single pass
+struct audio_chunk_features
+{
+    // Exact sum of the squared samples - even at full scale this takes more than 2^33 samples to overflow
+    u64 sum_sq;
+    // Largest absolute sample value (0 to 32768)
+    u32 peak;
+    // Number of samples sitting on either rail
+    u32 clip_count;
+    // Number of adjacent sample pairs that change sign, with zero counted as positive
+    u32 zero_crossings;
+};
+
+// Name of the SIMD path the kernels were compiled with (neon, avx2, sse2, or scalar)
+const char *audio_dsp_isa_name();
+
+// Name of the arithmetic the VAD and log mel kernels were compiled with (fixed point or float)
+const char *audio_dsp_math_name();
+
+// Compute sum of squares, peak, clip count, and zero crossings for count samples
+void audio_chunk_features_compute(const s16 *samples, sizet count, audio_chunk_features *feat);
+
+// Normalized RMS in the range [0, 1] - this is what AUDIO_SILENT_THRESHOLD_RMS is compared against. Fixed point builds
+// take an integer square root of the mean square with 16 fractional bits, which is within 2^-8 of a sample step of the
+// float result.
+f32 audio_chunk_rms(const audio_chunk_features &feat, sizet count);
+
+// Returns true if the RMS of the chunk is below AUDIO_SILENT_THRESHOLD_RMS. The comparison is done on the integer sum of
+// squares so it doesn't depend on float accumulation order or chunk length.
+bool audio_chunk_is_silent(const audio_chunk_features &feat, sizet count);
+
+// Split frame_count interleaved frames of channel_count channels in to a separate buffer per channel - stereo has a SIMD
+// path, other channel counts are done one sample at a time
+void audio_deinterleave(const s16 *frames, sizet frame_count, u32 channel_count, s16 *const *channels);
+
+// Sum of a[i] * b[i] over count samples - the caller makes sure the sum fits in s32, which it does for filter taps whose
+// absolute values add up to less than 2.0 in Q15
+s32 audio_dot_s16(const s16 *a, const s16 *b, sizet count);
+
+// Multiply count samples by a Q15 window in to out, keeping shift fractional bits of the product (rounded to nearest) -
+// shift is below 15
+void audio_window_q15(const s16 *samples, const s16 *window, sizet count, u32 shift, s32 *out);
+
+// Largest shift for audio_window_q15 that keeps samples up to peak in magnitude under 2^bits - block floating point, so
+// quiet frames keep more fractional bits through the transform than loud ones
+u32 audio_window_q15_shift(u32 peak, u32 bits);
+
+// Log2 of x (which must be non zero) in Q16. A leading zero count gives the integer part and a 64 entry table with linear
+// interpolation the fraction, which is within 7e-5 of exact and exact at powers of two.
+s32 audio_log2_q16(u64 x);
@@ -0,0 +1,452 @@
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(AUDIO_DSP_FIXED_POINT)
+// Fixed point transforms are scalar - they're for boards without NEON
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define AUDIO_FFT_NEON
+#elif defined(__SSE2__)
+// AVX2 builds use this too - the transforms here are too short for eight lanes to be worth another path
+#include <emmintrin.h>
+#define AUDIO_FFT_SSE2
+#endif
+
+#include "logging.h"
+#include "audio_fft.h"
+
+// The butterflies are written once as templates over the lane type - f32 for the scalar loops and tails, and the SIMD
+// vector type, whose arithmetic operators the compiler provides. Only the loads, stores, and shuffles need intrinsics.
+// Fixed point builds use q31 below as the lane.
+#if defined(AUDIO_DSP_FIXED_POINT)
+// An s32 transform value - multiplying by one holding a Q31 twiddle is rounded back to the value's scale
+struct q31
+{
+    s32 v;
+};
+
+intern q31 operator+(q31 a, q31 b)
+{
+    return {a.v + b.v};
+}
+
+intern q31 operator-(q31 a, q31 b)
+{
+    return {a.v - b.v};
+}
+
+intern q31 operator*(q31 a, q31 b)
+{
+    return {(s32)(((s64)a.v * b.v + (1ll << 30)) >> 31)};
+}
+
+typedef q31 fft_lane;
+
+intern s32 to_twiddle(f64 x)
+{
+    return (s32)llround(fmin(x * 2147483648.0, 2147483647.0));
+}
+#else
+typedef f32 fft_lane;
+
+intern f32 to_twiddle(f64 x)
+{
+    return (f32)x;
+}
+#endif
+
+#if defined(AUDIO_FFT_NEON)
+#define AUDIO_FFT_SIMD
+typedef float32x4_t f32x4;
+
+intern f32x4 splat4(f32 x)
+{
+    return vdupq_n_f32(x);
+}
+
+intern f32x4 reverse4(f32x4 v)
+{
+    v = vrev64q_f32(v);
+    return vextq_f32(v, v, 2);
+}
+
+// Lane j of v[k] goes to p[4 * j + k]
+intern void store4_interleaved(f32 *p, const f32x4 *v)
+{
+    float32x4x4_t t = {{v[0], v[1], v[2], v[3]}};
+    vst4q_f32(p, t);
+}
+
+// Even and odd elements of the 8 at p
+intern void load4_deinterleaved(const f32 *p, f32x4 *even, f32x4 *odd)
+{
+    float32x4x2_t t = vld2q_f32(p);
+    *even = t.val[0];
+    *odd = t.val[1];
+}
+#elif defined(AUDIO_FFT_SSE2)
+#define AUDIO_FFT_SIMD
+typedef __m128 f32x4;
+
+intern f32x4 splat4(f32 x)
+{
+    return _mm_set1_ps(x);
+}
+
+intern f32x4 reverse4(f32x4 v)
+{
+    return _mm_shuffle_ps(v, v, _MM_SHUFFLE(0, 1, 2, 3));
+}
+
+// Lane j of v[k] goes to p[4 * j + k]
+intern void store4_interleaved(f32 *p, const f32x4 *v)
+{
+    f32x4 a = v[0];
+    f32x4 b = v[1];
+    f32x4 c = v[2];
+    f32x4 d = v[3];
+    _MM_TRANSPOSE4_PS(a, b, c, d);
+    _mm_storeu_ps(p, a);
+    _mm_storeu_ps(p + 4, b);
+    _mm_storeu_ps(p + 8, c);
+    _mm_storeu_ps(p + 12, d);
+}
+
+// Even and odd elements of the 8 at p
+intern void load4_deinterleaved(const f32 *p, f32x4 *even, f32x4 *odd)
+{
+    f32x4 lo = _mm_loadu_ps(p);
+    f32x4 hi = _mm_loadu_ps(p + 4);
+    *even = _mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0));
+    *odd = _mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1));
+}
+#endif
+
+// Unaligned load and store of a lane or a vector of them
+template<class V>
+intern V load_lanes(const audio_fft_value *p)
+{
+    V v;
+    memcpy(&v, p, sizeof(V));
+    return v;
+}
+
+template<class V>
+intern void store_lanes(audio_fft_value *p, V v)
+{
+    memcpy(p, &v, sizeof(V));
+}
+
+// Radix 4 decimation in frequency butterfly on inputs a, b, c, d in r and i. The outputs go back in r and i with the
+// last three rotated by the twiddles in w.
+template<class V>
+intern void butterfly4(V *r, V *i, const V *w)
+{
+    V apc_r = r[0] + r[2];
+    V apc_i = i[0] + i[2];
+    V amc_r = r[0] - r[2];
+    V amc_i = i[0] - i[2];
+    V bpd_r = r[1] + r[3];
+    V bpd_i = i[1] + i[3];
+    V bmd_r = r[1] - r[3];
+    V bmd_i = i[1] - i[3];
+    // a - c -/+ j(b - d)
+    V t1_r = amc_r + bmd_i;
+    V t1_i = amc_i - bmd_r;
+    V t2_r = apc_r - bpd_r;
+    V t2_i = apc_i - bpd_i;
+    V t3_r = amc_r - bmd_i;
+    V t3_i = amc_i + bmd_r;
+    r[0] = apc_r + bpd_r;
+    i[0] = apc_i + bpd_i;
+    r[1] = w[0] * t1_r - w[1] * t1_i;
+    i[1] = w[0] * t1_i + w[1] * t1_r;
+    r[2] = w[2] * t2_r - w[3] * t2_i;
+    i[2] = w[2] * t2_i + w[3] * t2_r;
+    r[3] = w[4] * t3_r - w[5] * t3_i;
+    i[3] = w[4] * t3_i + w[5] * t3_r;
+}
+
+// Butterfly on the lanes at x + k * in_step, writing them to y + k * out_step
+template<class V>
+intern void butterfly4_strided(const audio_fft_value *xr,
+                               const audio_fft_value *xi,
+                               sizet in_step,
+                               audio_fft_value *yr,
+                               audio_fft_value *yi,
+                               sizet out_step,
+                               const V *w)
+{
+    V r[4];
+    V i[4];
+    for (sizet k = 0; k < 4; ++k) {
+        r[k] = load_lanes<V>(xr + k * in_step);
+        i[k] = load_lanes<V>(xi + k * in_step);
+    }
+    butterfly4(r, i, w);
+    for (sizet k = 0; k < 4; ++k) {
+        store_lanes(yr + k * out_step, r[k]);
+        store_lanes(yi + k * out_step, i[k]);
+    }
+}
+
+// Point p of sub transform q goes from x[q + stride * (p + k * span / 4)] to y[q + stride * (4 * p + k)]
+intern void radix4_pass(const audio_fft_stage &st,
+                        const audio_fft_value *xr,
+                        const audio_fft_value *xi,
+                        audio_fft_value *yr,
+                        audio_fft_value *yi)
+{
+    sizet s = st.stride;
+    sizet quarter = st.span / 4;
+    const audio_fft_value *tw = st.twiddles;
+
+    if (s == 1) {
+        // First pass - a single transform, so go four points at a time and interleave the outputs
+        sizet p = 0;
+#if defined(AUDIO_FFT_SIMD)
+        for (; p + 4 <= quarter; p += 4) {
+            f32x4 r[4];
+            f32x4 i[4];
+            f32x4 w[6];
+            for (sizet k = 0; k < 4; ++k) {
+                r[k] = load_lanes<f32x4>(xr + p + k * quarter);
+                i[k] = load_lanes<f32x4>(xi + p + k * quarter);
+            }
+            for (sizet k = 0; k < 6; ++k) {
+                w[k] = load_lanes<f32x4>(tw + k * quarter + p);
+            }
+            butterfly4(r, i, w);
+            store4_interleaved(yr + 4 * p, r);
+            store4_interleaved(yi + 4 * p, i);
+        }
+#endif
+        for (; p < quarter; ++p) {
+            fft_lane w[6];
+            for (sizet k = 0; k < 6; ++k) {
+                w[k] = load_lanes<fft_lane>(tw + k * quarter + p);
+            }
+            butterfly4_strided(xr + p, xi + p, quarter, yr + 4 * p, yi + 4 * p, 1, w);
+        }
+        return;
+    }
+
+    // Later passes - the stride interleaved transforms share twiddles, so go four transforms at a time
+    for (sizet p = 0; p < quarter; ++p) {
+        fft_lane w[6];
+        for (sizet k = 0; k < 6; ++k) {
+            w[k] = load_lanes<fft_lane>(tw + k * quarter + p);
+        }
+        sizet in = s * p;
+        sizet out = s * 4 * p;
+        sizet q = 0;
+#if defined(AUDIO_FFT_SIMD)
+        f32x4 wv[6];
+        for (sizet k = 0; k < 6; ++k) {
+            wv[k] = splat4(tw[k * quarter + p]);
+        }
+        for (; q + 4 <= s; q += 4) {
+            butterfly4_strided(xr + in + q, xi + in + q, s * quarter, yr + out + q, yi + out + q, s, wv);
+        }
+#endif
+        for (; q < s; ++q) {
+            butterfly4_strided(xr + in + q, xi + in + q, s * quarter, yr + out + q, yi + out + q, s, w);
+        }
+    }
+}
+
+template<class V>
+intern void butterfly2(audio_fft_value *r, audio_fft_value *i, sizet step)
+{
+    V ar = load_lanes<V>(r);
+    V ai = load_lanes<V>(i);
+    V br = load_lanes<V>(r + step);
+    V bi = load_lanes<V>(i + step);
+    store_lanes(r, ar + br);
+    store_lanes(i, ai + bi);
+    store_lanes(r + step, ar - br);
+    store_lanes(i + step, ai - bi);
+}
+
+// Last pass for odd powers of two - stride transforms of 2 points, which need no twiddles and are done in place
+intern void radix2_pass(audio_fft_value *re, audio_fft_value *im, sizet stride)
+{
+    sizet q = 0;
+#if defined(AUDIO_FFT_SIMD)
+    for (; q + 4 <= stride; q += 4) {
+        butterfly2<f32x4>(re + q, im + q, stride);
+    }
+#endif
+    for (; q < stride; ++q) {
+        butterfly2<fft_lane>(re + q, im + q, stride);
+    }
+}
+
+// Bin k of the real input from bins k and half - k of the packed transform Z. Writing E = (Z[k] + conj(Z[half - k])) / 2
+// for the even samples and O = (Z[k] - conj(Z[half - k])) / 2 for the odd ones, X[k] = E - j W^k O. The halving is left
+// until the end, where it's a quarter of the power.
+#if defined(AUDIO_DSP_FIXED_POINT)
+intern u64 split_bin_power(q31 ar, q31 ai, q31 br, q31 bi, q31 wr, q31 wi)
+{
+    q31 e_r = ar + br;
+    q31 e_i = ai - bi;
+    q31 o_r = ar - br;
+    q31 o_i = ai + bi;
+    s64 x_r = (e_r + wr * o_i + wi * o_r).v;
+    s64 x_i = (e_i - wr * o_r + wi * o_i).v;
+    return (u64)(x_r * x_r + x_i * x_i) >> 2;
+}
+
+intern void split_power(const audio_fft *fft, const s32 *re, const s32 *im, u64 *power)
+{
+    sizet half = fft->size / 2;
+    s64 dc = (s64)re[0] + im[0];
+    s64 nyquist = (s64)re[0] - im[0];
+    power[0] = (u64)(dc * dc);
+    power[half] = (u64)(nyquist * nyquist);
+    for (sizet k = 1; k < half; ++k) {
+        power[k] = split_bin_power({re[k]}, {im[k]}, {re[half - k]}, {im[half - k]}, {fft->split_cos[k]}, {fft->split_sin[k]});
+    }
+}
+#else
+template<class V>
+intern V split_bin_power(V ar, V ai, V br, V bi, V wr, V wi)
+{
+    V e_r = ar + br;
+    V e_i = ai - bi;
+    V o_r = ar - br;
+    V o_i = ai + bi;
+    V x_r = e_r + wr * o_i + wi * o_r;
+    V x_i = e_i - wr * o_r + wi * o_i;
+    return (x_r * x_r + x_i * x_i) * 0.25f;
+}
+
+intern void split_power(const audio_fft *fft, const f32 *re, const f32 *im, f32 *power)
+{
+    sizet half = fft->size / 2;
+    power[0] = (re[0] + im[0]) * (re[0] + im[0]);
+    power[half] = (re[0] - im[0]) * (re[0] - im[0]);
+
+    sizet k = 1;
+#if defined(AUDIO_FFT_SIMD)
+    // Bins half - k down to half - k - 3 are read as a vector and reversed
+    for (; k + 4 <= half; k += 4) {
+        f32x4 br = reverse4(load_lanes<f32x4>(re + half - k - 3));
+        f32x4 bi = reverse4(load_lanes<f32x4>(im + half - k - 3));
+        f32x4 p = split_bin_power(load_lanes<f32x4>(re + k),
+                                  load_lanes<f32x4>(im + k),
+                                  br,
+                                  bi,
+                                  load_lanes<f32x4>(fft->split_cos + k),
+                                  load_lanes<f32x4>(fft->split_sin + k));
+        store_lanes(power + k, p);
+    }
+#endif
+    for (; k < half; ++k) {
+        power[k] = split_bin_power(re[k], im[k], re[half - k], im[half - k], fft->split_cos[k], fft->split_sin[k]);
+    }
+}
+#endif
+
+bool audio_fft_init(audio_fft *fft, sizet size)
+{
+    asrt(size >= 2 && (size & (size - 1)) == 0);
+    *fft = {};
+    fft->size = size;
+    sizet half = size / 2;
+
+    // Plan the radix 4 passes, then one radix 2 pass if a factor of 2 is left over
+    sizet twiddle_count{};
+    sizet span = half;
+    sizet stride = 1;
+    while (span >= 4) {
+        asrt(fft->stage_count < AUDIO_FFT_MAX_STAGES);
+        fft->stages[fft->stage_count++] = {span, stride, nullptr};
+        twiddle_count += 6 * (span / 4);
+        span /= 4;
+        stride *= 4;
+    }
+    fft->radix2 = (span == 2);
+
+    fft->twiddles = (audio_fft_value *)malloc((twiddle_count ? twiddle_count : 1) * sizeof(audio_fft_value));
+    fft->split_cos = (audio_fft_value *)malloc(half * sizeof(audio_fft_value));
+    fft->split_sin = (audio_fft_value *)malloc(half * sizeof(audio_fft_value));
+    bool allocated = fft->twiddles && fft->split_cos && fft->split_sin;
+    for (sizet b = 0; b < 2; ++b) {
+        fft->re[b] = (audio_fft_value *)malloc(half * sizeof(audio_fft_value));
+        fft->im[b] = (audio_fft_value *)malloc(half * sizeof(audio_fft_value));
+        allocated = allocated && fft->re[b] && fft->im[b];
+    }
+    if (!allocated) {
+        wlog("Could not allocate %lu point FFT", size);
+        audio_fft_terminate(fft);
+        return false;
+    }
+
+    audio_fft_value *tw = fft->twiddles;
+    for (sizet s = 0; s < fft->stage_count; ++s) {
+        auto st = &fft->stages[s];
+        sizet quarter = st->span / 4;
+        st->twiddles = tw;
+        for (sizet p = 0; p < quarter; ++p) {
+            for (sizet k = 1; k <= 3; ++k) {
+                f64 angle = -2.0 * M_PI * (f64)(k * p) / st->span;
+                tw[(2 * k - 2) * quarter + p] = to_twiddle(cos(angle));
+                tw[(2 * k - 1) * quarter + p] = to_twiddle(sin(angle));
+            }
+        }
+        tw += 6 * quarter;
+    }
+    for (sizet k = 0; k < half; ++k) {
+        f64 angle = -2.0 * M_PI * k / size;
+        fft->split_cos[k] = to_twiddle(cos(angle));
+        fft->split_sin[k] = to_twiddle(sin(angle));
+    }
+    return true;
+}
+
+void audio_fft_terminate(audio_fft *fft)
+{
+    free(fft->twiddles);
+    free(fft->split_cos);
+    free(fft->split_sin);
+    for (sizet b = 0; b < 2; ++b) {
+        free(fft->re[b]);
+        free(fft->im[b]);
+    }
+    *fft = {};
+}
+
+void audio_fft_power(audio_fft *fft, const audio_fft_value *in, audio_fft_power_value *power)
+{
+    sizet half = fft->size / 2;
+    audio_fft_value *re = fft->re[0];
+    audio_fft_value *im = fft->im[0];
+
+    // Even samples are the real parts and odd samples the imaginary parts of the packed transform
+    sizet k = 0;
+#if defined(AUDIO_FFT_SIMD)
+    for (; k + 4 <= half; k += 4) {
+        f32x4 even;
+        f32x4 odd;
+        load4_deinterleaved(in + 2 * k, &even, &odd);
+        store_lanes(re + k, even);
+        store_lanes(im + k, odd);
+    }
+#endif
+    for (; k < half; ++k) {
+        re[k] = in[2 * k];
+        im[k] = in[2 * k + 1];
+    }
+
+    sizet cur = 0;
+    for (sizet s = 0; s < fft->stage_count; ++s) {
+        radix4_pass(fft->stages[s], fft->re[cur], fft->im[cur], fft->re[cur ^ 1], fft->im[cur ^ 1]);
+        cur ^= 1;
+    }
+    if (fft->radix2) {
+        radix2_pass(fft->re[cur], fft->im[cur], half / 2);
+    }
+    split_power(fft, fft->re[cur], fft->im[cur], power);
+}
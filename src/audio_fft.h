@@ -0,0 +1,63 @@
+#pragma once
+#include "basic_types.h"
+
+// Enough passes for a 2^32 point transform
+inline constexpr sizet AUDIO_FFT_MAX_STAGES = 16;
+
+#if defined(AUDIO_DSP_FIXED_POINT)
+// Fixed point builds transform s32 values with Q31 twiddles, rounding after each twiddle multiply, and give the power as
+// u64. Nothing is scaled between passes - the input has to leave room for the transform to grow (see audio_fft_power).
+typedef s32 audio_fft_value;
+typedef u64 audio_fft_power_value;
+#else
+typedef f32 audio_fft_value;
+typedef f32 audio_fft_power_value;
+#endif
+
+// One radix 4 pass - stride interleaved transforms of span points are each split in to four of span / 4 points
+struct audio_fft_stage
+{
+    sizet span;
+    sizet stride;
+    // span / 4 twiddles for each of the three rotated outputs, as w1 real, w1 imaginary, w2 real, and so on
+    const audio_fft_value *twiddles;
+};
+
+// Real FFT of a fixed power of two size. The real input is packed in to a complex transform of half the size, which is
+// then split back out in to the spectrum of the real input. The complex transform is a Stockham radix 4 (plus one radix 2
+// pass for odd powers of two), so every pass reads and writes with unit stride and is done four points at a time with
+// NEON or SSE2 - picked at compile time like the audio_dsp kernels, except in fixed point builds, which run the same passes
+// as scalar code. The pass plan and all twiddles are computed on init so transforms are real time safe, but the work
+// buffers are not shared - each thread doing transforms needs its own.
+struct audio_fft
+{
+    sizet size;
+    audio_fft_stage stages[AUDIO_FFT_MAX_STAGES];
+    sizet stage_count;
+    // Set when the half size transform finishes with a radix 2 pass
+    bool radix2;
+    audio_fft_value *twiddles;
+    // Twiddles for splitting the packed transform, size / 2 of each
+    audio_fft_value *split_cos;
+    audio_fft_value *split_sin;
+    // Two split complex buffers of size / 2 points the passes go back and forth between
+    audio_fft_value *re[2];
+    audio_fft_value *im[2];
+};
+
+bool audio_fft_init(audio_fft *fft, sizet size);
+void audio_fft_terminate(audio_fft *fft);
+
+// Power spectrum (squared magnitude) of size real samples in to size / 2 + 1 bins from DC to nyquist. In fixed point builds
+// the input must be under 2^audio_fft_input_bits in magnitude - the transform then can't pass 2^31 and the power can't pass
+// 2^60. Twiddle rounding puts the magnitude of each bin within size / 16 of exact, so inputs should be scaled up to use the
+// bits they're allowed.
+void audio_fft_power(audio_fft *fft, const audio_fft_value *in, audio_fft_power_value *power);
+
+#if defined(AUDIO_DSP_FIXED_POINT)
+// Bits of magnitude the input to a fixed point transform can have - 2^29 / size, so 20 for 512 points
+inline u32 audio_fft_input_bits(const audio_fft *fft)
+{
+    return 29 - (u32)__builtin_ctzll(fft->size);
+}
+#endif
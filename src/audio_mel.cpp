@@ -0,0 +1,220 @@
+#include <cmath>
+#include <cstdlib>
+
+#include "logging.h"
+#include "audio_dsp.h"
+#include "audio_mel.h"
+
+// Whisper takes the log of the band power with this as the floor
+intern constexpr f32 MEL_POWER_FLOOR = 1e-10f;
+intern constexpr f64 MEL_MAX_HZ = 8000.0;
+
+#if defined(AUDIO_DSP_FIXED_POINT)
+// Power bins are shifted down as far as needed for this many bits of headroom over the largest of them, so a band sum of
+// 16 bit weights over up to 512 bins can't overflow
+intern constexpr s32 MEL_SUM_HEADROOM_BITS = 16 + 9;
+#endif
+
+// Slaney mel scale - linear up to 1 kHz and logarithmic above, which is what librosa and so Whisper use
+intern constexpr f64 SLANEY_HZ_PER_MEL = 200.0 / 3.0;
+intern constexpr f64 SLANEY_LOG_HZ = 1000.0;
+intern constexpr f64 SLANEY_LOG_MEL = SLANEY_LOG_HZ / SLANEY_HZ_PER_MEL;
+
+intern f64 slaney_log_step()
+{
+    return log(6.4) / 27.0;
+}
+
+intern f64 hz_to_mel(f64 hz)
+{
+    return (hz < SLANEY_LOG_HZ) ? hz / SLANEY_HZ_PER_MEL : SLANEY_LOG_MEL + log(hz / SLANEY_LOG_HZ) / slaney_log_step();
+}
+
+intern f64 mel_to_hz(f64 mel)
+{
+    return (mel < SLANEY_LOG_MEL) ? mel * SLANEY_HZ_PER_MEL : SLANEY_LOG_HZ * exp(slaney_log_step() * (mel - SLANEY_LOG_MEL));
+}
+
+bool audio_mel_ring_init(audio_mel_ring *mr, sizet sample_capacity, sizet hop_sample_count)
+{
+    mr->capacity = (sample_capacity + hop_sample_count - 1) / hop_sample_count;
+    mr->hop_sample_count = hop_sample_count;
+    mr->buffer = (audio_mel_frame *)calloc(mr->capacity, sizeof(audio_mel_frame));
+    if (!mr->buffer) {
+        wlog("Could not allocate %lu log mel frames", mr->capacity);
+        return false;
+    }
+    return true;
+}
+
+void audio_mel_ring_terminate(audio_mel_ring *mr)
+{
+    free(mr->buffer);
+    mr->buffer = nullptr;
+    mr->capacity = 0;
+}
+
+ring_view<const audio_mel_frame> audio_mel_ring_view(const audio_mel_ring *mr, u64 first, sizet count)
+{
+    asrt(count <= mr->capacity);
+    sizet offset = first % mr->capacity;
+    sizet head_count = mr->capacity - offset;
+    if (head_count >= count) {
+        return {mr->buffer + offset, count, mr->buffer, 0};
+    }
+    return {mr->buffer + offset, head_count, mr->buffer, count - head_count};
+}
+
+// Triangular filters between neighbouring points evenly spaced in mel, each scaled by 2 / its width in Hz so the bands
+// have equal area
+intern void design_filter_bank(audio_mel *mel, u32 sample_rate)
+{
+    sizet bin_count = mel->fft_size / 2 + 1;
+    f64 bin_hz = (f64)sample_rate / mel->fft_size;
+    f64 max_mel = hz_to_mel((MEL_MAX_HZ < sample_rate / 2.0) ? MEL_MAX_HZ : sample_rate / 2.0);
+    f64 edges[AUDIO_MEL_BIN_COUNT + 2];
+    for (sizet i = 0; i < AUDIO_MEL_BIN_COUNT + 2; ++i) {
+        edges[i] = mel_to_hz(max_mel * i / (AUDIO_MEL_BIN_COUNT + 1));
+    }
+
+#if defined(AUDIO_DSP_FIXED_POINT)
+    // No weight is over its band's norm, and the narrowest band has the largest
+    f64 max_norm{};
+    for (sizet m = 0; m < AUDIO_MEL_BIN_COUNT; ++m) {
+        max_norm = fmax(max_norm, 2.0 / (edges[m + 2] - edges[m]));
+    }
+    mel->weight_shift = (u32)floor(log2(65535.0 / max_norm));
+#endif
+
+    u32 offset{};
+    for (sizet m = 0; m < AUDIO_MEL_BIN_COUNT; ++m) {
+        f64 lo = edges[m];
+        f64 center = edges[m + 1];
+        f64 hi = edges[m + 2];
+        f64 norm = 2.0 / (hi - lo);
+        mel->filter_first[m] = 0;
+        mel->filter_count[m] = 0;
+        mel->filter_offset[m] = offset;
+        for (sizet k = 0; k < bin_count; ++k) {
+            f64 hz = k * bin_hz;
+            f64 w = fmin((hz - lo) / (center - lo), (hi - hz) / (hi - center));
+            if (w <= 0.0) {
+                continue;
+            }
+            if (mel->filter_count[m] == 0) {
+                mel->filter_first[m] = (u32)k;
+            }
+#if defined(AUDIO_DSP_FIXED_POINT)
+            mel->weights[offset++] = (u16)lround(ldexp(w * norm, (s32)mel->weight_shift));
+#else
+            mel->weights[offset++] = (f32)(w * norm);
+#endif
+            ++mel->filter_count[m];
+        }
+    }
+}
+
+bool audio_mel_init(audio_mel *mel, u32 sample_rate)
+{
+    mel->window_sample_count = (sizet)sample_rate * AUDIO_MEL_WINDOW_MS / 1000;
+    mel->fft_size = 1;
+    while (mel->fft_size < mel->window_sample_count) {
+        mel->fft_size *= 2;
+    }
+    sizet bin_count = mel->fft_size / 2 + 1;
+    mel->window = (decltype(mel->window))malloc(mel->window_sample_count * sizeof(*mel->window));
+    mel->frame = (audio_fft_value *)calloc(mel->fft_size, sizeof(audio_fft_value));
+    mel->power = (audio_fft_power_value *)malloc(bin_count * sizeof(audio_fft_power_value));
+    // Neighbouring triangles overlap by half, so each bin is in at most two of them
+    mel->weights = (decltype(mel->weights))malloc(2 * bin_count * sizeof(*mel->weights));
+    if (!mel->window || !mel->frame || !mel->power || !mel->weights || !audio_fft_init(&mel->fft, mel->fft_size)) {
+        wlog("Could not allocate log mel buffers");
+        audio_mel_terminate(mel);
+        return false;
+    }
+    for (sizet i = 0; i < mel->window_sample_count; ++i) {
+        f64 w = 0.5 - 0.5 * cos(2.0 * M_PI * i / mel->window_sample_count);
+#if defined(AUDIO_DSP_FIXED_POINT)
+        // Scaled by 2^15 so the power comes out an exact power of two over the float path's - only the peak sample of
+        // one has to be brought down to fit
+        mel->window[i] = (s16)((w < 1.0) ? lround(w * 32768.0) : 32767);
+#else
+        mel->window[i] = (f32)w;
+#endif
+    }
+    design_filter_bank(mel, sample_rate);
+    return true;
+}
+
+void audio_mel_terminate(audio_mel *mel)
+{
+    audio_fft_terminate(&mel->fft);
+    free(mel->window);
+    free(mel->frame);
+    free(mel->power);
+    free(mel->weights);
+    mel->window = nullptr;
+    mel->frame = nullptr;
+    mel->power = nullptr;
+    mel->weights = nullptr;
+}
+
+#if defined(AUDIO_DSP_FIXED_POINT)
+void audio_mel_compute(audio_mel *mel, const s16 *samples, audio_mel_frame *out)
+{
+    // Block floating point on the way in - the frame is scaled up by its peak to use all of the transform's input bits
+    u32 peak{};
+    for (sizet i = 0; i < mel->window_sample_count; ++i) {
+        u32 mag = (u32)abs(samples[i]);
+        peak = (mag > peak) ? mag : peak;
+    }
+    u32 window_shift = audio_window_q15_shift(peak, audio_fft_input_bits(&mel->fft));
+    audio_window_q15(samples, mel->window, mel->window_sample_count, window_shift, mel->frame);
+    audio_fft_power(&mel->fft, mel->frame, mel->power);
+
+    // And on the way out - the power is shifted down just enough for the band sums to fit, so quiet frames keep every bit
+    // and loud ones keep 39 bits under their largest bin
+    sizet bin_count = mel->fft_size / 2 + 1;
+    u64 all_bits{};
+    for (sizet k = 0; k < bin_count; ++k) {
+        all_bits |= mel->power[k];
+    }
+    s32 top = all_bits ? 64 - __builtin_clzll(all_bits) : 0;
+    s32 shift = (top + MEL_SUM_HEADROOM_BITS > 64) ? top + MEL_SUM_HEADROOM_BITS - 64 : 0;
+
+    // Back out the scale of the sums to get the float path's log10 - samples are Q15 with window_shift more fractional
+    // bits, which is twice that in the power
+    s32 scale_q16 = (2 * (15 + (s32)window_shift) + (s32)mel->weight_shift - shift) << 16;
+    constexpr f32 log10_per_log2_q16 = 0.30102999566f / 65536.0f;
+    f32 floor = log10f(MEL_POWER_FLOOR);
+    for (sizet m = 0; m < AUDIO_MEL_BIN_COUNT; ++m) {
+        const u16 *w = mel->weights + mel->filter_offset[m];
+        const u64 *p = mel->power + mel->filter_first[m];
+        u64 sum{};
+        for (u32 k = 0; k < mel->filter_count[m]; ++k) {
+            sum += (p[k] >> shift) * w[k];
+        }
+        f32 bin = sum ? (f32)(audio_log2_q16(sum) - scale_q16) * log10_per_log2_q16 : floor;
+        out->bins[m] = (bin > floor) ? bin : floor;
+    }
+}
+#else
+void audio_mel_compute(audio_mel *mel, const s16 *samples, audio_mel_frame *out)
+{
+    // Samples are scaled to [-1, 1) like Whisper's float input - the rest of the frame stays zero
+    for (sizet i = 0; i < mel->window_sample_count; ++i) {
+        mel->frame[i] = samples[i] * (mel->window[i] / 32768.0f);
+    }
+    audio_fft_power(&mel->fft, mel->frame, mel->power);
+
+    for (sizet m = 0; m < AUDIO_MEL_BIN_COUNT; ++m) {
+        const f32 *w = mel->weights + mel->filter_offset[m];
+        const f32 *p = mel->power + mel->filter_first[m];
+        f32 sum{};
+        for (u32 k = 0; k < mel->filter_count[m]; ++k) {
+            sum += w[k] * p[k];
+        }
+        out->bins[m] = log10f((sum > MEL_POWER_FLOOR) ? sum : MEL_POWER_FLOOR);
+    }
+}
+#endif
@@ -0,0 +1,75 @@
+#pragma once
+#include "audio_fft.h"
+#include "spsc_ring.h"
+
+// Log mel spectrogram with Whisper's front end parameters - 25 ms Hann windows every 10 ms, 80 slaney mel bands from 0 to
+// 8 kHz (or nyquist below 16 kHz), and log10 of the band power floored at 1e-10. Windows are zero padded to the next power
+// of two for the FFT - at 16 kHz that's Whisper's 400 sample windows every 160 samples in a 512 point FFT. The filter bank
+// is designed for the FFT bins rather than loaded from a model file.
+inline constexpr sizet AUDIO_MEL_BIN_COUNT = 80;
+inline constexpr s32 AUDIO_MEL_HOP_MS = 10;
+inline constexpr s32 AUDIO_MEL_WINDOW_MS = 25;
+
+struct audio_mel_frame
+{
+    f32 bins[AUDIO_MEL_BIN_COUNT];
+};
+
+// Log mel frames of a sample ring, in lockstep with it - frame i is the window centered on ring position
+// i * hop_sample_count. Like audio_frame_ring there is a slot for each hop the ring can hold, so a frame is never overwritten
+// while its samples are still in use.
+struct audio_mel_ring
+{
+    audio_mel_frame *buffer;
+    sizet capacity;
+    sizet hop_sample_count;
+};
+
+bool audio_mel_ring_init(audio_mel_ring *mr, sizet sample_capacity, sizet hop_sample_count);
+void audio_mel_ring_terminate(audio_mel_ring *mr);
+
+inline audio_mel_frame *audio_mel_ring_at(const audio_mel_ring *mr, u64 frame)
+{
+    return mr->buffer + frame % mr->capacity;
+}
+
+// count frames starting at frame index first as at most two contiguous spans
+ring_view<const audio_mel_frame> audio_mel_ring_view(const audio_mel_ring *mr, u64 first, sizet count);
+
+// Window, transform, and filter bank for computing frames one at a time. Setup allocates, computing frames doesn't, but
+// each thread computing frames needs its own.
+struct audio_mel
+{
+    audio_fft fft;
+    sizet window_sample_count;
+    sizet fft_size;
+#if defined(AUDIO_DSP_FIXED_POINT)
+    // Periodic Hann window in Q15
+    s16 *window;
+#else
+    // Periodic Hann window
+    f32 *window;
+#endif
+    // The windowed and zero padded frame, and its power spectrum
+    audio_fft_value *frame;
+    audio_fft_power_value *power;
+    // Each band's triangle as a run of weights over the power spectrum bins starting at filter_first
+    u32 filter_first[AUDIO_MEL_BIN_COUNT];
+    u32 filter_count[AUDIO_MEL_BIN_COUNT];
+    u32 filter_offset[AUDIO_MEL_BIN_COUNT];
+#if defined(AUDIO_DSP_FIXED_POINT)
+    // Weights scaled by 2^weight_shift, as far as the largest of them fits in 16 bits
+    u16 *weights;
+    u32 weight_shift;
+#else
+    f32 *weights;
+#endif
+};
+
+bool audio_mel_init(audio_mel *mel, u32 sample_rate);
+void audio_mel_terminate(audio_mel *mel);
+
+// Compute one frame from window_sample_count samples. In fixed point builds the transform's rounding noise sits about 80 dB
+// under the loudest bin of each frame, so bins that far down come out noisy - but after Whisper's clamp to 8 under the
+// loudest bin they're within 1e-2 of the float path's (0.1 dB) on the sample audio at full scale and at -26 dB.
+void audio_mel_compute(audio_mel *mel, const s16 *samples, audio_mel_frame *out);
@@ -0,0 +1,148 @@
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <numeric>
+
+#include "logging.h"
+#include "audio_dsp.h"
+#include "audio_resample.h"
+
+// Zero crossings of the sinc on either side of the center, counted at the lower of the two rates - more gives a sharper
+// cutoff for more taps
+intern constexpr sizet RESAMPLE_ZERO_CROSSINGS = 24;
+// Passband edge as a fraction of the lower rate's nyquist frequency - the transition band sits between this and nyquist
+intern constexpr f64 RESAMPLE_CUTOFF = 0.9;
+// Kaiser window shape - 8.0 designs for a stopband around 80 dB down, which rounding the taps to Q15 brings to about 70 dB
+// (tests/test_audio_resample.cpp measures it)
+intern constexpr f64 RESAMPLE_KAISER_BETA = 8.0;
+// Taps per phase are rounded up to this so the dot product never needs a scalar tail
+intern constexpr sizet RESAMPLE_TAP_MULTIPLE = 16;
+// Input is taken this many samples at a time
+intern constexpr sizet RESAMPLE_BLOCK_SAMPLE_COUNT = 1024;
+
+// Zeroth order modified bessel function of the first kind
+intern f64 bessel_i0(f64 x)
+{
+    f64 sum = 1.0;
+    f64 term = 1.0;
+    for (int k = 1; k < 50; ++k) {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+        if (term < sum * 1e-12) {
+            break;
+        }
+    }
+    return sum;
+}
+
+// Fill the polyphase table from a windowed sinc lowpass designed at the upsampled rate. Each phase is scaled on its own to
+// a DC gain of exactly 1.0 so the quantized taps don't add a ripple at the phase rate. taps is scratch space for one phase.
+intern void design_filter(audio_resampler *rs, f64 *taps)
+{
+    sizet len = rs->tap_count * rs->up;
+    f64 center = (len - 1) / 2.0;
+    // Cutoff in cycles per sample at the upsampled rate
+    f64 fc = RESAMPLE_CUTOFF * 0.5 / (rs->up > rs->down ? rs->up : rs->down);
+    f64 window_norm = bessel_i0(RESAMPLE_KAISER_BETA);
+    for (u32 p = 0; p < rs->up; ++p) {
+        f64 sum{};
+        for (sizet j = 0; j < rs->tap_count; ++j) {
+            // Output phase p uses prototype taps p, p + up, p + 2 up ... against the newest sample first
+            sizet n = p + (rs->tap_count - 1 - j) * rs->up;
+            f64 x = n - center;
+            f64 sinc = (x == 0.0) ? 1.0 : sin(2.0 * M_PI * fc * x) / (2.0 * M_PI * fc * x);
+            f64 r = x / (center + 0.5);
+            f64 window = bessel_i0(RESAMPLE_KAISER_BETA * sqrt(fmax(0.0, 1.0 - r * r))) / window_norm;
+            taps[j] = sinc * window;
+            sum += taps[j];
+        }
+        for (sizet j = 0; j < rs->tap_count; ++j) {
+            f64 q15 = fmin(taps[j] / sum * 32768.0, 32767.0);
+            rs->coefs[p * rs->tap_count + j] = (s16)lround(q15);
+        }
+    }
+}
+
+bool audio_resampler_init(audio_resampler *rs, u32 in_rate, u32 out_rate)
+{
+    u32 g = std::gcd(in_rate, out_rate);
+    rs->in_rate = in_rate;
+    rs->out_rate = out_rate;
+    rs->up = out_rate / g;
+    rs->down = in_rate / g;
+    // Enough taps to cover the zero crossings at the lower rate, measured in input samples
+    sizet span = (rs->down + rs->up - 1) / rs->up;
+    span = (span > 0) ? span : 1;
+    rs->tap_count = 2 * RESAMPLE_ZERO_CROSSINGS * span;
+    rs->tap_count = (rs->tap_count + RESAMPLE_TAP_MULTIPLE - 1) / RESAMPLE_TAP_MULTIPLE * RESAMPLE_TAP_MULTIPLE;
+    rs->block_capacity = RESAMPLE_BLOCK_SAMPLE_COUNT;
+
+    rs->coefs = (s16 *)malloc(rs->up * rs->tap_count * sizeof(s16));
+    rs->history = (s16 *)calloc(rs->tap_count - 1 + rs->block_capacity, sizeof(s16));
+    f64 *taps = (f64 *)malloc(rs->tap_count * sizeof(f64));
+    if (!rs->coefs || !rs->history || !taps) {
+        wlog("Could not allocate %u phase resampler", rs->up);
+        free(taps);
+        audio_resampler_terminate(rs);
+        return false;
+    }
+    design_filter(rs, taps);
+    free(taps);
+
+    // Start with a window of silence so the first output lines up with the first input sample
+    rs->history_count = rs->tap_count - 1;
+    rs->next_index = rs->tap_count - 1;
+    rs->phase = 0;
+    ilog("Resampling %u Hz to %u Hz with %u phases of %lu taps (%lu bytes)",
+         in_rate,
+         out_rate,
+         rs->up,
+         rs->tap_count,
+         rs->up * rs->tap_count * sizeof(s16));
+    return true;
+}
+
+void audio_resampler_terminate(audio_resampler *rs)
+{
+    free(rs->coefs);
+    free(rs->history);
+    rs->coefs = nullptr;
+    rs->history = nullptr;
+}
+
+sizet audio_resample_max_output(const audio_resampler *rs, sizet in_count)
+{
+    return (in_count * rs->up) / rs->down + 1;
+}
+
+sizet audio_resample(audio_resampler *rs, const s16 *in, sizet in_count, s16 *out)
+{
+    sizet out_count{};
+    while (in_count > 0) {
+        sizet count = (in_count < rs->block_capacity) ? in_count : rs->block_capacity;
+        memcpy(rs->history + rs->history_count, in, count * sizeof(s16));
+        rs->history_count += count;
+        in += count;
+        in_count -= count;
+
+        while (rs->next_index < rs->history_count) {
+            const s16 *window = rs->history + rs->next_index + 1 - rs->tap_count;
+            s32 acc = audio_dot_s16(rs->coefs + rs->phase * rs->tap_count, window, rs->tap_count);
+            acc = (acc + (1 << 14)) >> 15;
+            acc = (acc > std::numeric_limits<s16>::max()) ? std::numeric_limits<s16>::max() : acc;
+            acc = (acc < std::numeric_limits<s16>::min()) ? std::numeric_limits<s16>::min() : acc;
+            out[out_count++] = (s16)acc;
+            rs->phase += rs->down;
+            rs->next_index += rs->phase / rs->up;
+            rs->phase %= rs->up;
+        }
+
+        // Keep only what the next output's window reaches back to
+        sizet keep_from = rs->next_index + 1 - rs->tap_count;
+        memmove(rs->history, rs->history + keep_from, (rs->history_count - keep_from) * sizeof(s16));
+        rs->history_count -= keep_from;
+        rs->next_index -= keep_from;
+    }
+    return out_count;
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include "basic_types.h"
+
+// Polyphase FIR resampler from in_rate to out_rate for a single channel of s16 samples. The rate ratio is reduced to
+// up/down and the windowed sinc lowpass is split in to up phases of tap_count taps each, so every output sample is one
+// tap_count long dot product against the most recent input. Setup allocates, processing doesn't and is real time safe.
+struct audio_resampler
+{
+    u32 in_rate;
+    u32 out_rate;
+    u32 up;
+    u32 down;
+    sizet tap_count;
+    // up phases of tap_count Q15 taps, each stored oldest sample first so it lines up with the history
+    s16 *coefs;
+    // The last tap_count - 1 input samples followed by room for a block of new ones
+    s16 *history;
+    sizet history_count;
+    sizet block_capacity;
+    // Index in history of the newest sample under the next output, and the phase of the next output
+    sizet next_index;
+    u32 phase;
+};
+
+bool audio_resampler_init(audio_resampler *rs, u32 in_rate, u32 out_rate);
+void audio_resampler_terminate(audio_resampler *rs);
+
+// Maximum number of samples audio_resample produces from in_count input samples
+sizet audio_resample_max_output(const audio_resampler *rs, sizet in_count);
+
+// Resample in_count samples in to out, which must hold audio_resample_max_output samples, and return how many were
+// written. Input that doesn't complete an output sample is kept for the next call.
+sizet audio_resample(audio_resampler *rs, const s16 *in, sizet in_count, s16 *out);
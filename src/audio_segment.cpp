@@ -0,0 +1,407 @@
+#include <new>
+
+#include "audio_segment.h"
+
+bool audio_frame_ring_init(audio_frame_ring *fr, sizet sample_capacity, sizet frame_sample_count)
+{
+    fr->capacity = (sample_capacity + frame_sample_count - 1) / frame_sample_count;
+    fr->frame_sample_count = frame_sample_count;
+    fr->buffer = (audio_frame_features *)calloc(fr->capacity, sizeof(audio_frame_features));
+    if (!fr->buffer) {
+        wlog("Could not allocate features for %lu frames", fr->capacity);
+        return false;
+    }
+    return true;
+}
+
+void audio_frame_ring_terminate(audio_frame_ring *fr)
+{
+    free(fr->buffer);
+    fr->buffer = nullptr;
+    fr->capacity = 0;
+}
+
+ring_view<const audio_frame_features> audio_frame_ring_view(const audio_frame_ring *fr, u64 first, sizet count)
+{
+    asrt(count <= fr->capacity);
+    sizet offset = first % fr->capacity;
+    sizet head_count = fr->capacity - offset;
+    if (head_count >= count) {
+        return {fr->buffer + offset, count, fr->buffer, 0};
+    }
+    return {fr->buffer + offset, head_count, fr->buffer, count - head_count};
+}
+
+void audio_segment_table_init(audio_segment_table *tbl, spsc_ring<s16> *ring, const audio_frame_ring *frames, const audio_mel_ring *mel)
+{
+    tbl->ring = ring;
+    tbl->frames = frames;
+    tbl->mel = mel;
+    tbl->head = 0;
+    tbl->count = 0;
+    tbl->end_pos = ring->read_pos.load(std::memory_order_relaxed);
+    tbl->hold_pos = INVALID_IND;
+    pthread_mutex_init(&tbl->mutex, nullptr);
+    pthread_cond_init(&tbl->slot_freed, nullptr);
+}
+
+void audio_segment_table_terminate(audio_segment_table *tbl)
+{
+    if (tbl->count > 0) {
+        wlog("Terminating segment table with %lu segments still referenced", tbl->count);
+    }
+    pthread_cond_destroy(&tbl->slot_freed);
+    pthread_mutex_destroy(&tbl->mutex);
+}
+
+// Give ring space back up to the start of the oldest segment somebody will still read - one that has references and
+// wasn't dropped before a worker started on it. If there are none everything handed out so far is given back. Slots
+// themselves are only reused once all references are gone. Must hold the mutex.
+intern void reclaim_segments(audio_segment_table *tbl)
+{
+    u64 release_pos = tbl->end_pos;
+    for (sizet i = 0; i < tbl->count; ++i) {
+        auto seg = &tbl->slots[(tbl->head + i) % AUDIO_MAX_SEGMENTS];
+        if (seg->refs.load(std::memory_order_acquire) != 0 && seg->state.load(std::memory_order_acquire) != AUDIO_SEGMENT_DROPPED) {
+            release_pos = seg->start_pos;
+            break;
+        }
+    }
+    if (release_pos > tbl->hold_pos) {
+        release_pos = tbl->hold_pos;
+    }
+    if (release_pos > tbl->ring->read_pos.load(std::memory_order_relaxed)) {
+        spsc_ring_consume_to(tbl->ring, release_pos);
+    }
+
+    while (tbl->count > 0 && tbl->slots[tbl->head].refs.load(std::memory_order_acquire) == 0) {
+        tbl->head = (tbl->head + 1) % AUDIO_MAX_SEGMENTS;
+        --tbl->count;
+        pthread_cond_signal(&tbl->slot_freed);
+    }
+}
+
+audio_segment *audio_segment_create(audio_segment_table *tbl, u32 id, u64 start_pos, u64 end_pos)
+{
+    rt_assert_can_block();
+    pthread_mutex_lock(&tbl->mutex);
+    asrt(start_pos <= end_pos);
+    asrt(start_pos >= tbl->ring->read_pos.load(std::memory_order_relaxed));
+    asrt(start_pos % tbl->frames->frame_sample_count == 0 && end_pos % tbl->frames->frame_sample_count == 0);
+    while (tbl->count == AUDIO_MAX_SEGMENTS) {
+        pthread_cond_wait(&tbl->slot_freed, &tbl->mutex);
+    }
+    auto seg = &tbl->slots[(tbl->head + tbl->count) % AUDIO_MAX_SEGMENTS];
+    ++tbl->count;
+
+    seg->id = id;
+    seg->start_pos = start_pos;
+    seg->sample_count = (sizet)(end_pos - start_pos);
+    seg->partial = false;
+    seg->part = 0;
+    seg->station = nullptr;
+    seg->publish_ns = 0;
+    seg->confidence = 0.0f;
+    auto view = spsc_ring_view(tbl->ring, seg->start_pos, seg->sample_count);
+    seg->pcm = {view.head, view.head_count, view.tail, view.tail_count};
+    seg->frame_count = seg->sample_count / tbl->frames->frame_sample_count;
+    seg->frames = audio_frame_ring_view(tbl->frames, start_pos / tbl->frames->frame_sample_count, seg->frame_count);
+    seg->mel_frame_count = seg->sample_count / tbl->mel->hop_sample_count;
+    seg->mel = audio_mel_ring_view(tbl->mel, start_pos / tbl->mel->hop_sample_count, seg->mel_frame_count);
+    seg->refs.store(1, std::memory_order_relaxed);
+    seg->state.store(AUDIO_SEGMENT_QUEUED, std::memory_order_relaxed);
+    seg->owner = tbl;
+    seg->pool = nullptr;
+    if (end_pos > tbl->end_pos) {
+        tbl->end_pos = end_pos;
+    }
+    pthread_mutex_unlock(&tbl->mutex);
+    return seg;
+}
+
+void audio_segment_table_set_hold(audio_segment_table *tbl, u64 pos)
+{
+    pthread_mutex_lock(&tbl->mutex);
+    tbl->hold_pos = pos;
+    reclaim_segments(tbl);
+    pthread_mutex_unlock(&tbl->mutex);
+}
+
+void audio_segment_table_skip(audio_segment_table *tbl, u64 end_pos)
+{
+    pthread_mutex_lock(&tbl->mutex);
+    if (end_pos > tbl->end_pos) {
+        tbl->end_pos = end_pos;
+    }
+    reclaim_segments(tbl);
+    pthread_mutex_unlock(&tbl->mutex);
+}
+
+void audio_segment_retain(audio_segment *seg)
+{
+    seg->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+intern void pool_release(audio_segment *seg)
+{
+    auto pool = seg->pool;
+    pthread_mutex_lock(&pool->mutex);
+    if (seg->heap) {
+        free(seg->buffer);
+        free(seg->frame_buffer);
+        free(seg->mel_buffer);
+        delete seg;
+    }
+    else {
+        pthread_cond_signal(&pool->entry_freed);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+bool audio_segment_begin(audio_segment *seg)
+{
+    u32 expected = AUDIO_SEGMENT_QUEUED;
+    return seg->state.compare_exchange_strong(expected, AUDIO_SEGMENT_ACTIVE, std::memory_order_acq_rel);
+}
+
+void audio_segment_release(audio_segment *seg)
+{
+    // The acq_rel makes sure all reads of the samples through this reference happen before the space is reclaimed
+    if (seg->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+        return;
+    }
+
+    if (seg->pool) {
+        pool_release(seg);
+        return;
+    }
+
+    auto tbl = seg->owner;
+    pthread_mutex_lock(&tbl->mutex);
+    reclaim_segments(tbl);
+    pthread_mutex_unlock(&tbl->mutex);
+}
+
+sizet audio_segment_table_drop_queued(audio_segment_table *tbl)
+{
+    sizet dropped{};
+    pthread_mutex_lock(&tbl->mutex);
+    for (sizet i = 0; i < tbl->count; ++i) {
+        auto seg = &tbl->slots[(tbl->head + i) % AUDIO_MAX_SEGMENTS];
+        u32 expected = AUDIO_SEGMENT_QUEUED;
+        if (seg->state.compare_exchange_strong(expected, AUDIO_SEGMENT_DROPPED, std::memory_order_acq_rel)) {
+            ++dropped;
+        }
+    }
+    reclaim_segments(tbl);
+    pthread_mutex_unlock(&tbl->mutex);
+    return dropped;
+}
+
+intern sizet count_in_use(audio_segment_pool *pool)
+{
+    sizet in_use{};
+    for (sizet i = 0; i < AUDIO_SEGMENT_POOL_COUNT; ++i) {
+        in_use += (pool->entries[i].refs.load(std::memory_order_relaxed) > 0);
+    }
+    return in_use;
+}
+
+bool audio_segment_pool_init(audio_segment_pool *pool,
+                             sizet entry_sample_capacity,
+                             sizet entry_frame_capacity,
+                             sizet entry_mel_capacity,
+                             audio_pool_empty_policy policy)
+{
+    sizet sample_bytes = AUDIO_SEGMENT_POOL_COUNT * entry_sample_capacity * sizeof(s16);
+    sizet frame_bytes = AUDIO_SEGMENT_POOL_COUNT * entry_frame_capacity * sizeof(audio_frame_features);
+    sizet mel_bytes = AUDIO_SEGMENT_POOL_COUNT * entry_mel_capacity * sizeof(audio_mel_frame);
+    sizet bytes = sample_bytes + frame_bytes + mel_bytes;
+    pool->mem = (s16 *)malloc(sample_bytes);
+    pool->frame_mem = (audio_frame_features *)malloc(frame_bytes);
+    pool->mel_mem = (audio_mel_frame *)malloc(mel_bytes);
+    if (!pool->mem || !pool->frame_mem || !pool->mel_mem) {
+        wlog("Could not allocate %lu bytes for segment pool", bytes);
+        free(pool->mem);
+        free(pool->frame_mem);
+        free(pool->mel_mem);
+        pool->mem = nullptr;
+        pool->frame_mem = nullptr;
+        pool->mel_mem = nullptr;
+        return false;
+    }
+    // Touch every page now so we don't take page faults the first time each buffer is used
+    memset(pool->mem, 0, sample_bytes);
+    memset(pool->frame_mem, 0, frame_bytes);
+    memset(pool->mel_mem, 0, mel_bytes);
+
+    pool->entry_sample_capacity = entry_sample_capacity;
+    pool->entry_frame_capacity = entry_frame_capacity;
+    pool->entry_mel_capacity = entry_mel_capacity;
+    pool->policy = policy;
+    pool->next_seq = 0;
+    pool->stats = {};
+    for (sizet i = 0; i < AUDIO_SEGMENT_POOL_COUNT; ++i) {
+        auto entry = &pool->entries[i];
+        entry->buffer = pool->mem + i * entry_sample_capacity;
+        entry->frame_buffer = pool->frame_mem + i * entry_frame_capacity;
+        entry->mel_buffer = pool->mel_mem + i * entry_mel_capacity;
+        entry->pool = pool;
+        entry->owner = nullptr;
+        entry->heap = false;
+        entry->refs.store(0, std::memory_order_relaxed);
+        entry->state.store(AUDIO_SEGMENT_DROPPED, std::memory_order_relaxed);
+    }
+    pthread_mutex_init(&pool->mutex, nullptr);
+    pthread_cond_init(&pool->entry_freed, nullptr);
+    ilog("Allocated segment pool of %lu buffers (%lu bytes)", AUDIO_SEGMENT_POOL_COUNT, bytes);
+    return true;
+}
+
+void audio_segment_pool_terminate(audio_segment_pool *pool)
+{
+    if (!pool->mem) {
+        return;
+    }
+    ilog("Segment pool stats - high water: %lu/%lu exhausted: %lu dropped: %lu heap allocs: %lu heap failures: %lu detached: %lu",
+         pool->stats.high_water,
+         AUDIO_SEGMENT_POOL_COUNT,
+         pool->stats.exhausted,
+         pool->stats.dropped,
+         pool->stats.heap_allocs,
+         pool->stats.heap_failures,
+         pool->stats.detached);
+    sizet in_use = count_in_use(pool);
+    if (in_use > 0) {
+        wlog("Terminating segment pool with %lu buffers still referenced", in_use);
+    }
+    pthread_cond_destroy(&pool->entry_freed);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->mem);
+    free(pool->frame_mem);
+    free(pool->mel_mem);
+    pool->mem = nullptr;
+    pool->frame_mem = nullptr;
+    pool->mel_mem = nullptr;
+}
+
+intern audio_segment *find_free_entry(audio_segment_pool *pool)
+{
+    for (sizet i = 0; i < AUDIO_SEGMENT_POOL_COUNT; ++i) {
+        if (pool->entries[i].refs.load(std::memory_order_acquire) == 0) {
+            return &pool->entries[i];
+        }
+    }
+    return nullptr;
+}
+
+// Mark the oldest pooled segment that hasn't been started as dropped - its buffer frees up as soon as a worker pulls it
+// off the queue and skips it
+intern void drop_oldest_queued(audio_segment_pool *pool)
+{
+    audio_segment *oldest{};
+    for (sizet i = 0; i < AUDIO_SEGMENT_POOL_COUNT; ++i) {
+        auto entry = &pool->entries[i];
+        if (entry->state.load(std::memory_order_acquire) == AUDIO_SEGMENT_QUEUED && (!oldest || entry->seq < oldest->seq)) {
+            oldest = entry;
+        }
+    }
+    u32 expected = AUDIO_SEGMENT_QUEUED;
+    if (oldest && oldest->state.compare_exchange_strong(expected, AUDIO_SEGMENT_DROPPED, std::memory_order_acq_rel)) {
+        ++pool->stats.dropped;
+        wlog("Segment pool empty - dropped queued segment %u", oldest->id);
+    }
+}
+
+// An entry with buffers of its own for when the pool is empty, or null if any of them can't be allocated
+intern audio_segment *alloc_heap_entry(audio_segment_pool *pool)
+{
+    auto entry = new (std::nothrow) audio_segment{};
+    if (!entry) {
+        return nullptr;
+    }
+    entry->buffer = (s16 *)malloc(pool->entry_sample_capacity * sizeof(s16));
+    entry->frame_buffer = (audio_frame_features *)malloc(pool->entry_frame_capacity * sizeof(audio_frame_features));
+    entry->mel_buffer = (audio_mel_frame *)malloc(pool->entry_mel_capacity * sizeof(audio_mel_frame));
+    if (!entry->buffer || !entry->frame_buffer || !entry->mel_buffer) {
+        free(entry->buffer);
+        free(entry->frame_buffer);
+        free(entry->mel_buffer);
+        delete entry;
+        return nullptr;
+    }
+    entry->pool = pool;
+    entry->heap = true;
+    return entry;
+}
+
+// Returns null if the pool is empty and a heap entry couldn't be allocated
+intern audio_segment *acquire_entry(audio_segment_pool *pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    auto entry = find_free_entry(pool);
+    if (!entry) {
+        ++pool->stats.exhausted;
+        wlog("Segment pool exhausted (%lu times so far)", pool->stats.exhausted);
+        if (pool->policy == AUDIO_POOL_EMPTY_HEAP) {
+            entry = alloc_heap_entry(pool);
+            if (!entry) {
+                ++pool->stats.heap_failures;
+                wlog("Could not allocate a heap segment buffer (%lu times so far) - leaving the segment in the ring",
+                     pool->stats.heap_failures);
+                pthread_mutex_unlock(&pool->mutex);
+                return nullptr;
+            }
+            ++pool->stats.heap_allocs;
+        }
+        else {
+            if (pool->policy == AUDIO_POOL_EMPTY_DROP_OLDEST) {
+                drop_oldest_queued(pool);
+            }
+            while (!(entry = find_free_entry(pool))) {
+                pthread_cond_wait(&pool->entry_freed, &pool->mutex);
+            }
+        }
+    }
+    ++pool->stats.detached;
+    entry->seq = pool->next_seq++;
+    entry->refs.store(1, std::memory_order_relaxed);
+
+    pool->stats.in_use = count_in_use(pool);
+    if (pool->stats.in_use > pool->stats.high_water) {
+        pool->stats.high_water = pool->stats.in_use;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return entry;
+}
+
+audio_segment *audio_segment_detach(audio_segment_pool *pool, audio_segment *seg)
+{
+    if (seg->sample_count > pool->entry_sample_capacity || seg->frame_count > pool->entry_frame_capacity ||
+        seg->mel_frame_count > pool->entry_mel_capacity) {
+        return seg;
+    }
+    auto entry = acquire_entry(pool);
+    if (!entry) {
+        return seg;
+    }
+    ring_view_copy(entry->buffer, seg->pcm);
+    ring_view_copy(entry->frame_buffer, seg->frames);
+    ring_view_copy(entry->mel_buffer, seg->mel);
+    entry->id = seg->id;
+    entry->start_pos = seg->start_pos;
+    entry->sample_count = seg->sample_count;
+    entry->partial = seg->partial;
+    entry->part = seg->part;
+    entry->station = seg->station;
+    entry->publish_ns = seg->publish_ns;
+    entry->confidence = seg->confidence;
+    entry->pcm = {entry->buffer, seg->sample_count, nullptr, 0};
+    entry->frame_count = seg->frame_count;
+    entry->frames = {entry->frame_buffer, seg->frame_count, nullptr, 0};
+    entry->mel_frame_count = seg->mel_frame_count;
+    entry->mel = {entry->mel_buffer, seg->mel_frame_count, nullptr, 0};
+    entry->state.store(AUDIO_SEGMENT_QUEUED, std::memory_order_release);
+    audio_segment_release(seg);
+    return entry;
+}
@@ -0,0 +1,209 @@
+#pragma once
+#include <atomic>
+#include <pthread.h>
+
+#include "global_constants.h"
+#include "spsc_ring.h"
+#include "audio_mel.h"
+
+// Max number of segments that can be handed out from a ring at once - this needs to cover everything sitting in the work
+// queue plus whatever the worker threads are processing
+inline constexpr sizet AUDIO_MAX_SEGMENTS = 32;
+
+struct audio_segment_table;
+struct audio_segment_pool;
+
+enum audio_segment_state
+{
+    AUDIO_SEGMENT_QUEUED,
+    AUDIO_SEGMENT_ACTIVE,
+    AUDIO_SEGMENT_DROPPED
+};
+
+// What to do when a segment needs a pool buffer and they're all in use
+enum audio_pool_empty_policy
+{
+    // Wait for a worker to release one
+    AUDIO_POOL_EMPTY_BLOCK,
+    // Drop the oldest pooled segment no worker has started on, and take its buffer once the worker skips it
+    AUDIO_POOL_EMPTY_DROP_OLDEST,
+    // Allocate a one off buffer on the heap
+    AUDIO_POOL_EMPTY_HEAP
+};
+
+enum audio_frame_flags
+{
+    // Above AUDIO_SILENT_THRESHOLD_RMS
+    AUDIO_FRAME_LOUD = 1,
+    // Above the noise floor threshold
+    AUDIO_FRAME_ABOVE_FLOOR = 2,
+    AUDIO_FRAME_SPEECH = 4
+};
+
+// What the capture thread worked out about one VAD frame, kept alongside its samples so anything looking at a segment
+// later can go frame by frame instead of over every sample
+struct audio_frame_features
+{
+    // RMS relative to full scale and VAD score from 0 to 1
+    f32 rms;
+    f32 score;
+    // Largest absolute sample value, saturated to 32767
+    u16 peak;
+    u16 zero_crossings;
+    u16 clip_count;
+    // AUDIO_FRAME_* flags
+    u16 flags;
+};
+
+// Features of every frame written to a sample ring, in lockstep with it - frame i covers ring positions
+// i * frame_sample_count up to (i + 1) * frame_sample_count, so only whole frames may be written to the ring. There is a
+// slot for each frame the ring can hold, which means a frame's features are never overwritten while its samples are
+// still in use, and they are published along with the samples.
+struct audio_frame_ring
+{
+    audio_frame_features *buffer;
+    sizet capacity;
+    sizet frame_sample_count;
+};
+
+bool audio_frame_ring_init(audio_frame_ring *fr, sizet sample_capacity, sizet frame_sample_count);
+void audio_frame_ring_terminate(audio_frame_ring *fr);
+
+inline audio_frame_features *audio_frame_ring_at(const audio_frame_ring *fr, u64 frame)
+{
+    return fr->buffer + frame % fr->capacity;
+}
+
+// Features of count frames starting at frame index first as at most two contiguous spans
+ring_view<const audio_frame_features> audio_frame_ring_view(const audio_frame_ring *fr, u64 first, sizet count);
+
+// Immutable handle to a run of samples. The samples are either read in place from the capture ring, which won't
+// overwrite them until every reference has been released, or from a segment pool buffer they were detached to.
+struct audio_segment
+{
+    u32 id;
+    // Absolute ring position of the first sample
+    u64 start_pos;
+    sizet sample_count;
+    // Spans of the samples - tail is empty unless the segment is in an unmirrored ring and wraps
+    ring_view<const s16> pcm;
+    // Features of each VAD frame of the samples - these can wrap even when the samples don't
+    sizet frame_count;
+    ring_view<const audio_frame_features> frames;
+    // Log mel frames centered on each hop of the samples. Partial segments only have the frames computed so far, which
+    // stop a window short of their end.
+    sizet mel_frame_count;
+    ring_view<const audio_mel_frame> mel;
+    // Streaming mode - a partial segment is a window from the start of a segment that is still being recorded. It's
+    // followed by more partials with the same id and finally the closed segment.
+    bool partial;
+    // Index of a partial window, or the number of partial windows that came before a closed segment
+    u32 part;
+    // Tag of the station the segment was captured from, and when the capture thread published it
+    cstr station;
+    u64 publish_ns;
+    // Mean VAD score of the segment's frames up to its last speech frame, from 0 to 1
+    f32 confidence;
+    std::atomic<u32> refs;
+    std::atomic<u32> state;
+    // Exactly one of these is set
+    audio_segment_table *owner;
+    audio_segment_pool *pool;
+
+    // Pool and heap segments only
+    s16 *buffer;
+    audio_frame_features *frame_buffer;
+    audio_mel_frame *mel_buffer;
+    u64 seq;
+    bool heap;
+};
+
+// Tracks the segments handed out from a ring in the order they were created. Segments are released in any order by the
+// worker threads, but ring space is only given back to the producer up to the start of the oldest segment still
+// referenced. Segments may overlap (partial windows of the same segment) but their start positions never go backwards.
+struct audio_segment_table
+{
+    spsc_ring<s16> *ring;
+    const audio_frame_ring *frames;
+    const audio_mel_ring *mel;
+    audio_segment slots[AUDIO_MAX_SEGMENTS];
+    // Oldest live segment and number of live segments
+    sizet head;
+    sizet count;
+    // Furthest end ring position of any segment handed out
+    u64 end_pos;
+    // Ring space is never given back past this position - used to keep the start of a segment that is still being
+    // streamed in partial windows. INVALID_IND if nothing is held.
+    u64 hold_pos;
+    pthread_mutex_t mutex;
+    pthread_cond_t slot_freed;
+};
+
+void audio_segment_table_init(audio_segment_table *tbl, spsc_ring<s16> *ring, const audio_frame_ring *frames, const audio_mel_ring *mel);
+void audio_segment_table_terminate(audio_segment_table *tbl);
+
+// Create a segment covering start_pos to end_pos in the ring with a single reference held by the caller. Both have to be
+// on frame boundaries. This blocks if all segment slots are in use.
+audio_segment *audio_segment_create(audio_segment_table *tbl, u32 id, u64 start_pos, u64 end_pos);
+
+// Keep ring space from pos onwards from being given back even if no segment references it, or pass INVALID_IND to clear
+void audio_segment_table_set_hold(audio_segment_table *tbl, u64 pos);
+
+// Give the ring space up to end_pos back once no earlier segment needs it, for samples that are never handed out
+void audio_segment_table_skip(audio_segment_table *tbl, u64 end_pos);
+
+void audio_segment_retain(audio_segment *seg);
+
+// Drop a reference - once the last reference is dropped the segment's samples may be overwritten
+void audio_segment_release(audio_segment *seg);
+
+// Drop every segment in the table no worker has started on and give their ring space back to the producer right away.
+// Workers skip dropped segments when audio_segment_begin fails. Returns the number of segments dropped.
+sizet audio_segment_table_drop_queued(audio_segment_table *tbl);
+
+struct audio_segment_pool_stats
+{
+    sizet in_use;
+    sizet high_water;
+    // Number of times a buffer was needed and none were free
+    sizet exhausted;
+    sizet dropped;
+    sizet heap_allocs;
+    // Heap buffers that couldn't be allocated - those segments stayed in the ring
+    sizet heap_failures;
+    sizet detached;
+};
+
+// Fixed set of preallocated and prefaulted segment buffers. Segments are copied here when they can't stay in the ring,
+// so the ring space can be given back to the capture thread right away.
+struct audio_segment_pool
+{
+    audio_segment entries[AUDIO_SEGMENT_POOL_COUNT];
+    s16 *mem;
+    audio_frame_features *frame_mem;
+    audio_mel_frame *mel_mem;
+    sizet entry_sample_capacity;
+    sizet entry_frame_capacity;
+    sizet entry_mel_capacity;
+    audio_pool_empty_policy policy;
+    u64 next_seq;
+    audio_segment_pool_stats stats;
+    pthread_mutex_t mutex;
+    pthread_cond_t entry_freed;
+};
+
+bool audio_segment_pool_init(audio_segment_pool *pool,
+                             sizet entry_sample_capacity,
+                             sizet entry_frame_capacity,
+                             sizet entry_mel_capacity,
+                             audio_pool_empty_policy policy);
+void audio_segment_pool_terminate(audio_segment_pool *pool);
+
+// Copy the samples of seg in to a pool buffer and return a new handle to them with a single reference held by the
+// caller. The caller's reference to seg is released. If seg is too big for a pool buffer, or the pool is empty and a heap
+// buffer can't be allocated, it is returned as is.
+audio_segment *audio_segment_detach(audio_segment_pool *pool, audio_segment *seg);
+
+// Called by a worker before it touches the samples - returns false if the segment was dropped while it was queued, in
+// which case the worker must not read the samples and should just release it
+bool audio_segment_begin(audio_segment *seg);
@@ -0,0 +1,186 @@
+#include <cmath>
+#include <cstdlib>
+
+#include "logging.h"
+#include "global_constants.h"
+#include "audio_vad.h"
+
+// The score is a weighted sum of how far each feature is in to speech territory. Flatness counts the most since it's what
+// tells harmonic voice apart from the broadband hiss of an open squelch.
+intern constexpr f32 VAD_ENERGY_WEIGHT = 0.3f;
+intern constexpr f32 VAD_FLATNESS_WEIGHT = 0.45f;
+intern constexpr f32 VAD_ZCR_WEIGHT = 0.25f;
+// Frames this far above the threshold get the full energy score
+intern constexpr f32 VAD_ENERGY_RANGE_DB = 30.0f;
+#if defined(AUDIO_DSP_FIXED_POINT)
+// Bins are under 2^60, so the band is summed this far down to keep the sum of up to 257 of them in a u64
+intern constexpr u32 VAD_POWER_SUM_SHIFT = 9;
+#else
+// Keeps the log of empty bins finite
+intern constexpr f32 VAD_POWER_FLOOR = 1e-12f;
+#endif
+// Weight of the previous smoothed power when smoothing frame power for the noise floor - about 100 ms with 20 ms frames
+intern constexpr f32 NOISE_FLOOR_SMOOTHING = 0.8f;
+// The minimum of the smoothed power sits below the mean noise power - this scales it back up
+intern constexpr f32 NOISE_FLOOR_BIAS = 1.5f;
+
+intern f32 clamp_unit(f32 x)
+{
+    return (x < 0.0f) ? 0.0f : ((x > 1.0f) ? 1.0f : x);
+}
+
+intern void noise_floor_reset(audio_noise_floor *nf)
+{
+    nf->smoothed_power = -1.0f;
+    nf->current_min = INFINITY;
+    nf->subwindow_index = 0;
+    nf->subwindow_frame = 0;
+    nf->finished_subwindows = 0;
+    nf->floor_rms = 0.0f;
+    nf->threshold_rms = AUDIO_SILENT_THRESHOLD_RMS;
+}
+
+intern void noise_floor_update(audio_noise_floor *nf, f32 power)
+{
+    nf->smoothed_power = (nf->smoothed_power < 0.0f) ? power : NOISE_FLOOR_SMOOTHING * nf->smoothed_power + (1.0f - NOISE_FLOOR_SMOOTHING) * power;
+    nf->current_min = fminf(nf->current_min, nf->smoothed_power);
+    if (++nf->subwindow_frame == nf->frames_per_subwindow) {
+        nf->subwindow_min[nf->subwindow_index] = nf->current_min;
+        nf->subwindow_index = (nf->subwindow_index + 1) % AUDIO_NOISE_FLOOR_SUBWINDOW_COUNT;
+        nf->subwindow_frame = 0;
+        nf->current_min = INFINITY;
+        if (nf->finished_subwindows < AUDIO_NOISE_FLOOR_SUBWINDOW_COUNT) {
+            ++nf->finished_subwindows;
+        }
+    }
+    if (nf->finished_subwindows == 0) {
+        return;
+    }
+
+    f32 window_min = nf->current_min;
+    for (sizet i = 0; i < nf->finished_subwindows; ++i) {
+        window_min = fminf(window_min, nf->subwindow_min[i]);
+    }
+    nf->floor_rms = sqrtf(window_min * NOISE_FLOOR_BIAS);
+    f32 threshold = nf->floor_rms * powf(10.0f, AUDIO_NOISE_FLOOR_MARGIN_DB / 20.0f);
+    threshold = (threshold < AUDIO_SILENT_THRESHOLD_RMS) ? AUDIO_SILENT_THRESHOLD_RMS : threshold;
+    nf->threshold_rms = (threshold > AUDIO_NOISE_FLOOR_MAX_RMS) ? AUDIO_NOISE_FLOOR_MAX_RMS : threshold;
+}
+
+bool audio_vad_init(audio_vad *vad, sizet frame_sample_count, u32 sample_rate)
+{
+    asrt(frame_sample_count <= AUDIO_VAD_FFT_SIZE);
+    vad->frame_sample_count = frame_sample_count;
+    vad->window = (decltype(vad->window))malloc(frame_sample_count * sizeof(*vad->window));
+    vad->frame = (audio_fft_value *)calloc(AUDIO_VAD_FFT_SIZE, sizeof(audio_fft_value));
+    vad->power = (audio_fft_power_value *)malloc((AUDIO_VAD_FFT_SIZE / 2 + 1) * sizeof(audio_fft_power_value));
+    if (!vad->window || !vad->frame || !vad->power || !audio_fft_init(&vad->fft, AUDIO_VAD_FFT_SIZE)) {
+        wlog("Could not allocate VAD buffers");
+        audio_vad_terminate(vad);
+        return false;
+    }
+    for (sizet i = 0; i < frame_sample_count; ++i) {
+        f64 w = 0.5 - 0.5 * cos(2.0 * M_PI * i / (frame_sample_count - 1));
+#if defined(AUDIO_DSP_FIXED_POINT)
+        vad->window[i] = (s16)lround(w * 32767.0);
+#else
+        vad->window[i] = (f32)w;
+#endif
+    }
+    f32 bin_hz = (f32)sample_rate / AUDIO_VAD_FFT_SIZE;
+    vad->band_first = (sizet)ceilf(AUDIO_VAD_BAND_LOW_HZ / bin_hz);
+    vad->band_last = (sizet)(AUDIO_VAD_BAND_HIGH_HZ / bin_hz);
+    if (vad->band_last > AUDIO_VAD_FFT_SIZE / 2) {
+        vad->band_last = AUDIO_VAD_FFT_SIZE / 2;
+    }
+
+    sizet frame_ms = frame_sample_count * 1000 / sample_rate;
+    sizet window_frames = AUDIO_NOISE_FLOOR_WINDOW_MS / frame_ms;
+    vad->noise_floor.frames_per_subwindow = (window_frames > AUDIO_NOISE_FLOOR_SUBWINDOW_COUNT) ? window_frames / AUDIO_NOISE_FLOOR_SUBWINDOW_COUNT : 1;
+    noise_floor_reset(&vad->noise_floor);
+    return true;
+}
+
+void audio_vad_reset(audio_vad *vad)
+{
+    noise_floor_reset(&vad->noise_floor);
+}
+
+void audio_vad_terminate(audio_vad *vad)
+{
+    audio_fft_terminate(&vad->fft);
+    free(vad->window);
+    free(vad->frame);
+    free(vad->power);
+    vad->window = nullptr;
+    vad->frame = nullptr;
+    vad->power = nullptr;
+}
+
+#if defined(AUDIO_DSP_FIXED_POINT)
+// Worked out in log2 - the mean log2 of the bins less the log2 of their mean - so the only float math left is turning the
+// result back from a log. The frame is scaled up by its peak to use all of the transform's input bits, which keeps it within
+// 2e-3 of the float flatness relative to it on the sample audio.
+intern f32 spectral_flatness(audio_vad *vad, const s16 *samples, u32 peak)
+{
+    u32 shift = audio_window_q15_shift(peak, audio_fft_input_bits(&vad->fft));
+    audio_window_q15(samples, vad->window, vad->frame_sample_count, shift, vad->frame);
+    audio_fft_power(&vad->fft, vad->frame, vad->power);
+
+    s64 log_sum{};
+    u64 sum{};
+    for (sizet i = vad->band_first; i <= vad->band_last; ++i) {
+        // Adding one keeps the log of empty bins finite
+        u64 p = vad->power[i] + 1;
+        log_sum += audio_log2_q16(p);
+        sum += p >> VAD_POWER_SUM_SHIFT;
+    }
+    s64 bins = (s64)(vad->band_last - vad->band_first + 1);
+    s64 log_mean = audio_log2_q16(sum ? sum : 1) + (VAD_POWER_SUM_SHIFT << 16) - audio_log2_q16((u64)bins);
+    return exp2f((f32)(log_sum / bins - log_mean) / 65536.0f);
+}
+#else
+intern f32 spectral_flatness(audio_vad *vad, const s16 *samples, u32)
+{
+    for (sizet i = 0; i < vad->frame_sample_count; ++i) {
+        vad->frame[i] = samples[i] * vad->window[i];
+    }
+    audio_fft_power(&vad->fft, vad->frame, vad->power);
+
+    f64 log_sum{};
+    f64 sum{};
+    for (sizet i = vad->band_first; i <= vad->band_last; ++i) {
+        f32 p = vad->power[i] + VAD_POWER_FLOOR;
+        log_sum += logf(p);
+        sum += p;
+    }
+    f64 bins = (f64)(vad->band_last - vad->band_first + 1);
+    return (f32)(exp(log_sum / bins) / (sum / bins));
+}
+#endif
+
+void audio_vad_analyze(audio_vad *vad, const s16 *samples, audio_vad_frame *out)
+{
+    audio_chunk_features_compute(samples, vad->frame_sample_count, &out->feat);
+    out->rms = audio_chunk_rms(out->feat, vad->frame_sample_count);
+    out->zcr = (f32)out->feat.zero_crossings / vad->frame_sample_count;
+    out->noise_floor_rms = vad->noise_floor.floor_rms;
+    out->threshold_rms = vad->noise_floor.threshold_rms;
+    out->loud = !audio_chunk_is_silent(out->feat, vad->frame_sample_count);
+    out->above_floor = out->loud && out->rms >= out->threshold_rms;
+    out->flatness = 1.0f;
+    out->score = 0.0f;
+    out->speech = false;
+    noise_floor_update(&vad->noise_floor, out->rms * out->rms);
+    if (!out->above_floor) {
+        return;
+    }
+
+    // Only frames over the threshold pay for the spectrum
+    out->flatness = spectral_flatness(vad, samples, out->feat.peak);
+    f32 db_over = 20.0f * log10f(out->rms / out->threshold_rms);
+    out->score = VAD_ENERGY_WEIGHT * clamp_unit(db_over / VAD_ENERGY_RANGE_DB) +
+                 VAD_FLATNESS_WEIGHT * clamp_unit((AUDIO_VAD_MAX_FLATNESS - out->flatness) / AUDIO_VAD_MAX_FLATNESS) +
+                 VAD_ZCR_WEIGHT * clamp_unit((AUDIO_VAD_MAX_ZCR - out->zcr) / AUDIO_VAD_MAX_ZCR);
+    out->speech = (out->score >= AUDIO_VAD_SPEECH_SCORE);
+}
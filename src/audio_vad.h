@@ -0,0 +1,80 @@
+#pragma once
+#include "audio_dsp.h"
+#include "audio_fft.h"
+
+// Frames are zero padded up to this for the spectrum
+inline constexpr sizet AUDIO_VAD_FFT_SIZE = 512;
+// The noise floor window is split in to this many sub windows so the minimum can rise again one sub window at a time
+inline constexpr sizet AUDIO_NOISE_FLOOR_SUBWINDOW_COUNT = 6;
+
+// Minimum statistics noise floor tracker. Frame power is smoothed and the noise floor is taken as the minimum of it over
+// the last AUDIO_NOISE_FLOOR_WINDOW_MS - speech has gaps between words and syllables, so over a few seconds the minimum
+// lands on the noise between them. The minimum is tracked per sub window so it can rise as well as fall.
+struct audio_noise_floor
+{
+    sizet frames_per_subwindow;
+    // Smoothed frame power relative to full scale
+    f32 smoothed_power;
+    // Minimum of each finished sub window, and of the current one so far
+    f32 subwindow_min[AUDIO_NOISE_FLOOR_SUBWINDOW_COUNT];
+    f32 current_min;
+    sizet subwindow_index;
+    sizet subwindow_frame;
+    sizet finished_subwindows;
+    // Current estimate, and the threshold frames have to be over to be considered for speech - which is
+    // AUDIO_SILENT_THRESHOLD_RMS until the first sub window is finished
+    f32 floor_rms;
+    f32 threshold_rms;
+};
+
+// Features of one VAD frame and the speech decision made from them
+struct audio_vad_frame
+{
+    audio_chunk_features feat;
+    f32 rms;
+    // Zero crossings per sample
+    f32 zcr;
+    // Geometric over arithmetic mean of the power spectrum across the voice band - near 0 for tones and voiced speech,
+    // near 0.56 for a frame of white noise. Only computed for frames over the threshold, 1.0 otherwise.
+    f32 flatness;
+    // How speech like the frame is from 0 to 1 - 0 for frames below the threshold
+    f32 score;
+    // Noise floor and threshold the frame was judged against
+    f32 noise_floor_rms;
+    f32 threshold_rms;
+    // Above AUDIO_SILENT_THRESHOLD_RMS, which is all the old energy only VAD looked at
+    bool loud;
+    // Above the noise floor threshold - always loud as well
+    bool above_floor;
+    bool speech;
+};
+
+// Per stream VAD state - the FFT work buffers mean each stream needs its own
+struct audio_vad
+{
+    sizet frame_sample_count;
+    audio_fft fft;
+#if defined(AUDIO_DSP_FIXED_POINT)
+    // Hann window over the frame in Q15
+    s16 *window;
+#else
+    // Hann window over the frame
+    f32 *window;
+#endif
+    // The windowed and zero padded frame, and its power spectrum
+    audio_fft_value *frame;
+    audio_fft_power_value *power;
+    // Spectrum bins covering AUDIO_VAD_BAND_LOW_HZ to AUDIO_VAD_BAND_HIGH_HZ
+    sizet band_first;
+    sizet band_last;
+    audio_noise_floor noise_floor;
+};
+
+bool audio_vad_init(audio_vad *vad, sizet frame_sample_count, u32 sample_rate);
+void audio_vad_terminate(audio_vad *vad);
+// Forget the noise floor, for when the audio is from a new source
+void audio_vad_reset(audio_vad *vad);
+
+// Compute the features of frame_sample_count samples and decide if they are speech, then update the noise floor with them
+// - real time safe
+void audio_vad_analyze(audio_vad *vad, const s16 *samples, audio_vad_frame *out);
@@ -57,14 +57,17 @@ struct small_str {
     sizet size{};
 };
 
-inline constexpr const sizet INVALID_IND = ULONG_LONG_MAX;
+inline constexpr const sizet INVALID_IND = SIZE_MAX;
 inline constexpr const u32 INVALID_ID = UINT_MAX;
 
 inline bool is_valid(sizet v)
 {
     return (v != INVALID_IND);
 }
+// On 32 bit targets sizet is u32 and the two invalid values are the same
+#if SIZE_MAX != UINT_MAX
 inline bool is_valid(u32 v)
 {
     return (v != INVALID_ID);
 }
+#endif
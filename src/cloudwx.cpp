@@ -56,8 +56,15 @@ intern void terminate_mongodb(cloudwx_ctxt *ctxt)
 
 intern bool init_audio(cloudwx_ctxt *ctxt)
 {
-    ctxt->ma = audio_create();
-    if (!audio_init(ctxt->ma)) {
+    ctxt->ma = audio_create(ctxt->pipeline);
+    bool result{};
+    if (ctxt->batch_path) {
+        result = audio_init_batch(ctxt->ma, ctxt->batch_path, ctxt->batch_threads);
+    }
+    else {
+        result = audio_init(ctxt->ma, ctxt->source);
+    }
+    if (!result) {
         audio_destroy(ctxt->ma);
         ctxt->ma = nullptr;
     }
@@ -102,6 +109,7 @@ bool init_cloudwx(cloudwx_ctxt *ctxt)
 void terminate_cloudwx(cloudwx_ctxt *ctxt)
 {
     ilog("Terminating cloudwx");
+    terminate_work_queue(&ctxt->wq);
     terminate_audio(ctxt);
     terminate_mongodb(ctxt);
 }
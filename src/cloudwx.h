@@ -1,4 +1,5 @@
 #pragma once
+#include "audio.h"
 #include "work_queue.h"
 
 struct audio_ctxt;
@@ -10,6 +11,13 @@ struct cloudwx_ctxt
     audio_ctxt *ma;
     mongodb_ctxt *db;
     work_queue wq;
+    // Sample rate and device layout to run the audio pipeline at - 16 kHz mono unless set otherwise
+    audio_pipeline pipeline;
+    // Where audio comes from when not running a batch - the radios unless set otherwise
+    audio_source_config source;
+    // Reprocess every file in this directory across batch_threads threads (0 for one per core) instead of capturing if set
+    const char *batch_path;
+    sizet batch_threads;
 };
 
 bool init_cloudwx(cloudwx_ctxt *ctxt);
@@ -1,12 +1,85 @@
 #pragma once
 #include "basic_types.h"
-inline constexpr s32 AUDIO_CHUNK_DURATION_MS = 200;
+// How often the capture device hands us samples - kept short so the audio thread does a little work often
+inline constexpr s32 AUDIO_CAPTURE_PERIOD_MS = 10;
+// Length of the frames the speech/silence decision is made on, independent of the capture period
+inline constexpr s32 AUDIO_VAD_FRAME_DURATION_MS = 20;
 inline constexpr s32 AUDIO_ENTRY_MAX_DURATION_S = 60;
+// Segments that reach the max duration are cut at the quietest VAD frame this far back from the end, rather than mid word
+// right at the max duration. What comes after the cut starts the next segment.
+inline constexpr s32 AUDIO_SPLIT_SEARCH_MS = 3000;
 inline constexpr s32 APPROXIMATE_SPEECH_CHARS_PER_S = 13;
-inline constexpr s32 AUDIO_SAMPLE_RATE = 16000;
+// Frames quieter than this are never speech
 inline constexpr f32 AUDIO_SILENT_THRESHOLD_RMS = 0.002f;
+// The speech threshold follows the receiver noise - frames have to be this far over the noise floor, estimated from the
+// quietest stretch of the last AUDIO_NOISE_FLOOR_WINDOW_MS, to be considered for speech. The threshold never goes below
+// AUDIO_SILENT_THRESHOLD_RMS or above AUDIO_NOISE_FLOOR_MAX_RMS.
+inline constexpr s32 AUDIO_NOISE_FLOOR_WINDOW_MS = 3000;
+inline constexpr f32 AUDIO_NOISE_FLOOR_MARGIN_DB = 9.0f;
+inline constexpr f32 AUDIO_NOISE_FLOOR_MAX_RMS = 0.1f;
+// Frames above the threshold are scored from 0 to 1 on energy, zero crossing rate, and spectral flatness, and are
+// speech if they score at least this. Open squelch hiss and static are loud but spectrally flat and cross zero often,
+// where voice is harmonic.
+inline constexpr f32 AUDIO_VAD_SPEECH_SCORE = 0.5f;
+// Spectral flatness at which a frame stops scoring anything for flatness - 0 is a pure tone and a frame of white noise
+// comes out around 0.56
+inline constexpr f32 AUDIO_VAD_MAX_FLATNESS = 0.45f;
+// Zero crossings per sample at which a frame stops scoring anything for zero crossing rate
+inline constexpr f32 AUDIO_VAD_MAX_ZCR = 0.35f;
+// Band spectral flatness is measured over - what makes it through a voice radio
+inline constexpr f32 AUDIO_VAD_BAND_LOW_HZ = 250.0f;
+inline constexpr f32 AUDIO_VAD_BAND_HIGH_HZ = 3500.0f;
+// Attack - how long frames need to be speech in a row before recording starts. Shorter bursts are treated as noise.
+inline constexpr s32 AUDIO_VAD_ATTACK_MS = 60;
+// Pre-roll - audio from before the attack that each segment starts with, so the onset of a transmission isn't clipped.
+// It is kept in a history of whole VAD frames in each stream, so this is rounded up to a multiple of the frame length.
+inline constexpr s32 AUDIO_PREROLL_MS = 300;
+// Segments with less speech than this in them are dropped instead of being handed to a worker - 0 to keep everything
+inline constexpr s32 AUDIO_SEGMENT_MIN_SPEECH_MS = 240;
+// A segment that starts recording within this long of the previous one stopping is merged in to it, so a transmission
+// with a pause in it is transcribed as one - 0 to never merge. The gap between them is left out apart from the previous
+// segment's hangover and the next one's pre-roll. Closed segments are held back this long before they are handed off.
+inline constexpr s32 AUDIO_SEGMENT_MERGE_GAP_MS = 1500;
+// Channels in each stream and its segments - streams are always a single radio
 inline constexpr u32 AUDIO_CHANNEL_COUNT = 1;
-// How much silence do we need to stop recording a chunk and send it over to whisper
+// Every capture device whose name contains this is opened, until each of the AUDIO_MAX_CAPTURE_STREAMS streams is used
+inline constexpr cstr AUDIO_CAPTURE_DEVICE_MATCH = "USB Audio CODEC";
+inline constexpr sizet AUDIO_MAX_CAPTURE_STREAMS = 4;
+// Capture at the codec's native rate and decimate to the pipeline's sample rate ourselves instead of leaving the conversion
+// to ALSA or miniaudio - the sample rate and device channel count are picked at startup from the configs in audio_config.h
+inline constexpr bool AUDIO_CAPTURE_NATIVE_RATE = true;
+// Binds the station a radio is tuned to to the capture device and channel it's plugged in to. ALSA numbers cards in the
+// order they're found, which can change across reboots and replugs, so device is matched against the device name, its
+// ALSA id, and the sysfs path of its card instead. The sysfs path includes the USB port (ie /1-1.2/ is port 2 of the
+// first hub), which is the only thing telling two of the same codec apart - the startup log lists it for each device.
+struct audio_station_binding
+{
+    cstr device;
+    // Always 0 for mono devices
+    u32 channel;
+    // Segments are named after this
+    cstr tag;
+};
+// Set these to the port each radio's codec is plugged in to and the station it's tuned to. Capture channels without a
+// binding are still recorded, tagged unbound0, unbound1, ... in the order they're opened. Sources without devices (file,
+// synth) tag their streams radio0, radio1, ...
+inline constexpr audio_station_binding AUDIO_STATION_BINDINGS[] = {
+    {"/1-1.1/", 0, "radio0"},
+    {"/1-1.2/", 0, "radio1"},
+    {"/1-1.3/", 0, "radio2"},
+    {"/1-1.4/", 0, "radio3"},
+};
+// Hangover - how long frames need to not be speech in a row to stop recording a chunk and send it over to whisper
 inline constexpr sizet CONSECUTIVE_SILENT_AUDIO_THRESHOLD_MS = 2200;
+// Streaming mode - while a segment is being recorded, publish a partial window from its start every this many seconds so
+// downstream work can start before it closes. 0 only publishes closed segments. This is the default for the -p flag.
+inline constexpr f64 AUDIO_PARTIAL_SEGMENT_INTERVAL_S = 0.0;
+// While recording, samples are published to the processing thread at least this often so it can compute the log mel
+// frames of a segment as it comes in, rather than all at once when it closes
+inline constexpr s32 AUDIO_PUBLISH_INTERVAL_MS = 100;
+// Number of max duration segment buffers preallocated for segments that have to be copied out of the capture ring
+inline constexpr sizet AUDIO_SEGMENT_POOL_COUNT = 4;
+// Files finished by batch reprocessing are listed here in the batch directory so an interrupted batch can be resumed
+inline constexpr cstr AUDIO_BATCH_JOURNAL_FILE = "cloudwx_batch.done";
 inline constexpr cstr WHISPER_MODEL_FILE = "models/ggml-tiny.en.bin";
 inline constexpr sizet WHISPER_CHAR_BUF_SZ = AUDIO_ENTRY_MAX_DURATION_S * APPROXIMATE_SPEECH_CHARS_PER_S * 2 + 1;
@@ -5,6 +5,7 @@
 #include "basic_types.h"
 #include "utils.h"
 #include "logging.h"
+#include "rt_check.h"
 #include "string.h"
 
 #define MAX_CALLBACKS 32
@@ -140,6 +141,7 @@ intern void init_event(log_event *ev, void *udata, bool append_nl)
 
 void lprint(logging_ctxt *logger, int level, const char *file, const char *func, int line, bool append_nl, const char *fmt, ...)
 {
+    rt_assert_can_block();
     log_event ev{};
     lock(logger);
     if (!logger->quiet && level >= logger->level) {
@@ -1,15 +1,125 @@
+#include <cstdlib>
+#include <cstring>
+
 #include "miniaudio.h"
 #include "logging.h"
+#include "global_constants.h"
 #include "cloudwx.h"
 #include "mongodb.h"
+#include "audio.h"
 
 cloudwx_ctxt ctxt{};
+
+intern void print_usage(const char *exe)
+{
+    ilog("Usage: %s [-c wideband|narrowband|stereo] [-f file_or_directory | -s capture|null|synth [-d seconds] [-F] [-n streams] | -b directory "
+         "[-j threads]] [-p seconds]",
+         exe);
+    ilog("  -c  Run the audio pipeline for 16 kHz mono, 8 kHz mono, or 16 kHz stereo devices - wideband by default");
+    ilog("  -f  Decode a file, or every file in a directory, instead of capturing from the radios");
+    ilog("  -s  Capture from the radios, from miniaudio's null device, or from generated audio");
+    ilog("  -d  Stop generated audio after this many seconds - runs until killed by default");
+    ilog("  -F  Generate audio as fast as the pipeline takes it instead of in real time");
+    ilog("  -n  Number of streams of generated audio, in multiples of the channels per device - one device's worth by default");
+    ilog("  -b  Reprocess every file in a directory in parallel - rerun to resume an interrupted batch");
+    ilog("  -j  Number of batch threads - defaults to one per core");
+    ilog("  -p  Publish a partial window of each segment being recorded this often (streaming mode) - 0 to only publish closed "
+         "segments, which is the default");
+}
+
+intern bool parse_source_type(const char *name, audio_source_type *type)
+{
+    if (strcmp(name, "capture") == 0) {
+        *type = AUDIO_SOURCE_CAPTURE;
+    }
+    else if (strcmp(name, "null") == 0) {
+        *type = AUDIO_SOURCE_NULL;
+    }
+    else if (strcmp(name, "synth") == 0) {
+        *type = AUDIO_SOURCE_SYNTH;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+intern bool parse_pipeline(const char *name, audio_pipeline *pipeline)
+{
+    if (strcmp(name, "wideband") == 0) {
+        *pipeline = AUDIO_PIPELINE_WIDEBAND;
+    }
+    else if (strcmp(name, "narrowband") == 0) {
+        *pipeline = AUDIO_PIPELINE_NARROWBAND;
+    }
+    else if (strcmp(name, "stereo") == 0) {
+        *pipeline = AUDIO_PIPELINE_WIDEBAND_STEREO;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
 int main(int argc, char **argv)
 {
+    ctxt.source.partial_interval_s = AUDIO_PARTIAL_SEGMENT_INTERVAL_S;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-c") == 0 && i + 1 < argc && parse_pipeline(argv[i + 1], &ctxt.pipeline)) {
+            ++i;
+        }
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            ctxt.source.type = AUDIO_SOURCE_FILE;
+            ctxt.source.path = argv[++i];
+        }
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc && parse_source_type(argv[i + 1], &ctxt.source.type)) {
+            ++i;
+        }
+        else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            ctxt.source.duration_s = strtod(argv[++i], nullptr);
+        }
+        else if (strcmp(argv[i], "-F") == 0) {
+            ctxt.source.free_run = true;
+        }
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            ctxt.source.synth_stream_count = strtoul(argv[++i], nullptr, 10);
+        }
+        else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            ctxt.batch_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            ctxt.batch_threads = strtoul(argv[++i], nullptr, 10);
+        }
+        else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc && strtod(argv[i + 1], nullptr) >= 0.0) {
+            ctxt.source.partial_interval_s = strtod(argv[++i], nullptr);
+        }
+        else {
+            wlog("Unknown argument %s", argv[i]);
+            print_usage(argv[0]);
+            return -1;
+        }
+    }
+
     if (!init_cloudwx(&ctxt)) {
         wlog("Failed to initialize cloudwx");
         return -1;
     }
+
+    if (ctxt.batch_path) {
+        audio_wait_batch(ctxt.ma);
+        terminate_cloudwx(&ctxt);
+        return 0;
+    }
+    else if (ctxt.source.type == AUDIO_SOURCE_FILE || (ctxt.source.type == AUDIO_SOURCE_SYNTH && ctxt.source.duration_s > 0.0)) {
+        while (!audio_source_finished(ctxt.ma)) {
+            process_available_audio(ctxt.ma, &ctxt.wq);
+        }
+        wait_work_queue_idle(&ctxt.wq);
+        audio_log_source_throughput(ctxt.ma);
+        terminate_cloudwx(&ctxt);
+        return 0;
+    }
+
     while (1) {
         process_available_audio(ctxt.ma, &ctxt.wq);
     }
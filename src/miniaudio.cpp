@@ -5,8 +5,9 @@
 #define MA_ASSERT asrt
 #define MA_ENABLE_ONLY_SPECIFIC_BACKENDS
 #define MA_ENABLE_ALSA
+// The null backend is a paced capture device delivering silence, for running without a sound card
+#define MA_ENABLE_NULL
 #define MA_NO_ENCODING
-#define MA_NO_GENERATION
 #define MA_NO_RESOURCE_MANAGER
 #define MA_NO_NODE_GRAPH
 #define MINIAUDIO_IMPLEMENTATION
@@ -0,0 +1,82 @@
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+
+#include "basic_types.h"
+#include "rt_check.h"
+
+#if !defined(NDEBUG)
+
+intern thread_local bool in_rt_scope;
+
+intern void rt_violation(const char *what)
+{
+    // Can't use the logger here as it locks and allocates
+    const char prefix[] = "Real time violation in audio callback: ";
+    write(STDERR_FILENO, prefix, sizeof(prefix) - 1);
+    write(STDERR_FILENO, what, strlen(what));
+    write(STDERR_FILENO, "\n", 1);
+    abort();
+}
+
+void rt_scope_begin()
+{
+    in_rt_scope = true;
+}
+
+void rt_scope_end()
+{
+    in_rt_scope = false;
+}
+
+void rt_assert_can_block()
+{
+    if (in_rt_scope) {
+        rt_violation("blocking call");
+    }
+}
+
+#if defined(__GLIBC__)
+// Replace the allocator entry points so allocations from the real time scope are caught - everything else is passed on
+// to glibc's allocator
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void __libc_free(void *ptr);
+
+void *malloc(size_t size)
+{
+    if (in_rt_scope) {
+        rt_violation("malloc");
+    }
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+    if (in_rt_scope) {
+        rt_violation("calloc");
+    }
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    if (in_rt_scope) {
+        rt_violation("realloc");
+    }
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+    if (in_rt_scope && ptr) {
+        rt_violation("free");
+    }
+    __libc_free(ptr);
+}
+}
+#endif
+
+#endif
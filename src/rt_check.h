@@ -0,0 +1,14 @@
+#pragma once
+
+// Debug build checks for code running on the real time audio thread. Anything between rt_scope_begin and rt_scope_end
+// aborts if it calls malloc/free (including new/delete) or any function that calls rt_assert_can_block. Release builds
+// compile these out.
+#if defined(NDEBUG)
+#define rt_scope_begin()
+#define rt_scope_end()
+#define rt_assert_can_block()
+#else
+void rt_scope_begin();
+void rt_scope_end();
+void rt_assert_can_block();
+#endif
@@ -0,0 +1,74 @@
+#include <cerrno>
+#include <numeric>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "spsc_ring.h"
+
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+intern void *mirror_alloc(sizet size)
+{
+    int fd = memfd_create("cloudwx_ring", MFD_CLOEXEC);
+    if (fd == -1) {
+        wlog("Could not create memfd for ring buffer: %s", strerror(errno));
+        return nullptr;
+    }
+    if (ftruncate(fd, size) != 0) {
+        wlog("Could not size memfd to %lu bytes: %s", size, strerror(errno));
+        close(fd);
+        return nullptr;
+    }
+
+    // Reserve address space for both copies first so the second mapping is guaranteed to land right after the first
+    auto base = (u8 *)mmap(nullptr, size * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        wlog("Could not reserve %lu bytes of address space for ring buffer: %s", size * 2, strerror(errno));
+        close(fd);
+        return nullptr;
+    }
+    if (mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+        mmap(base + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        wlog("Could not mirror map ring buffer: %s", strerror(errno));
+        munmap(base, size * 2);
+        close(fd);
+        return nullptr;
+    }
+
+    // The mappings keep the memory alive
+    close(fd);
+    return base;
+}
+#else
+intern void *mirror_alloc(sizet)
+{
+    return nullptr;
+}
+#endif
+
+void *ring_mem_alloc(sizet *size, sizet elem_size, bool *mirrored)
+{
+    // Mapping granularity is a page, and the mirror only lines up with the start of the buffer if a whole number of
+    // elements fits before it
+    sizet page_size = sysconf(_SC_PAGESIZE);
+    sizet granule = std::lcm(page_size, elem_size);
+    *size = ((*size + granule - 1) / granule) * granule;
+    void *mem = mirror_alloc(*size);
+    *mirrored = (mem != nullptr);
+    if (!mem) {
+        mem = malloc(*size);
+    }
+    return mem;
+}
+
+void ring_mem_free(void *mem, sizet size, bool mirrored)
+{
+    if (!mem) {
+        return;
+    }
+    if (mirrored) {
+        munmap(mem, size * 2);
+    }
+    else {
+        free(mem);
+    }
+}
@@ -0,0 +1,217 @@
+#pragma once
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <type_traits>
+
+#include "basic_types.h"
+#include "logging.h"
+#include "rt_check.h"
+
+inline constexpr sizet CACHE_LINE_SIZE = 64;
+
+// Allocate ring storage of at least *size bytes, rounded up to a whole number of pages and of elem_size elements (the
+// least common multiple of the two) and written back to *size. Where memfd is available the pages are mapped twice back
+// to back so that any span of up to *size bytes starting inside the buffer is contiguous in memory, and *mirrored is
+// set. Otherwise this falls back to a plain malloc.
+void *ring_mem_alloc(sizet *size, sizet elem_size, bool *mirrored);
+void ring_mem_free(void *mem, sizet size, bool mirrored);
+
+// A segment of the ring as at most two contiguous spans - tail is only non empty when the segment wraps past the end of
+// the buffer, which never happens for mirrored rings
+template<class T>
+struct ring_view
+{
+    T *head;
+    sizet head_count;
+    T *tail;
+    sizet tail_count;
+};
+
+// Single producer single consumer ring buffer. Positions are element counts that only ever increase, and are reduced
+// modulo capacity when indexing into the buffer. Each side's position lives on its own cache line along with that
+// side's cached copy of the other position, so the two threads only touch each others lines when the cache runs out.
+//
+// The producer appends elements to a pending region which the consumer can't see until spsc_ring_publish is called -
+// this lets the audio thread write a whole segment before handing it over.
+template<class T>
+struct spsc_ring
+{
+    // Set on init and read only after that
+    T *buffer;
+    sizet capacity;
+    bool mirrored;
+
+    // Producer side
+    alignas(CACHE_LINE_SIZE) std::atomic<u64> write_pos;
+    u64 pending_pos;
+    u64 cached_read_pos;
+
+    // Consumer side
+    alignas(CACHE_LINE_SIZE) std::atomic<u64> read_pos;
+    u64 cached_write_pos;
+};
+
+// The capacity may be rounded up to fill the last page of the allocation. The allocation is always a whole number of
+// elements so the mirror starts exactly at buffer + capacity, whatever the size of T.
+template<class T>
+bool spsc_ring_init(spsc_ring<T> *ring, sizet capacity)
+{
+    sizet bytes = capacity * sizeof(T);
+    ring->buffer = (T *)ring_mem_alloc(&bytes, sizeof(T), &ring->mirrored);
+    if (!ring->buffer) {
+        return false;
+    }
+    ring->capacity = bytes / sizeof(T);
+    asrt(ring->capacity * sizeof(T) == bytes);
+    ring->write_pos.store(0, std::memory_order_relaxed);
+    ring->read_pos.store(0, std::memory_order_relaxed);
+    ring->pending_pos = 0;
+    ring->cached_read_pos = 0;
+    ring->cached_write_pos = 0;
+    return true;
+}
+
+template<class T>
+void spsc_ring_terminate(spsc_ring<T> *ring)
+{
+    ring_mem_free(ring->buffer, ring->capacity * sizeof(T), ring->mirrored);
+    ring->buffer = nullptr;
+    ring->capacity = 0;
+}
+
+// Returns the spans covering count elements starting at absolute position pos
+template<class T>
+ring_view<T> spsc_ring_view(const spsc_ring<T> *ring, u64 pos, sizet count)
+{
+    asrt(count <= ring->capacity);
+    sizet offset = pos % ring->capacity;
+    sizet head_count = ring->capacity - offset;
+    if (ring->mirrored || head_count >= count) {
+        return {ring->buffer + offset, count, ring->buffer, 0};
+    }
+    return {ring->buffer + offset, head_count, ring->buffer, count - head_count};
+}
+
+template<class T>
+sizet ring_view_count(const ring_view<T> &view)
+{
+    return view.head_count + view.tail_count;
+}
+
+// Copy the view in to a contiguous destination which must hold at least ring_view_count elements
+template<class T>
+void ring_view_copy(std::remove_const_t<T> *dest, const ring_view<T> &view)
+{
+    memcpy(dest, view.head, view.head_count * sizeof(T));
+    memcpy(dest + view.head_count, view.tail, view.tail_count * sizeof(T));
+}
+
+// Producer: number of elements that can still be written without overwriting unconsumed data
+template<class T>
+sizet spsc_ring_write_space(spsc_ring<T> *ring)
+{
+    ring->cached_read_pos = ring->read_pos.load(std::memory_order_acquire);
+    return ring->capacity - (sizet)(ring->pending_pos - ring->cached_read_pos);
+}
+
+// Producer: block until at least count elements can be written and return the write space. Only for producers that are
+// allowed to block, like a file being decoded faster than real time.
+template<class T>
+sizet spsc_ring_wait_space(spsc_ring<T> *ring, sizet count)
+{
+    rt_assert_can_block();
+    asrt(count <= ring->capacity);
+    sizet space = spsc_ring_write_space(ring);
+    while (space < count) {
+        ring->read_pos.wait(ring->cached_read_pos, std::memory_order_acquire);
+        space = spsc_ring_write_space(ring);
+    }
+    return space;
+}
+
+// Producer: number of elements written but not yet published
+template<class T>
+sizet spsc_ring_pending(const spsc_ring<T> *ring)
+{
+    return (sizet)(ring->pending_pos - ring->write_pos.load(std::memory_order_relaxed));
+}
+
+// Producer: append up to count elements to the pending region and return how many were written. Fewer than count are
+// only written if the consumer has fallen behind and the ring is full.
+template<class T>
+sizet spsc_ring_write(spsc_ring<T> *ring, const T *src, sizet count)
+{
+    sizet space = ring->capacity - (sizet)(ring->pending_pos - ring->cached_read_pos);
+    if (space < count) {
+        ring->cached_read_pos = ring->read_pos.load(std::memory_order_acquire);
+        space = ring->capacity - (sizet)(ring->pending_pos - ring->cached_read_pos);
+        if (space < count) {
+            count = space;
+        }
+    }
+    auto view = spsc_ring_view(ring, ring->pending_pos, count);
+    memcpy(view.head, src, view.head_count * sizeof(T));
+    memcpy(view.tail, src + view.head_count, view.tail_count * sizeof(T));
+    ring->pending_pos += count;
+    return count;
+}
+
+// Producer: make everything in the pending region visible to the consumer and wake it if it is waiting
+template<class T>
+void spsc_ring_publish(spsc_ring<T> *ring)
+{
+    ring->write_pos.store(ring->pending_pos, std::memory_order_release);
+    ring->write_pos.notify_one();
+}
+
+// Consumer: number of published elements not yet consumed
+template<class T>
+sizet spsc_ring_available(spsc_ring<T> *ring)
+{
+    u64 rpos = ring->read_pos.load(std::memory_order_relaxed);
+    if (ring->cached_write_pos == rpos) {
+        ring->cached_write_pos = ring->write_pos.load(std::memory_order_acquire);
+    }
+    return (sizet)(ring->cached_write_pos - rpos);
+}
+
+// Consumer: block until at least one published element is available and return the available count
+template<class T>
+sizet spsc_ring_wait(spsc_ring<T> *ring)
+{
+    rt_assert_can_block();
+    u64 rpos = ring->read_pos.load(std::memory_order_relaxed);
+    ring->write_pos.wait(rpos, std::memory_order_acquire);
+    ring->cached_write_pos = ring->write_pos.load(std::memory_order_acquire);
+    return (sizet)(ring->cached_write_pos - rpos);
+}
+
+// Consumer: view count elements from the read position without consuming them
+template<class T>
+ring_view<T> spsc_ring_peek(spsc_ring<T> *ring, sizet count)
+{
+    asrt(count <= (sizet)(ring->cached_write_pos - ring->read_pos.load(std::memory_order_relaxed)));
+    return spsc_ring_view(ring, ring->read_pos.load(std::memory_order_relaxed), count);
+}
+
+// Consumer: release count elements back to the producer and wake it if it is waiting for space - any views of them are
+// invalid after this
+template<class T>
+void spsc_ring_consume(spsc_ring<T> *ring, sizet count)
+{
+    u64 rpos = ring->read_pos.load(std::memory_order_relaxed);
+    asrt(count <= (sizet)(ring->cached_write_pos - rpos));
+    ring->read_pos.store(rpos + count, std::memory_order_release);
+    ring->read_pos.notify_one();
+}
+
+// Consumer: release everything before absolute position pos back to the producer. This is for consumers that hand out
+// views of several segments at once and give them back as they are released.
+template<class T>
+void spsc_ring_consume_to(spsc_ring<T> *ring, u64 pos)
+{
+    asrt(pos >= ring->read_pos.load(std::memory_order_relaxed));
+    ring->read_pos.store(pos, std::memory_order_release);
+    ring->read_pos.notify_one();
+}
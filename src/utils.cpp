@@ -1,6 +1,7 @@
 #include <cstring>
 #include <cerrno>
 #include <cstdlib>
+#include <ctime>
 #include <sys/stat.h>
 
 #include "utils.h"
@@ -54,3 +55,10 @@ small_str generate_id()
     ret.size = strnlen(ret.data, SMALL_STR_LEN);
     return ret;
 }
+
+u64 monotonic_time_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
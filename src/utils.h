@@ -6,6 +6,9 @@ int mkdir_p(const char *path, int mode);
 
 small_str generate_id();
 
+// Monotonic clock in nanoseconds - safe to call from the audio thread
+u64 monotonic_time_ns();
+
 template<typename T>
 bool fequals(T a, T b, T epsilon = 0.0001)
 {
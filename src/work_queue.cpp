@@ -1,5 +1,6 @@
 #include "logging.h"
 #include "work_queue.h"
+#include "rt_check.h"
 
 void *worker_thread(void *arg)
 {
@@ -30,16 +31,25 @@ void *worker_thread(void *arg)
         wq_task task = queue->tasks[queue->front];
         queue->front = (queue->front + 1) % QUEUE_SIZE;
         queue->count--;
+        queue->active++;
 
         pthread_cond_signal(&queue->task_removed);
         pthread_mutex_unlock(&queue->mutex);
         task.func(task.arg);
+
+        pthread_mutex_lock(&queue->mutex);
+        queue->active--;
+        if (queue->count == 0 && queue->active == 0) {
+            pthread_cond_broadcast(&queue->idle);
+        }
+        pthread_mutex_unlock(&queue->mutex);
     }
     return nullptr;
 }
 
 void enqueue_task(work_queue *queue, wq_task task)
 {
+    rt_assert_can_block();
     pthread_mutex_lock(&queue->mutex);
 
     // Must be in a while loop because the thread can spuriously wake up, and also.. if multiple threads were
@@ -63,6 +73,7 @@ void init_work_queue(work_queue *queue)
     pthread_mutex_init(&queue->mutex, nullptr);
     pthread_cond_init(&queue->task_removed, nullptr);
     pthread_cond_init(&queue->task_added, nullptr);
+    pthread_cond_init(&queue->idle, nullptr);
     for (int i = 0; i < NUM_THREADS; ++i) {
         pthread_create(&queue->workers[i], NULL, worker_thread, queue);
     }
@@ -79,5 +90,15 @@ void terminate_work_queue(work_queue *queue)
     }
     pthread_cond_destroy(&queue->task_added);
     pthread_cond_destroy(&queue->task_removed);
+    pthread_cond_destroy(&queue->idle);
     pthread_mutex_destroy(&queue->mutex);
 }
+
+void wait_work_queue_idle(work_queue *queue)
+{
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->count > 0 || queue->active > 0) {
+        pthread_cond_wait(&queue->idle, &queue->mutex);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+}
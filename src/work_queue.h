@@ -19,13 +19,18 @@ struct work_queue
     sizet front;
     sizet rear;
     sizet count;
+    // Tasks taken off the queue that haven't finished yet
+    sizet active;
     s8 stop;
     pthread_mutex_t mutex;
     pthread_cond_t task_added;
     pthread_cond_t task_removed;
+    pthread_cond_t idle;
 };
 
 void *worker_thread(void *arg);
 void enqueue_task(work_queue *queue, wq_task task);
 void init_work_queue(work_queue *queue);
 void terminate_work_queue(work_queue *queue);
+// Block until the queue is empty and every task taken off it has finished
+void wait_work_queue_idle(work_queue *queue);
@@ -0,0 +1,200 @@
+// Checks the chunk feature and Q15 window kernels against plain scalar loops, and the integer silence test against the
+// float rms < threshold loop it replaced, then reports ns per chunk for both
+#include <cmath>
+#include <initializer_list>
+#include <limits>
+
+#include "audio_dsp.h"
+#include "global_constants.h"
+#include "test_common.h"
+
+intern constexpr s16 MAX_S16 = std::numeric_limits<s16>::max();
+intern constexpr s16 MIN_S16 = std::numeric_limits<s16>::min();
+intern constexpr sizet CHUNK_SAMPLE_COUNT = 320;
+intern constexpr sizet MAX_SAMPLE_COUNT = 2048;
+
+// The silence test as the capture callback did it before the features kernel - float accumulation of normalized squares
+intern bool float_is_silent(const s16 *samples, sizet count)
+{
+    constexpr f32 SAMPLE_RMS_DENOM = MAX_S16 * MAX_S16;
+    float sample_rms{};
+    for (sizet i = 0; i < count; ++i) {
+        sample_rms += (samples[i] * samples[i] / SAMPLE_RMS_DENOM);
+    }
+    sample_rms = sqrt(sample_rms / count);
+    return sample_rms < AUDIO_SILENT_THRESHOLD_RMS;
+}
+
+// Exact RMS relative to the threshold - the float loop is allowed to disagree with the integer test only right next to it
+intern long double exact_rms_over_threshold(const s16 *samples, sizet count)
+{
+    u64 sum_sq{};
+    for (sizet i = 0; i < count; ++i) {
+        sum_sq += (u64)((s64)samples[i] * samples[i]);
+    }
+    long double rms = sqrtl((long double)sum_sq / ((long double)count * MAX_S16 * MAX_S16));
+    return rms / (long double)AUDIO_SILENT_THRESHOLD_RMS;
+}
+
+intern void reference_features(const s16 *samples, sizet count, audio_chunk_features *feat)
+{
+    *feat = {};
+    for (sizet i = 0; i < count; ++i) {
+        s32 s = samples[i];
+        u32 mag = (u32)(s < 0 ? -s : s);
+        feat->sum_sq += (u64)((s64)s * s);
+        feat->peak = (mag > feat->peak) ? mag : feat->peak;
+        feat->clip_count += (s == MAX_S16 || s == MIN_S16);
+        if (i > 0) {
+            feat->zero_crossings += ((samples[i - 1] < 0) != (s < 0));
+        }
+    }
+}
+
+intern void fill_noise(test_rng *rng, s16 *samples, sizet count, s32 amplitude)
+{
+    for (sizet i = 0; i < count; ++i) {
+        samples[i] = (s16)test_rand_range(rng, -amplitude, amplitude);
+    }
+}
+
+intern void fill_constant(s16 *samples, sizet count, s16 value, bool alternate)
+{
+    for (sizet i = 0; i < count; ++i) {
+        samples[i] = (alternate && (i & 1)) ? (s16)-value : value;
+    }
+}
+
+intern void check_features(const s16 *samples, sizet count)
+{
+    audio_chunk_features feat{}, ref{};
+    audio_chunk_features_compute(samples, count, &feat);
+    reference_features(samples, count, &ref);
+    test_check(feat.sum_sq == ref.sum_sq, "count %zu: sum_sq %lu expected %lu", count, feat.sum_sq, ref.sum_sq);
+    test_check(feat.peak == ref.peak, "count %zu: peak %u expected %u", count, feat.peak, ref.peak);
+    test_check(feat.clip_count == ref.clip_count, "count %zu: clip count %u expected %u", count, feat.clip_count, ref.clip_count);
+    test_check(feat.zero_crossings == ref.zero_crossings,
+               "count %zu: zero crossings %u expected %u",
+               count,
+               feat.zero_crossings,
+               ref.zero_crossings);
+}
+
+// Returns true if the float loop disagreed with the integer test (which is only allowed right at the threshold)
+intern bool check_silence(const s16 *samples, sizet count)
+{
+    audio_chunk_features feat{};
+    audio_chunk_features_compute(samples, count, &feat);
+    bool silent = audio_chunk_is_silent(feat, count);
+    bool old_silent = float_is_silent(samples, count);
+    long double ratio = exact_rms_over_threshold(samples, count);
+
+    // The integer test has to get the exact answer every time
+    test_check(silent == (ratio < 1.0L), "count %zu: integer test says silent=%d at %.9Lf of the threshold", count, silent, ratio);
+
+    // Float accumulation over up to MAX_SAMPLE_COUNT samples is good to well under 1e-4 relative
+    if (silent != old_silent) {
+        test_check(fabsl(ratio - 1.0L) < 1e-4L,
+                   "count %zu: float loop says silent=%d and integer test silent=%d at %.9Lf of the threshold",
+                   count,
+                   old_silent,
+                   silent,
+                   ratio);
+        return true;
+    }
+    return false;
+}
+
+// Every shift the window can keep, against the exact product rounded to nearest
+intern void check_window(test_rng *rng, const s16 *samples, sizet count)
+{
+    s16 window[MAX_SAMPLE_COUNT];
+    s32 out[MAX_SAMPLE_COUNT];
+    for (sizet i = 0; i < count; ++i) {
+        window[i] = (s16)test_rand_range(rng, 0, MAX_S16);
+    }
+    window[0] = MAX_S16;
+    for (u32 shift = 0; shift < 15; ++shift) {
+        audio_window_q15(samples, window, count, shift, out);
+        sizet bad_count{};
+        for (sizet i = 0; i < count; ++i) {
+            // Halves round up, as an add and arithmetic shift does
+            f64 exact = floor((f64)samples[i] * window[i] / (f64)(1 << (15 - shift)) + 0.5);
+            bad_count += (out[i] != exact);
+        }
+        test_check(bad_count == 0, "count %zu shift %u: %zu windowed samples off", count, shift, bad_count);
+    }
+}
+
+int main()
+{
+    ilog("audio dsp kernels compiled for %s with %s math", audio_dsp_isa_name(), audio_dsp_math_name());
+    test_rng rng{0x5eed};
+    s16 samples[MAX_SAMPLE_COUNT];
+
+    // Lengths either side of every SIMD width and tail
+    constexpr sizet LENGTHS[] = {1, 2, 3, 7, 8, 9, 15, 16, 17, 31, 32, 33, 63, 64, 65, 160, 319, 320, 321, 1024, 2047, 2048};
+
+    for (sizet count : LENGTHS) {
+        fill_noise(&rng, samples, count, MAX_S16);
+        check_features(samples, count);
+        check_window(&rng, samples, count);
+
+        // Rails and sign changes through zero
+        for (sizet i = 0; i < count; ++i) {
+            constexpr s16 EDGES[] = {MIN_S16, MAX_S16, 0, -1, 1, MIN_S16 + 1};
+            samples[i] = EDGES[test_rand(&rng) % (sizeof(EDGES) / sizeof(EDGES[0]))];
+        }
+        check_features(samples, count);
+        check_window(&rng, samples, count);
+    }
+
+    // A constant (or alternating) chunk has an RMS of value / 32767, so 65 is just under the 0.002 threshold (65.53) and 66
+    // just over - those are the closest sample values to the edge and both tests must agree on them at every length
+    for (sizet count : LENGTHS) {
+        for (s16 value : {(s16)65, (s16)66, (s16)-65, (s16)-66, (s16)0, (s16)1, MAX_S16, MIN_S16}) {
+            for (bool alternate : {false, true}) {
+                fill_constant(samples, count, value, alternate);
+                check_silence(samples, count);
+                bool old_silent = float_is_silent(samples, count);
+                audio_chunk_features feat{};
+                audio_chunk_features_compute(samples, count, &feat);
+                test_check(old_silent == audio_chunk_is_silent(feat, count),
+                           "count %zu value %d: float loop and integer test disagree",
+                           count,
+                           value);
+            }
+        }
+    }
+
+    // Noise with an RMS close to the threshold - uniform noise in [-a, a] has an RMS of about a / sqrt(3), so amplitudes
+    // from 100 to 130 straddle the threshold. Count how often the float loop differed from the exact answer.
+    sizet trial_count{}, disagreement_count{};
+    for (sizet trial = 0; trial < 20000; ++trial) {
+        sizet count = (trial & 1) ? CHUNK_SAMPLE_COUNT : LENGTHS[test_rand(&rng) % (sizeof(LENGTHS) / sizeof(LENGTHS[0]))];
+        fill_noise(&rng, samples, count, test_rand_range(&rng, 100, 130));
+        disagreement_count += check_silence(samples, count);
+        ++trial_count;
+    }
+    ilog("float loop disagreed with the integer silence test on %zu of %zu chunks near the threshold (all within 1e-4 of it)",
+         disagreement_count,
+         trial_count);
+
+    // Cycles per chunk are roughly ns times the clock in GHz
+    fill_noise(&rng, samples, CHUNK_SAMPLE_COUNT, 3000);
+    audio_chunk_features feat{};
+    volatile bool sink{};
+    f64 features_ns = test_bench_ns(20, 20000, [&] {
+        audio_chunk_features_compute(samples, CHUNK_SAMPLE_COUNT, &feat);
+        sink = audio_chunk_is_silent(feat, CHUNK_SAMPLE_COUNT);
+    });
+    f64 float_ns = test_bench_ns(20, 20000, [&] { sink = float_is_silent(samples, CHUNK_SAMPLE_COUNT); });
+    ilog("%zu sample chunk: features kernel (%s) %.1f ns, old float rms loop %.1f ns",
+         CHUNK_SAMPLE_COUNT,
+         audio_dsp_isa_name(),
+         features_ns,
+         float_ns);
+    (void)sink;
+
+    return test_result("test_audio_dsp");
+}
@@ -0,0 +1,156 @@
+// Checks audio_fft_power against a direct DFT in double precision at every size from 4 to 2048 points - that covers the
+// radix 2 only transform, even and odd numbers of radix 4 passes, and the SIMD loops along with their scalar tails. This
+// file is built twice, once as is and once with AUDIO_DSP_FIXED_POINT, so the float and fixed point transforms are both
+// checked against the bounds given in audio_fft.h.
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+
+#include "audio_fft.h"
+#include "test_common.h"
+
+intern constexpr sizet MIN_FFT_SIZE = 4;
+intern constexpr sizet MAX_FFT_SIZE = 2048;
+intern constexpr sizet NOISE_SIGNAL_COUNT = 8;
+
+#if defined(AUDIO_DSP_FIXED_POINT)
+intern constexpr cstr FFT_BUILD_NAME = "fixed point";
+#else
+intern constexpr cstr FFT_BUILD_NAME = "float";
+// Peak input of the float signals - the bound below scales with the input so this only keeps the numbers readable
+intern constexpr f64 FLOAT_INPUT_PEAK = 32768.0;
+// Allowed bin magnitude error in units of eps * log2(size) * sqrt(size) * |x|, the usual bound on FFT rounding error
+intern constexpr f64 FLOAT_ERROR_FACTOR = 2.0;
+#endif
+
+// The largest magnitude an input sample can have
+intern f64 input_peak(const audio_fft *fft)
+{
+#if defined(AUDIO_DSP_FIXED_POINT)
+    return (f64)((1 << audio_fft_input_bits(fft)) - 1);
+#else
+    (void)fft;
+    return FLOAT_INPUT_PEAK;
+#endif
+}
+
+intern audio_fft_value to_input(f64 x)
+{
+#if defined(AUDIO_DSP_FIXED_POINT)
+    return (audio_fft_value)lround(x);
+#else
+    return (audio_fft_value)x;
+#endif
+}
+
+// Squared magnitude of every bin from DC to nyquist, from a table of the size roots of unity so the reference only has
+// the rounding of its sums
+intern void direct_dft_power(const audio_fft_value *in, sizet size, const f64 *cos_table, const f64 *sin_table, f64 *power)
+{
+    for (sizet k = 0; k <= size / 2; ++k) {
+        f64 re{}, im{};
+        for (sizet i = 0; i < size; ++i) {
+            sizet r = (k * i) % size;
+            re += (f64)in[i] * cos_table[r];
+            im -= (f64)in[i] * sin_table[r];
+        }
+        power[k] = re * re + im * im;
+    }
+}
+
+// Signal number s for a transform of size points peaking at peak: the edge cases first, then full scale noise
+intern const char *fill_signal(audio_fft_value *in, sizet size, sizet s, f64 peak, test_rng *rng)
+{
+    for (sizet i = 0; i < size; ++i) {
+        f64 x{};
+        switch (s) {
+            case 0: x = (i == 0) ? peak : 0.0; break;
+            case 1: x = (i == size / 2 + 1) ? -peak : 0.0; break;
+            case 2: x = peak; break;
+            case 3: x = (i & 1) ? -peak : peak; break;
+            case 4: x = peak * cos(2.0 * M_PI * (size / 4) * i / size); break;
+            case 5: x = peak * sin(2.0 * M_PI * 1.37 * i / size); break;
+            default: x = peak * (2.0 * test_rand(rng) / (f64)UINT32_MAX - 1.0); break;
+        }
+        in[i] = to_input(x);
+    }
+    static const char *names[] = {"impulse", "shifted impulse", "dc", "nyquist", "bin tone", "off bin tone"};
+    return (s < 6) ? names[s] : "noise";
+}
+
+intern void check_size(sizet size)
+{
+    audio_fft fft;
+    if (!audio_fft_init(&fft, size)) {
+        test_check(false, "could not init a %zu point transform", size);
+        return;
+    }
+    auto in = (audio_fft_value *)malloc(size * sizeof(audio_fft_value));
+    auto power = (audio_fft_power_value *)malloc((size / 2 + 1) * sizeof(audio_fft_power_value));
+    auto exact = (f64 *)malloc((size / 2 + 1) * sizeof(f64));
+    auto cos_table = (f64 *)malloc(size * sizeof(f64));
+    auto sin_table = (f64 *)malloc(size * sizeof(f64));
+    for (sizet i = 0; i < size; ++i) {
+        cos_table[i] = cos(2.0 * M_PI * i / size);
+        sin_table[i] = sin(2.0 * M_PI * i / size);
+    }
+
+    test_rng rng{size};
+    f64 peak = input_peak(&fft);
+    // Worst error over all the signals, as a fraction of the bound for that signal
+    f64 worst_ratio{};
+    for (sizet s = 0; s < 6 + NOISE_SIGNAL_COUNT; ++s) {
+        const char *name = fill_signal(in, size, s, peak, &rng);
+        audio_fft_power(&fft, in, power);
+        direct_dft_power(in, size, cos_table, sin_table, exact);
+
+#if defined(AUDIO_DSP_FIXED_POINT)
+        // Each bin's magnitude within size / 16 of exact, plus a half for the power having been rounded to an integer
+        f64 bound = size / 16.0 + 0.5;
+#else
+        f64 norm{};
+        for (sizet i = 0; i < size; ++i) {
+            norm += (f64)in[i] * in[i];
+        }
+        f64 bound = FLOAT_ERROR_FACTOR * FLT_EPSILON * log2((f64)size) * sqrt(size * norm);
+#endif
+        f64 signal_error{};
+        for (sizet k = 0; k <= size / 2; ++k) {
+#if defined(AUDIO_DSP_FIXED_POINT)
+            test_check(power[k] < (1ull << 60), "%zu points, %s: bin %zu power %lu is over 2^60", size, name, k, power[k]);
+#endif
+            f64 error = fabs(sqrt((f64)power[k]) - sqrt(exact[k]));
+            signal_error = fmax(signal_error, error);
+        }
+        test_check(signal_error <= bound,
+                   "%zu points, %s: bin magnitude off by %.3g, over the bound of %.3g",
+                   size,
+                   name,
+                   signal_error,
+                   bound);
+        worst_ratio = fmax(worst_ratio, signal_error / bound);
+    }
+
+    f64 fft_ns = test_bench_ns(5, (sizet)(1 << 20) / size, [&] { audio_fft_power(&fft, in, power); });
+    ilog("%s %4zu points: worst bin magnitude error %.1f%% of the bound, %.2f us per transform",
+         FFT_BUILD_NAME,
+         size,
+         100.0 * worst_ratio,
+         fft_ns / 1000.0);
+
+    audio_fft_terminate(&fft);
+    free(in);
+    free(power);
+    free(exact);
+    free(cos_table);
+    free(sin_table);
+}
+
+int main()
+{
+    for (sizet size = MIN_FFT_SIZE; size <= MAX_FFT_SIZE; size *= 2) {
+        check_size(size);
+    }
+    return test_result("test_audio_fft");
+}
@@ -0,0 +1,241 @@
+// Checks the polyphase resampler's output counts, passband gain, and stopband rejection at the capture rates we decimate
+// from, and compares it with miniaudio's linear resampler (what miniaudio converts with when we don't) on rejection and on
+// time per capture period
+#include <cmath>
+#include <cstring>
+#include <initializer_list>
+
+#include "miniaudio.h"
+#include "audio_resample.h"
+#include "test_common.h"
+
+// Long enough for a few hundred cycles of the lowest test tone after the filter settles
+intern constexpr sizet TONE_SAMPLE_COUNT = 48000;
+intern constexpr f64 TONE_AMPLITUDE = 16000.0;
+// Output samples skipped before measuring so the filter's startup transient is left out
+intern constexpr sizet SETTLE_SAMPLE_COUNT = 400;
+intern constexpr sizet CAPTURE_PERIOD_MS = 10;
+// A capture period at the highest input rate tested
+intern constexpr sizet AUDIO_BENCH_MAX_PERIOD = 48000 * CAPTURE_PERIOD_MS / 1000;
+
+intern void fill_tone(s16 *samples, sizet count, f64 freq, u32 rate)
+{
+    for (sizet i = 0; i < count; ++i) {
+        samples[i] = (s16)lround(TONE_AMPLITUDE * sin(2.0 * M_PI * freq * i / rate));
+    }
+}
+
+// Amplitude of the output at freq, found by correlating with a sine and cosine
+intern f64 tone_amplitude(const s16 *samples, sizet count, f64 freq, u32 rate)
+{
+    f64 re{}, im{};
+    for (sizet i = 0; i < count; ++i) {
+        re += samples[i] * cos(2.0 * M_PI * freq * i / rate);
+        im += samples[i] * sin(2.0 * M_PI * freq * i / rate);
+    }
+    return 2.0 * sqrt(re * re + im * im) / count;
+}
+
+// Peak amplitude the RMS of the output amounts to - for stopband tones this is whatever aliased through
+intern f64 rms_amplitude(const s16 *samples, sizet count)
+{
+    f64 sum{};
+    for (sizet i = 0; i < count; ++i) {
+        sum += (f64)samples[i] * samples[i];
+    }
+    return sqrt(2.0 * sum / count);
+}
+
+intern f64 db(f64 amplitude)
+{
+    return 20.0 * log10(fmax(amplitude, 1e-3) / TONE_AMPLITUDE);
+}
+
+// Resample in chunks of a capture period, like the callback does
+intern sizet resample_polyphase(audio_resampler *rs, const s16 *in, sizet in_count, s16 *out)
+{
+    sizet period = rs->in_rate * CAPTURE_PERIOD_MS / 1000;
+    sizet out_count{};
+    for (sizet i = 0; i < in_count; i += period) {
+        sizet count = (in_count - i < period) ? in_count - i : period;
+        out_count += audio_resample(rs, in + i, count, out + out_count);
+    }
+    return out_count;
+}
+
+intern sizet resample_linear(ma_linear_resampler *lr, u32 in_rate, const s16 *in, sizet in_count, s16 *out, sizet out_capacity)
+{
+    sizet period = in_rate * CAPTURE_PERIOD_MS / 1000;
+    sizet out_count{};
+    for (sizet i = 0; i < in_count; i += period) {
+        ma_uint64 frames_in = (in_count - i < period) ? in_count - i : period;
+        ma_uint64 frames_out = out_capacity - out_count;
+        ma_linear_resampler_process_pcm_frames(lr, in + i, &frames_in, out + out_count, &frames_out);
+        out_count += frames_out;
+    }
+    return out_count;
+}
+
+// Every output sample k sits at input position k * down / up, and is produced once that input sample arrives - so n
+// inputs make ceil(n * up / down) outputs however they're split up. Splits of every size have to give the same samples.
+intern void check_output_counts(u32 in_rate, u32 out_rate)
+{
+    test_rng rng{in_rate * 7ull + out_rate};
+    constexpr sizet INPUT_COUNT = 20011;
+    s16 *in = (s16 *)malloc(INPUT_COUNT * sizeof(s16));
+    s16 *whole = (s16 *)malloc(INPUT_COUNT * sizeof(s16));
+    s16 *split = (s16 *)malloc(INPUT_COUNT * sizeof(s16));
+    for (sizet i = 0; i < INPUT_COUNT; ++i) {
+        in[i] = (s16)test_rand_range(&rng, -20000, 20000);
+    }
+
+    audio_resampler rs{};
+    audio_resampler_init(&rs, in_rate, out_rate);
+    sizet whole_count = audio_resample(&rs, in, INPUT_COUNT, whole);
+    audio_resampler_terminate(&rs);
+
+    audio_resampler_init(&rs, in_rate, out_rate);
+    sizet split_count{};
+    for (sizet i = 0; i < INPUT_COUNT;) {
+        sizet count = test_rand_range(&rng, 0, 3000);
+        count = (count > INPUT_COUNT - i) ? INPUT_COUNT - i : count;
+        sizet out_count = audio_resample(&rs, in + i, count, split + split_count);
+        test_check(out_count <= audio_resample_max_output(&rs, count),
+                   "%u -> %u: %zu inputs made %zu outputs, over the maximum of %zu",
+                   in_rate,
+                   out_rate,
+                   count,
+                   out_count,
+                   audio_resample_max_output(&rs, count));
+        split_count += out_count;
+        i += count;
+    }
+
+    sizet expected = (INPUT_COUNT * rs.up + rs.down - 1) / rs.down;
+    test_check(whole_count == expected,
+               "%u -> %u: %zu outputs from %zu inputs, expected %zu",
+               in_rate,
+               out_rate,
+               whole_count,
+               INPUT_COUNT,
+               expected);
+    test_check(split_count == whole_count,
+               "%u -> %u: %zu outputs when split up against %zu in one go",
+               in_rate,
+               out_rate,
+               split_count,
+               whole_count);
+    test_check(memcmp(whole, split, whole_count * sizeof(s16)) == 0,
+               "%u -> %u: output depends on how the input was split",
+               in_rate,
+               out_rate);
+    audio_resampler_terminate(&rs);
+    free(in);
+    free(whole);
+    free(split);
+}
+
+struct response
+{
+    // Worst passband gain error in dB, and worst stopband level (most aliasing) in dB
+    f64 passband_db;
+    f64 stopband_db;
+};
+
+// Passband tones go up to 0.8 of the output nyquist, and stopband tones run from 1.1 of it up to the input nyquist - what
+// gets through of those lands in the output band as aliases
+template<class F>
+intern response measure_response(u32 in_rate, u32 out_rate, F resample)
+{
+    s16 *in = (s16 *)malloc(TONE_SAMPLE_COUNT * sizeof(s16));
+    s16 *out = (s16 *)malloc(TONE_SAMPLE_COUNT * sizeof(s16));
+    f64 nyquist = out_rate / 2.0;
+    response resp{0.0, -200.0};
+    for (f64 f = 100.0; f <= 0.8 * nyquist; f += 0.05 * nyquist) {
+        fill_tone(in, TONE_SAMPLE_COUNT, f, in_rate);
+        sizet count = resample(in, TONE_SAMPLE_COUNT, out);
+        f64 gain_db = db(tone_amplitude(out + SETTLE_SAMPLE_COUNT, count - SETTLE_SAMPLE_COUNT, f, out_rate));
+        resp.passband_db = (fabs(gain_db) > fabs(resp.passband_db)) ? gain_db : resp.passband_db;
+    }
+    for (f64 f = 1.1 * nyquist; f < in_rate / 2.0; f += 0.05 * nyquist) {
+        fill_tone(in, TONE_SAMPLE_COUNT, f, in_rate);
+        sizet count = resample(in, TONE_SAMPLE_COUNT, out);
+        f64 level_db = db(rms_amplitude(out + SETTLE_SAMPLE_COUNT, count - SETTLE_SAMPLE_COUNT));
+        resp.stopband_db = (level_db > resp.stopband_db) ? level_db : resp.stopband_db;
+    }
+    free(in);
+    free(out);
+    return resp;
+}
+
+intern void check_rate(u32 in_rate, u32 out_rate)
+{
+    check_output_counts(in_rate, out_rate);
+
+    auto poly = measure_response(in_rate, out_rate, [&](const s16 *in, sizet count, s16 *out) {
+        audio_resampler rs{};
+        audio_resampler_init(&rs, in_rate, out_rate);
+        sizet out_count = resample_polyphase(&rs, in, count, out);
+        audio_resampler_terminate(&rs);
+        return out_count;
+    });
+    auto linear = measure_response(in_rate, out_rate, [&](const s16 *in, sizet count, s16 *out) {
+        auto cfg = ma_linear_resampler_config_init(ma_format_s16, 1, in_rate, out_rate);
+        ma_linear_resampler lr;
+        ma_linear_resampler_init(&cfg, nullptr, &lr);
+        sizet out_count = resample_linear(&lr, in_rate, in, count, out, TONE_SAMPLE_COUNT);
+        ma_linear_resampler_uninit(&lr, nullptr);
+        return out_count;
+    });
+
+    // Kaiser beta 8 is designed for about 80 dB - Q15 taps leave a floor around 70 dB, which the worst rates sit just under
+    test_check(fabs(poly.passband_db) < 0.1, "%u -> %u: passband gain off by %.3f dB", in_rate, out_rate, poly.passband_db);
+    test_check(poly.stopband_db < -65.0, "%u -> %u: stopband only %.1f dB down", in_rate, out_rate, poly.stopband_db);
+
+    // Time per capture period - each loop resamples a period of noise
+    sizet period = in_rate * CAPTURE_PERIOD_MS / 1000;
+    test_rng rng{in_rate};
+    s16 in[AUDIO_BENCH_MAX_PERIOD]{};
+    s16 out[AUDIO_BENCH_MAX_PERIOD]{};
+    for (sizet i = 0; i < period; ++i) {
+        in[i] = (s16)test_rand_range(&rng, -8000, 8000);
+    }
+    audio_resampler rs{};
+    audio_resampler_init(&rs, in_rate, out_rate);
+    f64 poly_ns = test_bench_ns(10, 2000, [&] { audio_resample(&rs, in, period, out); });
+    audio_resampler_terminate(&rs);
+    auto cfg = ma_linear_resampler_config_init(ma_format_s16, 1, in_rate, out_rate);
+    ma_linear_resampler lr;
+    ma_linear_resampler_init(&cfg, nullptr, &lr);
+    f64 linear_ns = test_bench_ns(10, 2000, [&] {
+        ma_uint64 frames_in = period;
+        ma_uint64 frames_out = AUDIO_BENCH_MAX_PERIOD;
+        ma_linear_resampler_process_pcm_frames(&lr, in, &frames_in, out, &frames_out);
+    });
+    ma_linear_resampler_uninit(&lr, nullptr);
+
+    ilog("%u -> %u: polyphase passband %+.3f dB stopband %.1f dB, %.2f us per %zu ms period (%.3f%% of it) - linear passband "
+         "%+.3f dB stopband %.1f dB, %.2f us per period",
+         in_rate,
+         out_rate,
+         poly.passband_db,
+         poly.stopband_db,
+         poly_ns / 1000.0,
+         CAPTURE_PERIOD_MS,
+         poly_ns / (CAPTURE_PERIOD_MS * 10000.0),
+         linear.passband_db,
+         linear.stopband_db,
+         linear_ns / 1000.0);
+}
+
+int main()
+{
+    // Codecs commonly run at 48 or 44.1 kHz, decimated to the wideband and narrowband pipeline rates
+    for (u32 out_rate : {16000u, 8000u}) {
+        for (u32 in_rate : {48000u, 44100u, 32000u}) {
+            check_rate(in_rate, out_rate);
+        }
+    }
+    check_rate(16000, 8000);
+    return test_result("test_audio_resample");
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include <atomic>
+
+#include "basic_types.h"
+#include "logging.h"
+#include "utils.h"
+
+// Failed checks are logged and counted rather than stopping the test, so one run shows all of them. Threaded tests check
+// from more than one thread.
+inline std::atomic<int> test_failure_count{};
+
+#define test_check(cond, ...) ((cond) ? (void)0 : (elog(__VA_ARGS__), (void)++test_failure_count))
+
+// Exit code for main - ctest fails the test on anything but zero
+inline int test_result(const char *name)
+{
+    if (test_failure_count) {
+        elog("%s: %d checks failed", name, test_failure_count.load());
+        return 1;
+    }
+    ilog("%s: all checks passed", name);
+    return 0;
+}
+
+// Small deterministic generator so runs are repeatable
+struct test_rng
+{
+    u64 state;
+};
+
+inline u32 test_rand(test_rng *rng)
+{
+    rng->state = rng->state * 6364136223846793005ull + 1442695040888963407ull;
+    return (u32)(rng->state >> 33);
+}
+
+// Uniform in [lo, hi]
+inline s32 test_rand_range(test_rng *rng, s32 lo, s32 hi)
+{
+    return lo + (s32)(test_rand(rng) % (u32)(hi - lo + 1));
+}
+
+// Best time in ns per call of fn over rounds of iterations calls - the minimum filters out preemption on a busy host
+template<class F>
+f64 test_bench_ns(sizet rounds, sizet iterations, F fn)
+{
+    f64 best{};
+    for (sizet r = 0; r < rounds; ++r) {
+        u64 start = monotonic_time_ns();
+        for (sizet i = 0; i < iterations; ++i) {
+            fn();
+        }
+        f64 ns = (f64)(monotonic_time_ns() - start) / iterations;
+        best = (r == 0 || ns < best) ? ns : best;
+    }
+    return best;
+}
@@ -0,0 +1,175 @@
+// Producer/consumer stress check for spsc_ring - a producer thread writes sequence numbered elements in random sized
+// batches, publishing several writes at a time, and the consumer peeks and consumes random sized spans checking every
+// element is the next in sequence. Small rings make the positions wrap thousands of times. Each ring is run mirrored (as
+// allocated) and through the two span views the malloc fallback uses.
+#include <pthread.h>
+
+#include "spsc_ring.h"
+#include "test_common.h"
+
+// Elements sent per run
+intern constexpr u64 ELEMENT_COUNT = 4 * 1024 * 1024;
+
+intern void seq_fill(u32 *elem, u64 seq)
+{
+    *elem = (u32)seq;
+}
+
+intern bool seq_matches(const u32 &elem, u64 seq)
+{
+    return elem == (u32)seq;
+}
+
+// Same size as audio_event - 56 bytes doesn't divide a page, so the allocation has to be rounded to a multiple of both
+// for the mirror to line up
+struct event_elem
+{
+    u64 seq;
+    u64 check[6];
+};
+
+intern void seq_fill(event_elem *elem, u64 seq)
+{
+    elem->seq = seq;
+    for (sizet i = 0; i < 6; ++i) {
+        elem->check[i] = seq * (i + 3);
+    }
+}
+
+intern bool seq_matches(const event_elem &elem, u64 seq)
+{
+    bool match = elem.seq == seq;
+    for (sizet i = 0; i < 6; ++i) {
+        match = match && elem.check[i] == seq * (i + 3);
+    }
+    return match;
+}
+
+template<class T>
+struct stress_ctxt
+{
+    spsc_ring<T> ring;
+    // Largest batch either side moves at once
+    sizet max_batch;
+    u64 seed;
+};
+
+template<class T>
+intern void *stress_producer(void *arg)
+{
+    auto ctxt = (stress_ctxt<T> *)arg;
+    test_rng rng{ctxt->seed};
+    T *batch = (T *)malloc(ctxt->max_batch * sizeof(T));
+    u64 seq{};
+    while (seq < ELEMENT_COUNT) {
+        sizet count = test_rand_range(&rng, 1, (s32)ctxt->max_batch);
+        count = (count > ELEMENT_COUNT - seq) ? (sizet)(ELEMENT_COUNT - seq) : count;
+        for (sizet i = 0; i < count; ++i) {
+            seq_fill(&batch[i], seq + i);
+        }
+
+        // Wait for space for the whole batch on top of anything still pending, like the file decoder does
+        spsc_ring_wait_space(&ctxt->ring, count);
+        sizet written = spsc_ring_write(&ctxt->ring, batch, count);
+        test_check(written == count, "producer wrote %zu of %zu elements after waiting for space", written, count);
+        seq += written;
+
+        // Hold back about a third of the batches so the consumer sees several writes land in one publish
+        if (test_rand(&rng) % 3 != 0 || seq == ELEMENT_COUNT || spsc_ring_write_space(&ctxt->ring) < ctxt->max_batch) {
+            spsc_ring_publish(&ctxt->ring);
+        }
+    }
+    free(batch);
+    return nullptr;
+}
+
+template<class T>
+intern void stress_consume(stress_ctxt<T> *ctxt)
+{
+    test_rng rng{ctxt->seed ^ 0xc0ffee};
+    u64 seq{};
+    sizet bad_count{};
+    while (seq < ELEMENT_COUNT) {
+        sizet available = spsc_ring_available(&ctxt->ring);
+        if (available == 0) {
+            available = spsc_ring_wait(&ctxt->ring);
+        }
+        sizet count = test_rand_range(&rng, 1, (s32)ctxt->max_batch);
+        count = (count > available) ? available : count;
+
+        auto view = spsc_ring_peek(&ctxt->ring, count);
+        test_check(ring_view_count(view) == count, "peeked %zu elements but the view holds %zu", count, ring_view_count(view));
+        test_check(!ctxt->ring.mirrored || view.tail_count == 0, "mirrored ring view wrapped at %lu", seq);
+        for (sizet i = 0; i < count; ++i) {
+            const T &elem = (i < view.head_count) ? view.head[i] : view.tail[i - view.head_count];
+            if (!seq_matches(elem, seq + i) && bad_count++ < 10) {
+                test_check(false, "element %lu out of sequence", seq + i);
+            }
+        }
+
+        // Alternate between the two ways of giving elements back
+        if (test_rand(&rng) & 1) {
+            spsc_ring_consume(&ctxt->ring, count);
+        }
+        else {
+            spsc_ring_consume_to(&ctxt->ring, seq + count);
+        }
+        seq += count;
+    }
+    test_check(bad_count == 0, "%zu elements out of sequence", bad_count);
+}
+
+template<class T>
+intern void stress_run(stress_ctxt<T> *ctxt, const char *name)
+{
+    pthread_t producer;
+    u64 start = monotonic_time_ns();
+    pthread_create(&producer, nullptr, stress_producer<T>, ctxt);
+    stress_consume(ctxt);
+    pthread_join(producer, nullptr);
+    f64 ms = (f64)(monotonic_time_ns() - start) / 1e6;
+    ilog("%s: %lu elements through a ring of %zu (%s) in batches up to %zu in %.1f ms - wrapped %lu times",
+         name,
+         ELEMENT_COUNT,
+         ctxt->ring.capacity,
+         ctxt->ring.mirrored ? "mirrored" : "split views",
+         ctxt->max_batch,
+         ms,
+         ELEMENT_COUNT / ctxt->ring.capacity);
+}
+
+template<class T>
+intern void stress_ring(sizet capacity, sizet max_batch, const char *name)
+{
+    stress_ctxt<T> ctxt{};
+    ctxt.max_batch = max_batch;
+    ctxt.seed = capacity * 31 + max_batch;
+    if (!spsc_ring_init(&ctxt.ring, capacity)) {
+        test_check(false, "%s: could not allocate a ring of %zu", name, capacity);
+        return;
+    }
+    test_check(ctxt.ring.capacity >= capacity, "%s: asked for %zu elements and got %zu", name, capacity, ctxt.ring.capacity);
+    stress_run(&ctxt, name);
+    spsc_ring_terminate(&ctxt.ring);
+
+    // Same again on a plain malloc buffer, which is what rings get when memfd isn't available - wrapping reads and writes
+    // then go through the tail span. The odd capacity makes the wrap point move around.
+    stress_ctxt<T> split{};
+    split.max_batch = max_batch;
+    split.seed = ctxt.seed + 1;
+    split.ring.capacity = capacity + 3;
+    split.ring.buffer = (T *)malloc(split.ring.capacity * sizeof(T));
+    split.ring.mirrored = false;
+    stress_run(&split, name);
+    spsc_ring_terminate(&split.ring);
+}
+
+int main()
+{
+    // Batches up to the whole ring, and small batches that leave lots of elements in flight
+    stress_ring<u32>(1024, 1024, "u32 full batches");
+    stress_ring<u32>(1024, 37, "u32 small batches");
+    stress_ring<u32>(16 * 1024, 320, "u32 audio frames");
+    stress_ring<event_elem>(256, 64, "56 byte events");
+    return test_result("test_spsc_ring");
+}